@@ -27,7 +27,7 @@ function handle_flag(){
 
 function runit() {
     cd "$ROOTDIR"
-    prog=build/$RELEASETYPE/infectsim
+    prog=build/$RELEASETYPE/infectsim$HEADLESS
     if [ $RELEASETYPE = debug ] ; then
         gdb -silent -ex=r -ex=q --args $prog $args 
     elif true || handle_flag "-C" || handle_flag "--color" ; then
@@ -42,6 +42,12 @@ if handle_flag "--record" ; then
     RECORD=1 
 fi
 
+# No SDL and no perf timers (see src/CMakeLists.txt)
+HEADLESS=""
+if handle_flag "--headless" ; then
+    HEADLESS="-headless"
+fi
+
 
 if handle_flag "--debug" || handle_flag "--gdb" || handle_flag "-g" ; then
     RELEASETYPE='debug'
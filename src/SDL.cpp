@@ -1,6 +1,4 @@
 #include <cstdlib>
-#include "SDL/SDL.h"
-#include "SDL/SDL_ttf.h"
 #include <string>
 #include <sstream>
 #include <map>
@@ -8,6 +6,11 @@
 
 #include "sdl.h"
 
+#ifndef INFECTSIM_HEADLESS
+
+#include "SDL/SDL.h"
+#include "SDL/SDL_ttf.h"
+
 using namespace std;
 
 static TTF_Font *font;
@@ -96,4 +99,26 @@ void sdl_postdraw(const std::string& filebase) {
 	}
 	SDL_Flip(screen);
 }
+#else
+
+// The headless build draws nothing, and never links SDL
+void sdl_init(int width, int height, int vwidth, int vheight) {
+}
+void sdl_draw_text(const std::string& text, int x, int y) {
+}
+void sdl_fill_pixel(int x, int y, unsigned int colour) {
+}
+void sdl_fill_rect(int x, int y, int w, int h, unsigned int colour) {
+}
+void sdl_delay(int ms) {
+}
+void sdl_predraw() {
+}
+void sdl_copybuffer() {
+}
+void sdl_postdraw(const std::string& filebase) {
+}
+
+#endif
+
 #include <iostream>
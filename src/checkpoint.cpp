@@ -0,0 +1,75 @@
+#include <cstdio>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "checkpoint.h"
+
+using namespace std;
+
+Checkpointer::Checkpointer(const string& filename, double interval_seconds, bool compressed) :
+		filename(filename), interval_seconds(interval_seconds), compressed(compressed) {
+}
+
+Checkpointer::~Checkpointer() {
+	wait();
+}
+
+bool Checkpointer::due() {
+	if (!enabled()) {
+		return false;
+	}
+	reap(false);
+	return child < 0 && timer.get_microseconds() / 1e6 - last_checkpoint >= interval_seconds;
+}
+
+void Checkpointer::write(const function<void(DataWriter&)>& write) {
+	wait();
+	Timer fork_timer;
+	// Flush first, or the child would carry a copy of anything buffered:
+	fflush(stdout);
+	pid_t pid = fork();
+	if (pid == 0) {
+		int status = 0;
+		try {
+			string tmp_filename = filename + ".tmp";
+			DataWriter writer(tmp_filename, true, false, compressed);
+			write(writer);
+			writer.close();
+			status = (rename(tmp_filename.c_str(), filename.c_str()) == 0) ? 0 : 1;
+		} catch (...) {
+			status = 1;
+		}
+		// Skips atexit handlers and stdio buffers, which belong to the parent
+		_exit(status);
+	}
+	fork_ms = fork_timer.get_microseconds() / 1000.0;
+	last_checkpoint = timer.get_microseconds() / 1e6;
+	if (pid < 0) {
+		printf("Could not fork to write checkpoint '%s'\n", filename.c_str());
+		return;
+	}
+	child = pid;
+}
+
+void Checkpointer::wait() {
+	reap(true);
+}
+
+void Checkpointer::reap(bool block) {
+	if (child < 0) {
+		return;
+	}
+	int status = 0;
+	pid_t pid = waitpid(child, &status, block ? 0 : WNOHANG);
+	if (pid == 0) {
+		return; // Still writing
+	}
+	child = -1;
+	if (pid > 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+		n_written++;
+		printf("Wrote checkpoint %d to '%s' (fork paused the simulation %.3fms)\n", n_written, filename.c_str(), fork_ms);
+	} else {
+		printf("Failed to write checkpoint '%s'\n", filename.c_str());
+	}
+}
@@ -0,0 +1,52 @@
+#ifndef CHECKPOINT_H_
+#define CHECKPOINT_H_
+
+#include <functional>
+#include <string>
+
+#include <sys/types.h>
+
+#include "libs/DataReadWrite.h"
+#include "libs/Timer.h"
+
+/*
+ * Periodic checkpoints of a running simulation, written without stopping it: the process
+ * forks, and the child writes its copy-on-write image of the state while the parent carries
+ * on. The parent only pays for the fork and for copying the pages it writes to meanwhile.
+ *
+ * Each checkpoint goes to a temporary file, renamed over the previous one once durable,
+ * so a crash at any point leaves the last complete checkpoint in place.
+ */
+class Checkpointer {
+public:
+	// An empty filename disables checkpoints. If 'compressed', checkpoints are LZ-compressed.
+	Checkpointer(const std::string& filename, double interval_seconds, bool compressed = false);
+	// Waits for a checkpoint still being written
+	~Checkpointer();
+
+	bool enabled() const {
+		return !filename.empty();
+	}
+	// True once the interval has passed since the last checkpoint, unless one is still being written
+	bool due();
+	// Forks, and has the child call write() on a DataWriter for the checkpoint file
+	void write(const std::function<void(DataWriter&)>& write);
+	// Waits for the checkpoint being written, if any, reporting whether it succeeded
+	void wait();
+
+private:
+	// Reaps the child if it has exited (or once it does, if 'block')
+	void reap(bool block);
+
+	std::string filename;
+	double interval_seconds;
+	bool compressed;
+	Timer timer;
+	double last_checkpoint = 0;
+	pid_t child = -1;
+	int n_written = 0;
+	// Time the simulation was paused by the last fork
+	double fork_ms = 0;
+};
+
+#endif /* CHECKPOINT_H_ */
@@ -0,0 +1,298 @@
+#include <algorithm>
+#include <cstring>
+#include <utility>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_SSSE3_DECODE
+#endif
+
+#include "libs/perf_timer.h"
+#include "libs/ThreadPool.h"
+
+#include "compressed_graph.h"
+
+using namespace std;
+
+// Entities per compression work unit:
+static const size_t BLOCK = 4096;
+
+static inline void put_varint(vector<uint8_t>& out, uint64_t v) {
+	while (v >= 128) {
+		out.push_back((uint8_t)(v | 128));
+		v >>= 7;
+	}
+	out.push_back((uint8_t)v);
+}
+
+static inline const uint8_t* get_varint(const uint8_t* p, uint64_t& v) {
+	v = 0;
+	for (int shift = 0;; shift += 7) {
+		uint8_t b = *p++;
+		v |= (uint64_t)(b & 127) << shift;
+		if (b < 128) {
+			return p;
+		}
+	}
+}
+
+static inline uint32_t zigzag(int64_t v) {
+	return (uint32_t)((v << 1) ^ (v >> 63));
+}
+static inline int64_t unzigzag(uint32_t v) {
+	return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+/*****************************************************************************
+ * Stream-VByte
+ *****************************************************************************/
+
+// Per control byte: the pshufb mask that spreads its four values' bytes to 32-bit lanes,
+// and the number of data bytes it covers
+struct SvbTables {
+	uint8_t shuffle[256][16];
+	uint8_t length[256];
+	SvbTables() {
+		for (int c = 0; c < 256; c++) {
+			int offset = 0;
+			for (int s = 0; s < 4; s++) {
+				int len = ((c >> (2 * s)) & 3) + 1;
+				for (int b = 0; b < 4; b++) {
+					shuffle[c][4 * s + b] = (b < len) ? offset + b : 0xFF;
+				}
+				offset += len;
+			}
+			length[c] = offset;
+		}
+	}
+};
+static const SvbTables svb_tables;
+
+static void svb_encode(const vector<uint32_t>& values, vector<uint8_t>& out) {
+	size_t control = out.size();
+	out.resize(out.size() + (values.size() + 3) / 4, 0);
+	for (size_t k = 0; k < values.size(); k++) {
+		uint32_t v = values[k];
+		int len = (v < (1u << 8)) ? 1 : (v < (1u << 16)) ? 2 : (v < (1u << 24)) ? 3 : 4;
+		out[control + k / 4] |= (len - 1) << (2 * (k % 4));
+		for (int b = 0; b < len; b++) {
+			out.push_back((uint8_t)(v >> (8 * b)));
+		}
+	}
+}
+
+static void svb_decode_scalar(const uint8_t* control, const uint8_t* data, size_t start, size_t n, uint32_t* out) {
+	for (size_t k = start; k < n; k++) {
+		int len = ((control[k / 4] >> (2 * (k % 4))) & 3) + 1;
+		uint32_t v = 0;
+		for (int b = 0; b < len; b++) {
+			v |= (uint32_t)data[b] << (8 * b);
+		}
+		out[k] = v;
+		data += len;
+	}
+}
+
+#ifdef HAVE_SSSE3_DECODE
+// Reads up to 16 bytes past the last value, covered by the padding at the end of 'bytes'
+__attribute__((target("ssse3")))
+static void svb_decode_ssse3(const uint8_t* control, const uint8_t* data, size_t, size_t n, uint32_t* out) {
+	size_t k = 0;
+	for (; k + 4 <= n; k += 4) {
+		uint8_t c = control[k / 4];
+		__m128i in = _mm_loadu_si128((const __m128i*)data);
+		__m128i mask = _mm_loadu_si128((const __m128i*)svb_tables.shuffle[c]);
+		_mm_storeu_si128((__m128i*)(out + k), _mm_shuffle_epi8(in, mask));
+		data += svb_tables.length[c];
+	}
+	svb_decode_scalar(control, data, k, n, out);
+}
+#endif
+
+typedef void (*svb_decoder)(const uint8_t*, const uint8_t*, size_t, size_t, uint32_t*);
+
+static svb_decoder pick_decoder() {
+#ifdef HAVE_SSSE3_DECODE
+	if (__builtin_cpu_supports("ssse3")) {
+		return svb_decode_ssse3;
+	}
+#endif
+	return svb_decode_scalar;
+}
+static const svb_decoder svb_decode = pick_decoder();
+
+/*****************************************************************************
+ * CompressedGraph
+ *****************************************************************************/
+
+// Appends the record of entity 'i' of 'g'
+static void encode_entity(const Graph& g, size_t i, int prob_bits, vector<uint8_t>& out,
+		vector<pair<int, entity_id>>& edges, vector<uint32_t>& values) {
+	const int q_max = (1 << prob_bits) - 1;
+	edges.clear();
+	for (size_t e = g.offsets[i]; e < g.offsets[i + 1]; e++) {
+		int q = (int)(g.probs[e] * q_max + 0.5);
+		q = std::max(0, std::min(q_max, q));
+		// Negated, so that probabilities sort descending and targets ascending:
+		edges.push_back({-q, g.targets[e]});
+	}
+	sort(edges.begin(), edges.end());
+	size_t n_groups = 0;
+	for (size_t k = 0; k < edges.size(); k++) {
+		n_groups += (k == 0 || edges[k].first != edges[k - 1].first);
+	}
+
+	put_varint(out, edges.size());
+	put_varint(out, n_groups);
+	values.clear();
+	for (size_t k = 0; k < edges.size();) {
+		size_t end = k;
+		while (end < edges.size() && edges[end].first == edges[k].first) {
+			end++;
+		}
+		int q = -edges[k].first;
+		out.push_back((uint8_t)q);
+		if (prob_bits > 8) {
+			out.push_back((uint8_t)(q >> 8));
+		}
+		put_varint(out, end - k);
+		values.push_back(zigzag((int64_t)edges[k].second - (int64_t)i));
+		for (size_t j = k + 1; j < end; j++) {
+			values.push_back(edges[j].second - edges[j - 1].second);
+		}
+		k = end;
+	}
+	svb_encode(values, out);
+}
+
+CompressedGraph CompressedGraph::compress(const Graph& g, int prob_bits, int n_threads) {
+	PERF_TIMER();
+	ASSERT(prob_bits == 8 || prob_bits == 16, "Probabilities are quantized to 8 or 16 bits!");
+	CompressedGraph c;
+	c.prob_bits = prob_bits;
+	c.edge_count = g.n_edges();
+	c.original_ids = g.original_ids;
+	size_t n = g.size(), n_blocks = (n + BLOCK - 1) / BLOCK;
+	c.offsets.resize(n + 1);
+	// Blocks are encoded independently, with block-relative offsets, then concatenated
+	vector<vector<uint8_t>> block_bytes(n_blocks);
+	ThreadPool pool(n_threads);
+	pool.parallel_for(n_blocks, 1, [&](int, size_t begin, size_t end) {
+		vector<pair<int, entity_id>> edges;
+		vector<uint32_t> values;
+		for (size_t b = begin; b < end; b++) {
+			vector<uint8_t>& out = block_bytes[b];
+			for (size_t i = b * BLOCK; i < std::min(n, (b + 1) * BLOCK); i++) {
+				c.offsets[i] = out.size();
+				encode_entity(g, i, prob_bits, out, edges, values);
+			}
+		}
+	});
+	uint64_t base = 0;
+	for (size_t b = 0; b < n_blocks; b++) {
+		for (size_t i = b * BLOCK; i < std::min(n, (b + 1) * BLOCK); i++) {
+			c.offsets[i] += base;
+		}
+		base += block_bytes[b].size();
+	}
+	c.offsets[n] = base;
+	// Padding for the 16-byte loads of the SSSE3 decoder:
+	c.bytes.reserve(base + 16);
+	for (vector<uint8_t>& out : block_bytes) {
+		c.bytes.insert(c.bytes.end(), out.begin(), out.end());
+		vector<uint8_t>().swap(out);
+	}
+	c.bytes.resize(base + 16, 0);
+	return c;
+}
+
+size_t CompressedGraph::degree(size_t i) const {
+	uint64_t degree;
+	get_varint(bytes.data() + offsets[i], degree);
+	return degree;
+}
+
+size_t CompressedGraph::decode(size_t i, entity_id* targets, float* probs) const {
+	const uint8_t* p = bytes.data() + offsets[i];
+	uint64_t degree, n_groups, count;
+	p = get_varint(p, degree);
+	p = get_varint(p, n_groups);
+	const uint8_t* groups = p;
+	const int prob_bytes = prob_bits / 8;
+	for (uint64_t k = 0; k < n_groups; k++) {
+		p = get_varint(p + prob_bytes, count);
+	}
+	// Raw values first, in place, then undo the delta coding group by group:
+	uint32_t* values = (uint32_t*)targets;
+	svb_decode(p, p + (degree + 3) / 4, 0, degree, values);
+	const float scale = 1.0f / ((1 << prob_bits) - 1);
+	p = groups;
+	size_t k = 0;
+	for (uint64_t grp = 0; grp < n_groups; grp++) {
+		int q = p[0] | (prob_bytes > 1 ? p[1] << 8 : 0);
+		p = get_varint(p + prob_bytes, count);
+		float prob = q * scale;
+		int64_t target = (int64_t)i + unzigzag(values[k]);
+		targets[k] = (entity_id)target, probs[k] = prob;
+		for (size_t end = k + count, j = k + 1; j < end; j++) {
+			target += values[j];
+			targets[j] = (entity_id)target, probs[j] = prob;
+		}
+		k += count;
+	}
+	return degree;
+}
+
+Node CompressedGraph::operator[](size_t i) const {
+	static thread_local vector<entity_id> targets;
+	static thread_local vector<float> probs;
+	size_t n = degree(i);
+	if (targets.size() < n) {
+		targets.resize(n), probs.resize(n);
+	}
+	decode(i, targets.data(), probs.data());
+	return Node {targets.data(), probs.data(), n};
+}
+
+Graph CompressedGraph::decompress() const {
+	Graph g;
+	size_t n = size();
+	g.offsets.resize(n + 1);
+	g.offsets[0] = 0;
+	for (size_t i = 0; i < n; i++) {
+		g.offsets[i + 1] = g.offsets[i] + degree(i);
+	}
+	g.targets.resize(g.offsets[n]);
+	g.probs.resize(g.offsets[n]);
+	for (size_t i = 0; i < n; i++) {
+		decode(i, g.targets.data() + g.offsets[i], g.probs.data() + g.offsets[i]);
+	}
+	g.original_ids = original_ids;
+	return g;
+}
+
+void report_compression(const CompressedGraph& g) {
+	size_t n = g.size(), n_edges = std::max<size_t>(1, g.n_edges());
+	double csr_bytes = (n + 1) * sizeof(size_t) + g.n_edges() * (sizeof(entity_id) + sizeof(float));
+	printf("Compressed %zu edges to %.2f bytes/edge, %.1f%% of CSR (%d-bit probabilities)\n",
+			g.n_edges(), g.memory_size() / double(n_edges), 100 * g.memory_size() / csr_bytes, g.prob_bits);
+
+	// Sequential scan, as during alias construction:
+	vector<entity_id> targets;
+	vector<float> probs;
+	Timer timer;
+	uint64_t checksum = 0;
+	for (size_t i = 0; i < n; i++) {
+		size_t degree = g.degree(i);
+		if (targets.size() < degree) {
+			targets.resize(degree), probs.resize(degree);
+		}
+		g.decode(i, targets.data(), probs.data());
+		for (size_t k = 0; k < degree; k++) {
+			checksum += targets[k];
+		}
+	}
+	double seconds = std::max(1e-9, timer.get_microseconds() / 1e6);
+	printf("Decoded %zu edges in %.3fs (%.1fM edges/s, checksum %llu)\n",
+			g.n_edges(), seconds, g.n_edges() / 1e6 / seconds, (unsigned long long)checksum);
+}
@@ -0,0 +1,71 @@
+#ifndef COMPRESSED_GRAPH_H_
+#define COMPRESSED_GRAPH_H_
+
+#include <vector>
+
+#include "libs/int_types.h"
+
+#include "config.h"
+#include "graph.h"
+
+/*
+ * Compressed adjacency for graphs too big for the 8 bytes per edge of Graph.
+ *
+ * Probabilities are quantized to 8 or 16 bits, and each entity's edges are grouped by
+ * quantized probability, in descending order (as StateAlt requires). Within a group the
+ * targets are sorted: the first is stored relative to the entity's own id (zigzag encoded,
+ * small after reordering), the rest as gaps to the previous target.
+ * The values are stream-VByte encoded: 2-bit length codes packed four to a control byte,
+ * followed by the 1-4 data bytes of each value, which SSSE3 decodes four at a time with
+ * one shuffle.
+ *
+ * Entity i's record starts at bytes[offsets[i]]:
+ *   varint degree, varint n_groups, n_groups * (quantized prob, varint count),
+ *   ceil(degree / 4) control bytes, data bytes
+ *
+ * operator[] decodes into a per-thread buffer and returns the same Node view as Graph,
+ * so engines run on it unchanged. The view is only valid until the next call on that thread.
+ */
+struct CompressedGraph {
+	std::vector<uint64_t> offsets;
+	std::vector<uint8_t> bytes;
+	// 8 or 16
+	int prob_bits = 8;
+	std::vector<int64_t> original_ids;
+
+	CompressedGraph() {
+	}
+	static CompressedGraph compress(const Graph& g, int prob_bits, int n_threads = 0);
+	Graph decompress() const;
+
+	size_t size() const {
+		return offsets.empty() ? 0 : offsets.size() - 1;
+	}
+	size_t n_edges() const {
+		return edge_count;
+	}
+	// Total memory used, in bytes
+	size_t memory_size() const {
+		return offsets.size() * sizeof(uint64_t) + bytes.size();
+	}
+	// Decodes the out-edges of 'i' into 'targets' and 'probs', returning the degree.
+	size_t decode(size_t i, entity_id* targets, float* probs) const;
+	size_t degree(size_t i) const;
+	Node operator[](size_t i) const;
+
+	// Already sorted, see above
+	void sort_by_prob() {
+	}
+
+	READ_WRITE(rw) {
+		rw << prob_bits << edge_count;
+		rw << offsets << bytes << original_ids;
+	}
+private:
+	size_t edge_count = 0;
+};
+
+// Prints bytes/edge against the CSR Graph, and the sequential decode throughput
+void report_compression(const CompressedGraph& g);
+
+#endif /* COMPRESSED_GRAPH_H_ */
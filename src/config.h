@@ -5,6 +5,8 @@
 #ifndef CONFIG_H_
 #define CONFIG_H_
 
+#include <string>
+
 #include "discrete_fixedtree.h"
 #include "discrete_searchtree.h"
 #include "discrete_buckettree.h"
@@ -39,6 +41,18 @@ struct Config {
 	// Simulation end conditions:
 	double min_time = 100, max_weight = 1;
 
+	// Parallel engines (StateSSSP). n_threads <= 0 uses every core.
+	int n_threads = 0;
+	// Delta-stepping bucket width, <= 0 picks 1 / (average degree)
+	double sssp_delta = 0;
+
+	// Random network generators (see graph.h):
+	// Average out-degree, Watts-Strogatz rewiring probability and the infection probability
+	// of every generated edge
+	double mean_degree = 8, rewire_prob = 0.1, edge_prob = 0.9;
+	// Configuration model degree sequence, one degree per line, which sets the size. Empty draws a power law.
+	std::string degree_file;
+
 	// Strictly for visualization purposes:
 	size_t window_size = 900;
 
@@ -51,8 +65,16 @@ struct Config {
 	std::string saved_image_base_path;
 	int sqrt_size;
 	int size;
+	// Imported networks and degree sequences are padded to sqrt_size * sqrt_size with
+	// isolated entities. Only those below unpadded_size are seeded; -1 if there is no padding.
+	int unpadded_size = -1;
 	bool visualize = false;
 	int seed;
+
+	// Entities that can be infected at all
+	int n_seedable() const {
+		return unpadded_size >= 0 ? unpadded_size : size;
+	}
 };
 
 #endif
@@ -8,6 +8,12 @@
 #include "libs/mtwist.h"
 #include "discrete_common.h"
 
+// Node values of DBST, for checkpoints. Other value types provide an overload found by ADL.
+template <typename Visitor>
+inline void visit_bst_value(Visitor& rw, int& value) {
+	rw << value;
+}
+
 template <class K, class Num, class V>
 struct DBstNode {
     K key;
@@ -96,6 +102,28 @@ struct DBstNode {
         return result;
     }
 
+    // Pre-order, with a byte per node saying which children follow
+    template <typename Visitor>
+    static void visit_tree(Visitor& rw, DBstNode** node) {
+        char children = 0;
+        if (rw.is_writing()) {
+            children = ((*node)->left != NULL) | (((*node)->right != NULL) << 1);
+        }
+        K key = rw.is_writing() ? (*node)->key : K();
+        Num weight = rw.is_writing() ? (*node)->weight : Num();
+        rw << key << weight << children;
+        if (rw.is_reading()) {
+            *node = new DBstNode(key, weight);
+        }
+        visit_bst_value(rw, (*node)->value);
+        if (children & 1) {
+            visit_tree(rw, &(*node)->left);
+        }
+        if (children & 2) {
+            visit_tree(rw, &(*node)->right);
+        }
+    }
+
     DBstNode* weighted_select(Num num) {
         Num wl = w(left), wr = w(right);
         if (num < wl) {
@@ -120,6 +148,19 @@ struct DBST {
     Node* find(const K& k, const W& delta_weight) {
         return Node::find(&root, k, delta_weight);
     }
+    // The whole tree, for checkpoints
+    template <typename Visitor>
+    void visit_nodes(Visitor& rw) {
+        bool has_root = (root != NULL);
+        rw << has_root;
+        if (rw.is_reading()) {
+            delete root;
+            root = NULL;
+        }
+        if (has_root) {
+            Node::visit_tree(rw, &root);
+        }
+    }
 };
 
 // Guarantees O(log N) operations very trivially
@@ -154,6 +195,12 @@ struct DiscreteBST : public DBST<int, floatT, int> {
 	floatT total_weight() const {
 	    return root ? root->weight * decay_factor : 0;
 	}
+	// All of the contents, for checkpoints
+	template <typename Visitor>
+	void visit(Visitor& rw) {
+		rw << decay_factor;
+		visit_nodes(rw);
+	}
 	floatT decay_factor = 1.0;
 };
 
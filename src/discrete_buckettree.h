@@ -7,6 +7,10 @@
 struct Slot {
 	entity_id entity;
 	double prob;
+	template <typename Visitor>
+	void visit(Visitor& rw) {
+		rw << entity << prob;
+	}
 };
 
 struct Bucket {
@@ -27,6 +31,11 @@ struct Bucket {
 	}
 };
 
+template <typename Visitor>
+inline void visit_bst_value(Visitor& rw, Bucket& bucket) {
+	rw << bucket.slots;
+}
+
 struct DiscreteBucketTree : DBST<int, floatT, Bucket> {
 
 	DiscreteBucketTree(int __unused = 0) {
@@ -73,6 +82,12 @@ struct DiscreteBucketTree : DBST<int, floatT, Bucket> {
 	floatT total_weight() const {
 	    return root ? root->weight * decay_factor : 0;
 	}
+	// All of the contents, for checkpoints
+	template <typename Visitor>
+	void visit(Visitor& rw) {
+		rw << decay_factor;
+		visit_nodes(rw);
+	}
 	floatT decay_factor = 1.0;
 };
 
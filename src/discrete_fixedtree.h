@@ -13,6 +13,10 @@ struct DFTNode {
 	floatT total_weight = 0;
 	int parent_id = DFTNotExists;
 	int left_id = DFTNotExists, right_id = DFTNotExists;
+	template <typename Visitor>
+	void visit(Visitor& rw) {
+		rw << total_weight << parent_id << left_id << right_id;
+	}
 };
 
 // Guarantees O(log N) operations very trivially
@@ -63,6 +67,11 @@ struct DiscreteFixedTree {
 	floatT total_weight() const {
 		return nodes[size].total_weight * decay_factor;
 	}
+	// All of the contents, for checkpoints
+	template <typename Visitor>
+	void visit(Visitor& rw) {
+		rw << decay_factor << size << nodes;
+	}
 private:
 	int random_select(floatT r, int node_id) {
 		if (node_id < size) {
@@ -17,6 +17,10 @@ struct DSTNode {
         entity = e;
         weight = w;
     }
+    template <typename Visitor>
+    void visit(Visitor& rw) {
+        rw << weight << entity << lchild << rchild;
+    }
 
     void assert_relation() {
 //    	ASSERT(this != lchild, "Loop!");
@@ -120,6 +124,11 @@ struct DiscreteSearchTree {
     double total_weight() const {
         return nil(root_id) ? 0 : to_node(root_id)->weight / decay_factor;
     }
+    // All of the contents, for checkpoints
+    template <typename Visitor>
+    void visit(Visitor& rw) {
+        rw << decay_factor << buffer << last_used << root_id;
+    }
 private:
 	static bool nil(int a) {
 		return a == -1;
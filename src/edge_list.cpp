@@ -0,0 +1,348 @@
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "libs/perf_timer.h"
+#include "libs/ThreadPool.h"
+
+#include "edge_list.h"
+
+using namespace std;
+
+// Read-only view of a whole file
+struct MappedFile {
+	const char* data = NULL;
+	size_t size = 0;
+
+	MappedFile(const string& filename) {
+		fd = open(filename.c_str(), O_RDONLY);
+		ASSERT(fd >= 0, "Could not open edge list file!");
+		struct stat st;
+		ASSERT(fstat(fd, &st) == 0, "Could not stat edge list file!");
+		size = st.st_size;
+		if (size > 0) {
+			void* addr = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+			ASSERT(addr != MAP_FAILED, "Could not map edge list file!");
+			madvise(addr, size, MADV_WILLNEED);
+			data = (const char*)addr;
+		}
+	}
+	~MappedFile() {
+		if (data != NULL) {
+			munmap((void*)data, size);
+		}
+		close(fd);
+	}
+private:
+	int fd;
+};
+
+static inline const char* skip_blanks(const char* p, const char* end) {
+	while (p < end && (*p == ' ' || *p == '\t' || *p == ',' || *p == '\r')) {
+		p++;
+	}
+	return p;
+}
+
+// Returns NULL if there is no id at 'p'
+static inline const char* parse_id(const char* p, const char* end, int64_t& id) {
+	const char* start = p;
+	int64_t value = 0;
+	while (p < end && (unsigned)(*p - '0') < 10) {
+		value = value * 10 + (*p - '0');
+		p++;
+	}
+	id = value;
+	return p == start ? NULL : p;
+}
+
+// Plain decimals are parsed directly, anything else (eg exponents) goes through strtod.
+// Returns NULL if there is no number at 'p'
+static inline const char* parse_prob(const char* p, const char* end, double& prob) {
+	const char* start = p;
+	double value = 0, scale = 1;
+	while (p < end && (unsigned)(*p - '0') < 10) {
+		value = value * 10 + (*p - '0');
+		p++;
+	}
+	if (p < end && *p == '.') {
+		p++;
+		while (p < end && (unsigned)(*p - '0') < 10) {
+			value = value * 10 + (*p - '0');
+			scale *= 10;
+			p++;
+		}
+	}
+	if (p < end && *p != ' ' && *p != '\t' && *p != ',' && *p != '\r' && *p != '\n') {
+		// The mapping is not NUL-terminated, so copy the token first
+		char buff[64];
+		size_t n = std::min<size_t>(end - start, sizeof(buff) - 1);
+		memcpy(buff, start, n);
+		buff[n] = '\0';
+		char* parsed_end;
+		prob = strtod(buff, &parsed_end);
+		return parsed_end == buff ? NULL : start + (parsed_end - buff);
+	}
+	prob = value / scale;
+	return p == start ? NULL : p;
+}
+
+// Calls f(src, dst, prob) for every edge of [begin, end), which must start at a line.
+// Returns the number of malformed lines skipped.
+template <typename Func>
+static size_t parse_chunk(const char* begin, const char* end, double default_prob, Func f) {
+	size_t malformed = 0;
+	const char* p = begin;
+	while (p < end) {
+		const char* line_end = (const char*)memchr(p, '\n', end - p);
+		if (line_end == NULL) {
+			line_end = end;
+		}
+		p = skip_blanks(p, line_end);
+		if (p < line_end && *p != '#' && *p != '%') {
+			int64_t src, dst;
+			double prob = default_prob;
+			const char* q = parse_id(p, line_end, src);
+			if (q != NULL) {
+				q = parse_id(skip_blanks(q, line_end), line_end, dst);
+			}
+			if (q != NULL) {
+				q = skip_blanks(q, line_end);
+				if (q < line_end) {
+					q = parse_prob(q, line_end, prob);
+				}
+			}
+			if (q != NULL) {
+				f(src, dst, prob);
+			} else {
+				malformed++;
+			}
+		}
+		p = line_end + 1;
+	}
+	return malformed;
+}
+
+/*
+ * Original id -> entity, numbering the distinct ids in ascending order.
+ * Ids up to a few times the number of edges are marked in a bitmap, and an id's entity is
+ * its rank: the count of set bits before it. Sparser ids go through a hash table instead.
+ */
+struct IdMap {
+	// Dense ids:
+	vector<uint64_t> bits;
+	vector<uint32_t> ranks;
+	// Sparse ids, open addressing with linear probing:
+	vector<int64_t> keys;
+	vector<entity_id> values;
+	uint64_t mask = 0;
+
+	bool dense() const {
+		return !bits.empty();
+	}
+	void mark(int64_t id) {
+		__atomic_fetch_or(&bits[id >> 6], (uint64_t)1 << (id & 63), __ATOMIC_RELAXED);
+	}
+	// Fills 'ids' with the distinct ids in order
+	void finish_dense(vector<int64_t>& ids) {
+		ranks.resize(bits.size());
+		uint32_t rank = 0;
+		for (size_t w = 0; w < bits.size(); w++) {
+			ranks[w] = rank;
+			rank += __builtin_popcountll(bits[w]);
+		}
+		ids.clear();
+		ids.reserve(rank);
+		for (size_t w = 0; w < bits.size(); w++) {
+			for (uint64_t b = bits[w]; b != 0; b &= b - 1) {
+				ids.push_back(w * 64 + __builtin_ctzll(b));
+			}
+		}
+	}
+	// 'ids' must be sorted and distinct
+	void build_sparse(const vector<int64_t>& ids) {
+		size_t capacity = 16;
+		while (capacity < ids.size() * 2) {
+			capacity *= 2;
+		}
+		mask = capacity - 1;
+		keys.assign(capacity, -1);
+		values.resize(capacity);
+		for (size_t i = 0; i < ids.size(); i++) {
+			uint64_t h = slot(ids[i]);
+			while (keys[h] != -1) {
+				h = (h + 1) & mask;
+			}
+			keys[h] = ids[i], values[h] = i;
+		}
+	}
+	entity_id operator[](int64_t id) const {
+		if (dense()) {
+			uint64_t word = bits[id >> 6] & (((uint64_t)1 << (id & 63)) - 1);
+			return ranks[id >> 6] + __builtin_popcountll(word);
+		}
+		uint64_t h = slot(id);
+		while (keys[h] != id) {
+			h = (h + 1) & mask;
+		}
+		return values[h];
+	}
+private:
+	uint64_t slot(int64_t id) const {
+		return ((uint64_t)id * 0x9E3779B97F4A7C15ULL >> 20) & mask;
+	}
+};
+
+Graph import_edge_list(const string& filename, Config& config) {
+	PERF_TIMER();
+	Timer timer;
+	MappedFile file(filename);
+	ThreadPool pool(config.n_threads);
+	double default_prob = config.edge_prob;
+
+	// Chunks of about 16MB, at least a few per thread, ending at line boundaries:
+	size_t n_chunks = std::max<size_t>(pool.size() * 4, file.size >> 24);
+	n_chunks = std::max<size_t>(1, std::min(n_chunks, file.size / 4096 + 1));
+	vector<const char*> bounds(n_chunks + 1);
+	const char* end = file.data + file.size;
+	bounds[0] = file.data, bounds[n_chunks] = end;
+	for (size_t c = 1; c < n_chunks; c++) {
+		const char* p = file.data + file.size * c / n_chunks;
+		p = std::max(p, bounds[c - 1]);
+		const char* nl = (const char*)memchr(p, '\n', end - p);
+		bounds[c] = (nl == NULL) ? end : nl + 1;
+	}
+
+	// Pass 0: find the id range, which decides how ids are remapped
+	vector<int64_t> chunk_max(n_chunks, -1);
+	vector<size_t> chunk_edges(n_chunks, 0), chunk_malformed(n_chunks, 0);
+	pool.parallel_for(n_chunks, 1, [&](int, size_t begin, size_t end) {
+		for (size_t c = begin; c < end; c++) {
+			int64_t max_id = -1;
+			size_t n_edges = 0;
+			chunk_malformed[c] = parse_chunk(bounds[c], bounds[c + 1], default_prob,
+					[&](int64_t src, int64_t dst, double) {
+				max_id = std::max(max_id, std::max(src, dst));
+				n_edges++;
+			});
+			chunk_max[c] = max_id, chunk_edges[c] = n_edges;
+		}
+	});
+	int64_t max_id = *max_element(chunk_max.begin(), chunk_max.end());
+	size_t n_lines = 0, malformed = 0;
+	for (size_t c = 0; c < n_chunks; c++) {
+		n_lines += chunk_edges[c], malformed += chunk_malformed[c];
+	}
+	ASSERT(n_lines > 0, "Edge list has no edges!");
+
+	// ... and collect the distinct ids
+	Graph g;
+	vector<int64_t>& ids = g.original_ids;
+	IdMap id_map;
+	if (max_id < 32 * (int64_t)n_lines + (1 << 20)) {
+		id_map.bits.assign(max_id / 64 + 1, 0);
+		pool.parallel_for(n_chunks, 1, [&](int, size_t begin, size_t end) {
+			for (size_t c = begin; c < end; c++) {
+				parse_chunk(bounds[c], bounds[c + 1], default_prob, [&](int64_t src, int64_t dst, double) {
+					id_map.mark(src), id_map.mark(dst);
+				});
+			}
+		});
+		id_map.finish_dense(ids);
+	} else {
+		vector<vector<int64_t>> chunk_ids(n_chunks);
+		pool.parallel_for(n_chunks, 1, [&](int, size_t begin, size_t end) {
+			for (size_t c = begin; c < end; c++) {
+				vector<int64_t>& list = chunk_ids[c];
+				parse_chunk(bounds[c], bounds[c + 1], default_prob, [&](int64_t src, int64_t dst, double) {
+					list.push_back(src), list.push_back(dst);
+				});
+				sort(list.begin(), list.end());
+				list.erase(unique(list.begin(), list.end()), list.end());
+			}
+		});
+		for (size_t c = 0; c < n_chunks; c++) {
+			ids.insert(ids.end(), chunk_ids[c].begin(), chunk_ids[c].end());
+			vector<int64_t>().swap(chunk_ids[c]);
+		}
+		sort(ids.begin(), ids.end());
+		ids.erase(unique(ids.begin(), ids.end()), ids.end());
+		id_map.build_sparse(ids);
+	}
+	size_t n = ids.size();
+	ASSERT(n < (size_t)1 << 31, "Too many entities for entity_id!");
+
+	// Pass 1: count out-degrees
+	unique_ptr<atomic<size_t>[]> counts(new atomic<size_t>[n]);
+	for (size_t i = 0; i < n; i++) {
+		counts[i].store(0, memory_order_relaxed);
+	}
+	pool.parallel_for(n_chunks, 1, [&](int, size_t begin, size_t end) {
+		for (size_t c = begin; c < end; c++) {
+			parse_chunk(bounds[c], bounds[c + 1], default_prob, [&](int64_t src, int64_t, double) {
+				counts[id_map[src]].fetch_add(1, memory_order_relaxed);
+			});
+		}
+	});
+	g.offsets.resize(n + 1);
+	g.offsets[0] = 0;
+	for (size_t i = 0; i < n; i++) {
+		g.offsets[i + 1] = g.offsets[i] + counts[i].load(memory_order_relaxed);
+		counts[i].store(g.offsets[i], memory_order_relaxed);
+	}
+
+	// Pass 2: fill, each entity's edges in whatever order the threads reach them
+	g.targets.resize(g.offsets[n]);
+	g.probs.resize(g.offsets[n]);
+	pool.parallel_for(n_chunks, 1, [&](int, size_t begin, size_t end) {
+		for (size_t c = begin; c < end; c++) {
+			parse_chunk(bounds[c], bounds[c + 1], default_prob, [&](int64_t src, int64_t dst, double prob) {
+				size_t e = counts[id_map[src]].fetch_add(1, memory_order_relaxed);
+				g.targets[e] = id_map[dst], g.probs[e] = prob;
+			});
+		}
+	});
+	counts.reset();
+	// ... so sort them, for a graph that does not depend on the thread count
+	pool.parallel_for(n, 1024, [&](int, size_t begin, size_t end) {
+		EdgeList list;
+		for (size_t i = begin; i < end; i++) {
+			size_t start = g.offsets[i], degree = g.offsets[i + 1] - start;
+			list.resize(degree);
+			for (size_t k = 0; k < degree; k++) {
+				list[k] = Edge(g.probs[start + k], g.targets[start + k]);
+			}
+			sort(list.begin(), list.end(), [](const Edge& a, const Edge& b) {
+				return a.node < b.node || (a.node == b.node && a.prob < b.prob);
+			});
+			for (size_t k = 0; k < degree; k++) {
+				g.targets[start + k] = list[k].node, g.probs[start + k] = list[k].prob;
+			}
+		}
+	});
+
+	// Pad to a square, for drawing:
+	config.unpadded_size = n;
+	config.sqrt_size = (int)ceil(sqrt((double)n));
+	config.size = config.sqrt_size * config.sqrt_size;
+	g.offsets.resize(config.size + 1, g.offsets[n]);
+	ids.resize(config.size, -1);
+
+	double seconds = timer.get_microseconds() / 1e6;
+	if (malformed > 0) {
+		printf("Skipped %zu malformed lines\n", malformed);
+	}
+	printf("Imported '%s': %zu entities, %zu edges, %.1fMB in %.3fs (%.2f GB/s, %.1fM edges/s)\n",
+			filename.c_str(), n, g.n_edges(), file.size / 1e6, seconds,
+			file.size / 1e9 / seconds, g.n_edges() / 1e6 / seconds);
+	return g;
+}
@@ -0,0 +1,24 @@
+#ifndef EDGE_LIST_H_
+#define EDGE_LIST_H_
+
+#include <string>
+
+#include "config.h"
+#include "graph.h"
+
+/*
+ * Imports a SNAP-style text edge list: one 'src dst [prob]' per line, with lines starting
+ * with '#' or '%' ignored. Edges without a probability get config.edge_prob.
+ *
+ * The file is memory-mapped and split into chunks at line boundaries, which are parsed in
+ * parallel. Ids may be arbitrary non-negative integers: they are remapped densely in
+ * ascending order, and graph.original_ids maps the entities back.
+ * The graph is built in two passes over the chunks (count, then fill), and edges of an
+ * entity are in ascending target order, whatever the thread count.
+ *
+ * config.sqrt_size and config.size are set to fit the graph, which is padded with
+ * isolated entities up to sqrt_size * sqrt_size.
+ */
+Graph import_edge_list(const std::string& filename, Config& config);
+
+#endif /* EDGE_LIST_H_ */
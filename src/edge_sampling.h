@@ -0,0 +1,26 @@
+#ifndef EDGE_SAMPLING_H_
+#define EDGE_SAMPLING_H_
+
+#include <cmath>
+
+#include "libs/philox.h"
+
+/*
+ * Per-trial edge outcomes for the engines that pre-sample the network from a counter-based RNG.
+ * Every edge's fate is a pure function of (seed, edge index, trial), so engines sharing these
+ * functions agree exactly on which entities are reached for a given seed and trial.
+ */
+
+// Does edge 'e' transmit in 'trial'? Leaves the random words in 'r' for edge_delay.
+inline bool edge_transmits(const Philox& rng, uint64_t e, uint64_t trial, double prob, uint32_t r[4]) {
+	rng.generate(e, trial, r);
+	return Philox::to_real_not0(r[0], r[1]) < prob;
+}
+
+// The delay of a transmitting edge, distributed like MTwist::expovariate(1) (which rejects u <= 1e-7).
+inline double edge_delay(const uint32_t r[4]) {
+	double u = 1e-7 + (1 - 1e-7) * Philox::to_real_not0(r[2], r[3]);
+	return -log(u);
+}
+
+#endif /* EDGE_SAMPLING_H_ */
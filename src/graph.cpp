@@ -1,71 +1,329 @@
 #include "graph.h"
 #include "libs/mtwist.h"
+#include "libs/perf_timer.h"
+#include "libs/philox.h"
+#include "libs/ThreadPool.h"
 #include <algorithm>
+#include <cmath>
 
 using namespace std;
 
-static void connect(Node& n1, int id2, double weight) {
-	n1.push_back({weight, id2});
+Graph Graph::from_lists(const vector<EdgeList>& lists) {
+	Graph g;
+	g.offsets.reserve(lists.size() + 1);
+	g.offsets.push_back(0);
+	for (const EdgeList& list : lists) {
+		for (const Edge& edge : list) {
+			g.targets.push_back(edge.node);
+			g.probs.push_back(edge.prob);
+		}
+		g.offsets.push_back(g.targets.size());
+	}
+	return g;
 }
 
-static void connect(Graph& g, int id1, int id2, double weight) {
-	connect(g[id1], id2, weight);
+void Graph::sort_by_prob() {
+	EdgeList list;
+	for (size_t i = 0; i < size(); i++) {
+		Node node = (*this)[i];
+		list.resize(node.size());
+		for (size_t j = 0; j < node.size(); j++) {
+			list[j] = node[j];
+		}
+		std::sort(list.begin(), list.end(), [](const Edge& a, const Edge& b) {
+			return a.prob > b.prob;
+		});
+		for (size_t j = 0; j < list.size(); j++) {
+			targets[offsets[i] + j] = list[j].node;
+			probs[offsets[i] + j] = list[j].prob;
+		}
+	}
 }
 
-Graph generate_graph(Config& config) {
-	MTwist rng(config.seed);
-	int rows = config.sqrt_size, size = config.size;
+GraphView GraphView::of(const shared_ptr<const Graph>& g) {
+	GraphView view;
+	view.offsets = g->offsets.data();
+	view.targets = g->targets.data();
+	view.probs = g->probs.data();
+	view.original_ids = g->original_ids.empty() ? NULL : g->original_ids.data();
+	view.n = g->size();
+	view.owner = g;
+	return view;
+}
 
-	Graph g(size);
+Graph GraphView::to_graph() const {
+	Graph g;
+	if (n == 0) {
+		return g;
+	}
+	g.offsets.assign(offsets, offsets + n + 1);
+	g.targets.assign(targets, targets + n_edges());
+	g.probs.assign(probs, probs + n_edges());
+	if (original_ids != NULL) {
+		g.original_ids.assign(original_ids, original_ids + n);
+	}
+	return g;
+}
 
-	ASSERT(rows*rows == size, "Logic error");
-	vector<double> interests(size, 0);
-	for (int y = 0; y < rows; y++) {
-		for (int x = 0; x < rows; x++) {
-			interests[y*rows+x] = rng.rand_real_not0();
+// Every stream of a graph generator is a pure function of (seed, block), so the
+// graph does not depend on how blocks are spread over threads.
+static void seed_block_stream(MTwist& rng, int seed, size_t block) {
+	uint32_t key[4];
+	Philox((uint32_t)seed).generate(block, 0, key);
+	rng.init_by_array(key, 4);
+}
+
+/*
+ * Builds a graph of 'n' entities, split into blocks of 'block_size' consecutive entities,
+ * straight into CSR form: gen(rng, id, emit) calls emit(target, prob) for each out-edge of 'id'.
+ * Blocks run in parallel, each with its own stream. A first pass counts the edges, and a
+ * second pass replays every block's stream to write them into the preallocated arrays,
+ * so 'gen' must be deterministic given its stream.
+ */
+template <typename Gen>
+static Graph build_graph(Config& config, size_t n, size_t block_size, Gen gen) {
+	PERF_TIMER();
+	ThreadPool pool(config.n_threads);
+	size_t n_blocks = (n + block_size - 1) / block_size;
+	Graph g;
+	g.offsets.assign(n + 1, 0);
+	Timer timer;
+	pool.parallel_for(n_blocks, 1, [&](int, size_t begin, size_t end) {
+		MTwist rng;
+		for (size_t b = begin; b < end; b++) {
+			seed_block_stream(rng, config.seed, b);
+			for (size_t i = b * block_size; i < std::min(n, (b + 1) * block_size); i++) {
+				size_t degree = 0;
+				gen(rng, (entity_id)i, [&](entity_id, double) {
+					degree++;
+				});
+				g.offsets[i + 1] = degree;
+			}
 		}
+	});
+	for (size_t i = 0; i < n; i++) {
+		g.offsets[i + 1] += g.offsets[i];
 	}
-
-	printf("CONNECTING ENTITIES\n");
-	#define FOR_ID(x, y, A) \
-		for (int y = 0; y < rows; y++) \
-			for (int x = 0, A = y * rows; x < rows; x++, A++)
-
-	MilestoneRep rep;
-	FOR_ID(x, y, A) {
-		rep.report("Connected %d entities");
-//		if (rng.rand_real_not0() < 0.55) {
-//			continue;
-//		}
-		// How far away to effect?
-		double SxD = 1, SyD = 1;
-		for (int i = 0; i < 10; i++) {
-			SxD += rng.rand_real_with01();
-			SyD += rng.rand_real_with01();
-			if (rng.random_chance(0.33)) {
-				break;
+	printf("Counted %zu edges (%.9gms)\n", g.offsets[n], timer.get_microseconds() / 1000.0);
+	g.targets.resize(g.offsets[n]);
+	g.probs.resize(g.offsets[n]);
+	pool.parallel_for(n_blocks, 1, [&](int, size_t begin, size_t end) {
+		MTwist rng;
+		for (size_t b = begin; b < end; b++) {
+			seed_block_stream(rng, config.seed, b);
+			for (size_t i = b * block_size; i < std::min(n, (b + 1) * block_size); i++) {
+				size_t e = g.offsets[i];
+				gen(rng, (entity_id)i, [&](entity_id target, double prob) {
+					g.targets[e] = target, g.probs[e] = prob;
+					e++;
+				});
+				DEBUG_CHECK(e == g.offsets[i + 1], "Generator must replay the same edges!");
 			}
 		}
-		SxD = 1;
-		SyD = 1;
-		int Sx = (int) SxD, Sy = (int) SyD;
-		int n_squares = (1 + 2 * Sx) * (1 + 2 * Sy) - 1;
-		double popularity = rng.rand_real_not0() * 2;// / 40;
-		for (int sy = -Sy; sy <= Sy; sy++) {
-			for (int sx = -Sx; sx <= Sx; sx++) {
-//				if (rng.rand_real_not0() < 0.60) {
-//					continue;
-//				}
+	});
+	printf("Connected %zu entities (%.9gms)\n", n, timer.get_microseconds() / 1000.0);
+	return g;
+}
+
+// The 8-neighbour torus:
+struct TorusGenerator {
+	int rows;
+	template <typename Emit>
+	void operator()(MTwist&, entity_id A, Emit emit) const {
+		int x = A % rows, y = A / rows;
+		for (int sy = -1; sy <= 1; sy++) {
+			for (int sx = -1; sx <= 1; sx++) {
 				int nx = (x + rows + sx) % rows, ny = (y + rows + sy) % rows;
 				// This ensures everyone is connected to their neighbours, once it has completed.
 				if (sx != 0 || sy != 0) {
-					double dist = pow(sx*sx + sy*sy, 0.5);
-					entity_id id = ny * rows + nx;
-					connect(g, A, id, 0.9);//std::min(1.0, popularity / dist));
+					emit(ny * rows + nx, 0.9);
 				}
 			}
 		}
 	}
+};
+
+Graph generate_graph(Config& config) {
+	int rows = config.sqrt_size, size = config.size;
+	ASSERT(rows*rows == size, "Logic error");
+
+	printf("CONNECTING ENTITIES\n");
+	// One block per row (the torus needs no random draws):
+	return build_graph(config, size, rows, TorusGenerator {rows});
+}
+
+// Entities per generator block, fixed so that streams do not depend on the thread count:
+static const size_t GEN_BLOCK = 4096;
+
+struct ErdosRenyiGenerator {
+	size_t n;
+	double p, log_q, prob;
+	template <typename Emit>
+	void operator()(MTwist& rng, entity_id A, Emit emit) const {
+		if (p <= 0) {
+			return;
+		}
+		// Skip over the non-edges among the n - 1 candidate targets:
+		double j = -1;
+		while (true) {
+			j += 1 + (p >= 1 ? 0 : floor(log(rng.rand_real_not0()) / log_q));
+			if (j >= n - 1) {
+				break;
+			}
+			entity_id target = (entity_id)j;
+			emit(target < A ? target : target + 1, prob);
+		}
+	}
+};
 
+Graph generate_erdos_renyi(Config& config) {
+	size_t n = config.size;
+	double p = std::min(1.0, config.mean_degree / std::max<size_t>(1, n - 1));
+	printf("GENERATING ERDOS-RENYI GRAPH (p = %g)\n", p);
+	return build_graph(config, n, GEN_BLOCK,
+			ErdosRenyiGenerator {n, p, log1p(-p), config.edge_prob});
+}
+
+struct WattsStrogatzGenerator {
+	int n, k;
+	double beta, prob;
+	template <typename Emit>
+	void operator()(MTwist& rng, entity_id A, Emit emit) const {
+		// k / 2 neighbours behind, the rest ahead:
+		for (int d = -k / 2; d <= k - k / 2; d++) {
+			if (d == 0) {
+				continue;
+			}
+			entity_id target = (entity_id)(((long long)A + d + n) % n);
+			if (rng.random_chance(beta)) {
+				// Rewire to a uniformly random entity other than A:
+				target = rng.rand_int(n - 1);
+				target += (target >= A);
+			}
+			emit(target, prob);
+		}
+	}
+};
+
+Graph generate_watts_strogatz(Config& config) {
+	int n = config.size;
+	int k = std::min(n - 1, std::max(1, (int)round(config.mean_degree)));
+	printf("GENERATING WATTS-STROGATZ GRAPH (k = %d, beta = %g)\n", k, config.rewire_prob);
+	return build_graph(config, n, GEN_BLOCK,
+			WattsStrogatzGenerator {n, k, config.rewire_prob, config.edge_prob});
+}
+
+/*
+ * Batagelj & Brandes' linear-time preferential attachment: link j of entity j / m goes to
+ * the entity at a uniformly random earlier position of the (source, target) list, which
+ * picks entities proportionally to their degree. Instead of building that list, each
+ * target position is resolved by hashing (Sanders & Schulz): even positions are sources
+ * and known outright, odd ones are followed back until they reach one. Links are
+ * independent of each other, so they are resolved in parallel.
+ */
+Graph generate_barabasi_albert(Config& config) {
+	PERF_TIMER();
+	size_t n = config.size;
+	size_t m = std::max(1, (int)round(config.mean_degree / 2));
+	printf("GENERATING BARABASI-ALBERT GRAPH (m = %zu)\n", m);
+	Philox hash((uint32_t)config.seed);
+	ThreadPool pool(config.n_threads);
+	vector<entity_id> link_targets(n * m);
+	pool.parallel_for(n * m, GEN_BLOCK, [&](int, size_t begin, size_t end) {
+		for (size_t j = begin; j < end; j++) {
+			uint64_t pos = 2 * j + 1;
+			while (pos % 2 == 1) {
+				pos = hash.rand_uint64(pos, 1) % pos;
+			}
+			link_targets[j] = (entity_id)(pos / 2 / m);
+		}
+	});
+
+	// Links are undirected, so each becomes an edge both ways (self-loops are dropped):
+	Graph g;
+	g.offsets.assign(n + 1, 0);
+	for (size_t j = 0; j < n * m; j++) {
+		entity_id source = j / m, target = link_targets[j];
+		if (source != target) {
+			g.offsets[source + 1]++, g.offsets[target + 1]++;
+		}
+	}
+	for (size_t i = 0; i < n; i++) {
+		g.offsets[i + 1] += g.offsets[i];
+	}
+	g.targets.resize(g.offsets[n]);
+	g.probs.assign(g.offsets[n], config.edge_prob);
+	vector<size_t> cursor(g.offsets.begin(), g.offsets.end() - 1);
+	for (size_t j = 0; j < n * m; j++) {
+		entity_id source = j / m, target = link_targets[j];
+		if (source != target) {
+			g.targets[cursor[source]++] = target;
+			g.targets[cursor[target]++] = source;
+		}
+	}
+	return g;
+}
+
+// Reads one degree per line
+static vector<int> read_degree_sequence(const string& filename) {
+	FILE* file = fopen(filename.c_str(), "r");
+	ASSERT(file != NULL, "Could not open degree sequence file!");
+	vector<int> degrees;
+	int degree;
+	while (fscanf(file, "%d", &degree) == 1) {
+		degrees.push_back(degree);
+	}
+	bool complete = feof(file);
+	fclose(file);
+	ASSERT(complete, "Degree sequence file has a line that is not a degree!");
+	ASSERT(!degrees.empty(), "Degree sequence file has no degrees!");
+	return degrees;
+}
+
+Graph generate_configuration_model(Config& config) {
+	PERF_TIMER();
+	size_t n = config.size;
+	vector<int> degrees;
+	if (!config.degree_file.empty()) {
+		degrees = read_degree_sequence(config.degree_file);
+		printf("Read %zu degrees from '%s'\n", degrees.size(), config.degree_file.c_str());
+		// The sequence sets the size, padded to a square for drawing (as in import_edge_list)
+		config.sqrt_size = (int)ceil(sqrt((double)degrees.size()));
+		config.size = config.sqrt_size * config.sqrt_size;
+		config.unpadded_size = degrees.size();
+		n = config.size;
+		degrees.resize(n, 0);
+	} else {
+		// Discrete Pareto with exponent 2.5, whose mean is 3 times its minimum:
+		double x_min = std::max(1.0, config.mean_degree / 3);
+		degrees.resize(n);
+		MTwist rng;
+		seed_block_stream(rng, config.seed, 0);
+		for (size_t i = 0; i < n; i++) {
+			double x = x_min * pow(rng.rand_real_not0(), -1 / 1.5);
+			degrees[i] = (int)std::min<double>(n - 1, floor(x));
+		}
+	}
+	printf("GENERATING CONFIGURATION MODEL GRAPH\n");
+
+	// Entity i has degrees[i] out-stubs (its CSR slots) and as many in-stubs.
+	// A uniformly random matching of the two is a shuffle of the in-stubs:
+	Graph g;
+	g.offsets.resize(n + 1);
+	g.offsets[0] = 0;
+	for (size_t i = 0; i < n; i++) {
+		g.offsets[i + 1] = g.offsets[i] + degrees[i];
+	}
+	g.targets.resize(g.offsets[n]);
+	g.probs.assign(g.offsets[n], config.edge_prob);
+	for (size_t i = 0; i < n; i++) {
+		std::fill(g.targets.begin() + g.offsets[i], g.targets.begin() + g.offsets[i + 1], (entity_id)i);
+	}
+	MTwist rng;
+	seed_block_stream(rng, config.seed, 1);
+	for (size_t e = g.targets.size(); e > 1; e--) {
+		size_t r = (((uint64_t)rng.genrand_int32() << 32) | rng.genrand_int32()) % e;
+		std::swap(g.targets[e - 1], g.targets[r]);
+	}
 	return g;
 }
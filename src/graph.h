@@ -1,6 +1,12 @@
 #ifndef GENERATE_GRAPH_H_
 #define GENERATE_GRAPH_H_
 
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+#include "libs/int_types.h"
+
 #include "config.h"
 
 // Contains the infection probability.
@@ -13,11 +19,124 @@ struct Edge {
 	}
 };
 
-typedef std::vector<Edge> Node;
-typedef std::vector<Node> Graph;
+// Out-edges of one entity, used while building graphs.
+typedef std::vector<Edge> EdgeList;
+
+// The out-edges of one entity: a view into a Graph's arrays.
+struct Node {
+	const entity_id* targets;
+	const float* probs;
+	size_t n;
+	size_t size() const {
+		return n;
+	}
+	Edge operator[](size_t i) const {
+		return Edge(probs[i], targets[i]);
+	}
+};
+
+/*
+ * Directed graph in compressed sparse row form:
+ * the out-edges of entity i are [offsets[i], offsets[i+1]) of 'targets' and 'probs'.
+ * 8 bytes per edge, and three allocations in total.
+ */
+struct Graph {
+	std::vector<size_t> offsets;
+	std::vector<entity_id> targets;
+	std::vector<float> probs;
+	// Id of every entity in the input it came from (-1 for padding), empty if not imported
+	std::vector<int64_t> original_ids;
+
+	Graph() {
+	}
+	static Graph from_lists(const std::vector<EdgeList>& lists);
+
+	size_t size() const {
+		return offsets.empty() ? 0 : offsets.size() - 1;
+	}
+	size_t n_edges() const {
+		return targets.size();
+	}
+	size_t degree(size_t i) const {
+		return offsets[i + 1] - offsets[i];
+	}
+	Node operator[](size_t i) const {
+		size_t start = offsets[i];
+		return Node {targets.data() + start, probs.data() + start, offsets[i + 1] - start};
+	}
+
+	// Sort every entity's out-edges by descending probability
+	void sort_by_prob();
+
+	READ_WRITE(rw) {
+		rw << offsets << targets << probs << original_ids;
+	}
+};
+
+/*
+ * The same CSR arrays as Graph, but not owned: they belong to 'owner', which keeps them
+ * alive. Used to run on a mapped snapshot in place (see snapshot.h).
+ * Views are read-only, so the edges must already be sorted by descending probability.
+ */
+struct GraphView {
+	const size_t* offsets = NULL;
+	const entity_id* targets = NULL;
+	const float* probs = NULL;
+	const int64_t* original_ids = NULL; // NULL if not imported
+	size_t n = 0;
+	std::shared_ptr<const void> owner;
+
+	GraphView() {
+	}
+	// Views a graph, which must already be sorted
+	static GraphView of(const std::shared_ptr<const Graph>& g);
+
+	size_t size() const {
+		return n;
+	}
+	size_t n_edges() const {
+		return n == 0 ? 0 : offsets[n];
+	}
+	size_t degree(size_t i) const {
+		return offsets[i + 1] - offsets[i];
+	}
+	Node operator[](size_t i) const {
+		size_t start = offsets[i];
+		return Node {targets + start, probs + start, offsets[i + 1] - start};
+	}
+	// Copies the viewed arrays
+	Graph to_graph() const;
+
+	// Already sorted, see above
+	void sort_by_prob() {
+	}
+
+	READ_WRITE(rw) {
+		std::shared_ptr<Graph> g(new Graph(to_graph()));
+		g->visit(rw);
+		if (rw.is_reading()) {
+			*this = of(g);
+		}
+	}
+};
 
 // Based on the passed settings, create a random initial state.
 // Right now, we just generate a directed graph (the network state) of some average connectivity and uniformly weighted connections
 Graph generate_graph(Config& config);
 
+/*
+ * Random networks of config.size entities for capacity planning. Every edge has infection
+ * probability config.edge_prob, and each generator runs in O(E) time straight into CSR form.
+ */
+// Directed G(n, p) with p = mean_degree / (n - 1), using geometric skips between edges
+Graph generate_erdos_renyi(Config& config);
+// Ring of mean_degree nearest neighbours, each edge rewired with probability rewire_prob
+Graph generate_watts_strogatz(Config& config);
+// Barabasi-Albert preferential attachment, mean_degree / 2 undirected links per new entity
+Graph generate_barabasi_albert(Config& config);
+// Directed configuration model: out- and in-degrees follow the degree sequence
+// (config.degree_file, else a power law with exponent 2.5); self-loops and multi-edges are kept.
+// A degree sequence sets config.size (padded to a square with degree-0 entities).
+Graph generate_configuration_model(Config& config);
+
 #endif /* GENERATE_GRAPH_H_ */
@@ -0,0 +1,95 @@
+#ifndef LATTICE_GRAPH_H_
+#define LATTICE_GRAPH_H_
+
+#include <algorithm>
+#include <cmath>
+
+#include "libs/int_types.h"
+
+#include "config.h"
+#include "graph.h"
+
+/*
+ * The torus built by generate_graph, without storing it: the 8 Moore neighbours of
+ * entity A = y * rows + x are computed from (x, y) whenever they are asked for.
+ * Edge storage is zero, so the entity state is all the memory a simulation needs.
+ *
+ * Every edge has probability 'prob', or, with per-node popularity, min(1, popularity / dist)
+ * where 'popularity' in [0, 2) is a hash of (popularity_seed, source entity).
+ * Orthogonal neighbours come before diagonal ones, so edges are always sorted by
+ * descending probability (as StateAlt requires).
+ */
+
+// The out-edges of one lattice entity
+struct LatticeNode {
+	entity_id x, y, rows;
+	double orth_prob, diag_prob;
+
+	size_t size() const {
+		return 8;
+	}
+	Edge operator[](size_t i) const {
+		// Orthogonal, then diagonal:
+		static const int DX[8] = {1, -1, 0, 0, 1, -1, 1, -1};
+		static const int DY[8] = {0, 0, 1, -1, 1, 1, -1, -1};
+		entity_id nx = x + DX[i], ny = y + DY[i];
+		nx = (nx < 0) ? nx + rows : (nx >= rows ? nx - rows : nx);
+		ny = (ny < 0) ? ny + rows : (ny >= rows ? ny - rows : ny);
+		return Edge(i < 4 ? orth_prob : diag_prob, ny * rows + nx);
+	}
+};
+
+struct LatticeGraph {
+	int rows = 0;
+	double prob = 0.9;
+	// < 0 for a constant 'prob'
+	int popularity_seed = -1;
+
+	LatticeGraph() {
+	}
+	LatticeGraph(int rows, double prob, int popularity_seed = -1) :
+			rows(rows), prob(prob), popularity_seed(popularity_seed) {
+	}
+
+	size_t size() const {
+		return (size_t)rows * rows;
+	}
+	size_t n_edges() const {
+		return size() * 8;
+	}
+	size_t degree(size_t) const {
+		return 8;
+	}
+	LatticeNode operator[](size_t i) const {
+		LatticeNode node;
+		node.x = i % rows, node.y = i / rows, node.rows = rows;
+		if (popularity_seed < 0) {
+			node.orth_prob = node.diag_prob = prob;
+		} else {
+			double popularity = popularity_of(i);
+			node.orth_prob = std::min(1.0, popularity);
+			node.diag_prob = std::min(1.0, popularity / sqrt(2.0));
+		}
+		return node;
+	}
+
+	// Already sorted, see above
+	void sort_by_prob() {
+	}
+
+	READ_WRITE(rw) {
+		rw << rows << prob << popularity_seed;
+	}
+private:
+	// Uniform in [0, 2), fixed per entity (SplitMix64 finalizer as the hash)
+	double popularity_of(size_t id) const {
+		uint64_t z = ((uint64_t)popularity_seed << 32) ^ id;
+		z += 0x9E3779B97F4A7C15ULL;
+		z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+		z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+		z ^= z >> 31;
+		return (z >> 11) * (2.0 / 9007199254740992.0);
+	}
+};
+
+#endif /* LATTICE_GRAPH_H_ */
@@ -0,0 +1,231 @@
+/*
+ * AsyncFileIO.cpp:
+ *  Double-buffered file I/O on a background thread.
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "AsyncFileIO.h"
+#include "SerializeBuffer.h"
+
+AsyncFileIO::AsyncFileIO(const std::string& filename, Mode mode, bool direct_io, int n_chunks) :
+		mode(mode) {
+	int flags = (mode == WRITE) ? (O_WRONLY | O_CREAT | O_TRUNC) : O_RDONLY;
+#ifdef O_DIRECT
+	if (direct_io) {
+		fd = open(filename.c_str(), flags | O_DIRECT, 0644);
+		direct = (fd >= 0);
+	}
+#endif
+	if (fd < 0) {
+		fd = open(filename.c_str(), flags, 0644);
+	}
+	if (fd < 0) {
+		return;
+	}
+	chunks.resize(std::max(2, n_chunks));
+	for (size_t i = 0; i < chunks.size(); i++) {
+		void* data = NULL;
+		if (posix_memalign(&data, DIRECT_ALIGN, CHUNK_SIZE) != 0) {
+			abort();
+		}
+		chunks[i].data = (char*)data;
+		chunks[i].size = 0;
+		// Writing: all chunks start empty for the caller. Reading: all start being read into.
+		(mode == WRITE ? ready : pending).push_back(i);
+	}
+	if (mode == WRITE) {
+		current = ready.front();
+		ready.pop_front();
+	}
+	background = std::thread(&AsyncFileIO::background_loop, this);
+}
+
+AsyncFileIO::~AsyncFileIO() {
+	close();
+	for (Chunk& chunk : chunks) {
+		free(chunk.data);
+	}
+}
+
+void AsyncFileIO::disable_direct_io() {
+#ifdef O_DIRECT
+	if (direct) {
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+		direct = false;
+	}
+#endif
+}
+
+bool AsyncFileIO::write_out(const Chunk& chunk) {
+	if (direct && chunk.size % DIRECT_ALIGN != 0) {
+		disable_direct_io();
+	}
+	size_t done = 0;
+	while (done < chunk.size) {
+		ssize_t n = ::write(fd, chunk.data + done, chunk.size - done);
+		if (n < 0 && errno == EINVAL && direct) {
+			// Opened, but the file system refuses direct writes:
+			disable_direct_io();
+			continue;
+		}
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return false;
+		}
+		done += n;
+	}
+	return true;
+}
+
+void AsyncFileIO::background_loop() {
+	std::unique_lock<std::mutex> lock(mutex);
+	while (true) {
+		changed.wait(lock, [&]() {
+			return !pending.empty() || stopping;
+		});
+		if (pending.empty()) {
+			return; // Stopping, with nothing left to do
+		}
+		int index = pending.front();
+		pending.pop_front();
+		Chunk& chunk = chunks[index];
+		lock.unlock();
+		if (mode == WRITE) {
+			bool ok = write_out(chunk);
+			lock.lock();
+			failed = failed || !ok;
+			chunk.size = 0;
+		} else {
+			size_t got = 0;
+			while (got < CHUNK_SIZE) {
+				ssize_t n = ::read(fd, chunk.data + got, CHUNK_SIZE - got);
+				if (n < 0 && errno == EINVAL && direct) {
+					disable_direct_io();
+					continue;
+				}
+				if (n < 0 && errno == EINTR) {
+					continue;
+				}
+				if (n <= 0) {
+					break;
+				}
+				got += n;
+			}
+			lock.lock();
+			chunk.size = got;
+			if (got < CHUNK_SIZE) {
+				// End of file: the caller sees this chunk last, and nothing more is read
+				stopping = true;
+			}
+		}
+		ready.push_back(index);
+		changed.notify_all();
+	}
+}
+
+int AsyncFileIO::swap_chunk(std::deque<int>& give_to, std::deque<int>& take_from, int index) {
+	std::unique_lock<std::mutex> lock(mutex);
+	if (index >= 0) {
+		give_to.push_back(index);
+		changed.notify_all();
+	}
+	changed.wait(lock, [&]() {
+		return !take_from.empty();
+	});
+	int next = take_from.front();
+	take_from.pop_front();
+	return next;
+}
+
+void AsyncFileIO::write(const char* data, size_t n) {
+	while (n > 0) {
+		Chunk& chunk = chunks[current];
+		size_t piece = std::min(n, CHUNK_SIZE - chunk.size);
+		memcpy(chunk.data + chunk.size, data, piece);
+		chunk.size += piece;
+		data += piece, n -= piece;
+		if (chunk.size == CHUNK_SIZE) {
+			current = swap_chunk(pending, ready, current);
+		}
+	}
+}
+
+size_t AsyncFileIO::read(char* data, size_t n) {
+	size_t total = 0;
+	while (total < n && !at_eof) {
+		if (current < 0 || position == chunks[current].size) {
+			if (current >= 0 && chunks[current].size < CHUNK_SIZE) {
+				at_eof = true; // That was the last chunk
+				break;
+			}
+			// Hand the consumed chunk back to be refilled. A short chunk always comes last,
+			// so the background thread is still running, or has already queued it.
+			current = swap_chunk(pending, ready, current);
+			position = 0;
+			continue;
+		}
+		Chunk& chunk = chunks[current];
+		size_t piece = std::min(n - total, chunk.size - position);
+		memcpy(data + total, chunk.data + position, piece);
+		position += piece, total += piece;
+	}
+	return total;
+}
+
+bool AsyncFileIO::close() {
+	if (fd < 0) {
+		return !failed;
+	}
+	if (mode == WRITE && current >= 0 && chunks[current].size > 0) {
+		std::unique_lock<std::mutex> lock(mutex);
+		pending.push_back(current);
+		current = -1;
+	}
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		stopping = true;
+		changed.notify_all();
+	}
+	background.join();
+	if (mode == WRITE && fsync(fd) != 0) {
+		failed = true;
+	}
+	if (::close(fd) != 0) {
+		failed = true;
+	}
+	fd = -1;
+	return !failed;
+}
+
+void AsyncFileIO::flushf(void* context, const char* data, size_t size) {
+	((AsyncFileIO*)context)->write(data, size);
+}
+
+void AsyncFileIO::fillf(void* context, std::vector<char>& buffer, size_t maxsize) {
+	size_t end = buffer.size();
+	buffer.resize(maxsize);
+	size_t got = ((AsyncFileIO*)context)->read(&buffer[end], maxsize - end);
+	buffer.resize(end + got);
+}
+
+size_t AsyncFileIO::readf(void* context, char* data, size_t size) {
+	return ((AsyncFileIO*)context)->read(data, size);
+}
+
+void AsyncFileIO::closef(void* context) {
+	AsyncFileIO* io = (AsyncFileIO*)context;
+	bool ok = io->close();
+	delete io;
+	if (!ok) {
+		serialize_buffer_error("Could not write the file out durably");
+	}
+}
@@ -0,0 +1,81 @@
+/*
+ * AsyncFileIO.h:
+ *  Double-buffered file I/O on a background thread, as a SerializeBuffer backend.
+ *  Writes are copied into one of a few rotating chunks and written out while the caller
+ *  carries on; reads are prefetched a few chunks ahead. The bytes on disk are the same
+ *  as with plain fwrite/fread.
+ */
+
+#ifndef ASYNCFILEIO_H_
+#define ASYNCFILEIO_H_
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+class AsyncFileIO {
+public:
+	enum Mode {
+		READ,
+		WRITE
+	};
+	// Chunks are multiples of the O_DIRECT alignment
+	static const size_t CHUNK_SIZE = 1024 * 1024;
+	static const size_t DIRECT_ALIGN = 4096;
+
+	// direct_io tries O_DIRECT, bypassing the page cache, and silently falls back to
+	// buffered I/O where the file system does not support it.
+	AsyncFileIO(const std::string& filename, Mode mode, bool direct_io = false, int n_chunks = 3);
+	// Closes, without reporting errors; call close() to see them
+	~AsyncFileIO();
+
+	bool is_open() const {
+		return fd >= 0;
+	}
+	// Queues 'n' bytes for writing, blocking only while every chunk is in flight
+	void write(const char* data, size_t n);
+	// Reads up to 'n' bytes, returning fewer only at the end of the file
+	size_t read(char* data, size_t n);
+	// Writes out everything queued and fsyncs before closing, so that the data is on disk
+	// when it returns true. Returns false if any write failed.
+	bool close();
+
+	// SerializeBuffer callbacks, with an AsyncFileIO* as the context. closef deletes it,
+	// throwing SerializeBufferError if the data could not be made durable.
+	static void flushf(void* context, const char* data, size_t size);
+	static void fillf(void* context, std::vector<char>& buffer, size_t maxsize);
+	static size_t readf(void* context, char* data, size_t size);
+	static void closef(void* context);
+
+private:
+	struct Chunk {
+		char* data;
+		size_t size;
+	};
+	void background_loop();
+	// Writes a whole chunk to the file, clearing O_DIRECT first if it is not aligned
+	bool write_out(const Chunk& chunk);
+	void disable_direct_io();
+	// Hands the chunk being filled (or consumed) to the background thread, and takes the next
+	int swap_chunk(std::deque<int>& give_to, std::deque<int>& take_from, int current);
+
+	Mode mode;
+	int fd = -1;
+	bool direct = false;
+	std::vector<Chunk> chunks;
+	// Chunk indices: 'pending' are for the background thread (to write, or to read into),
+	// 'ready' for the caller (empty to fill, or read to consume)
+	std::deque<int> pending, ready;
+	// The chunk the caller is filling or consuming, and its position
+	int current = -1;
+	size_t position = 0;
+	bool stopping = false, failed = false, at_eof = false;
+	std::mutex mutex;
+	std::condition_variable changed;
+	std::thread background;
+};
+
+#endif /* ASYNCFILEIO_H_ */
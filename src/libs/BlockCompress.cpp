@@ -0,0 +1,406 @@
+/*
+ * BlockCompress.cpp:
+ *  In-process LZ compression for serialized files.
+ */
+
+#include <algorithm>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "BlockCompress.h"
+#include "SerializeBuffer.h"
+
+static const char LZ_FILE_MAGIC[8] = {'I', 'N', 'F', 'S', 'L', 'Z', '1', '\0'};
+static const char LZ_INDEX_MAGIC[8] = {'I', 'N', 'F', 'S', 'L', 'Z', 'I', '\0'};
+static const uint32_t STORED_FLAG = 1u << 31;
+static const size_t HEADER_SIZE = sizeof(LZ_FILE_MAGIC) + 4;
+static const size_t INDEX_ENTRY_SIZE = 8 + 8 + 4 + 4;
+static const size_t TRAILER_SIZE = 8 + 8 + sizeof(LZ_INDEX_MAGIC);
+
+/*****************************************************************************
+ * Codec
+ *****************************************************************************/
+
+static const size_t MIN_MATCH = 4;
+// Matches must end this far from the end, and start before the last MATCH_LIMIT bytes:
+static const size_t LAST_LITERALS = 5, MATCH_LIMIT = 12;
+static const int HASH_BITS = 16;
+static const size_t MAX_OFFSET = 65535;
+
+static inline uint32_t read32(const char* p) {
+	uint32_t v;
+	memcpy(&v, p, 4);
+	return v;
+}
+
+static inline uint32_t hash32(uint32_t v) {
+	return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+// Lengths of 15 or more continue in 255-runs
+static inline char* write_length(char* op, size_t len) {
+	for (; len >= 255; len -= 255) {
+		*op++ = (char)255;
+	}
+	*op++ = (char)len;
+	return op;
+}
+
+static inline char* write_sequence(char* op, const char* literals, size_t n_literals, size_t offset, size_t match_len) {
+	char* token = op++;
+	*token = (char)(std::min(n_literals, (size_t)15) << 4);
+	if (n_literals >= 15) {
+		op = write_length(op, n_literals - 15);
+	}
+	memcpy(op, literals, n_literals);
+	op += n_literals;
+	if (match_len == 0) {
+		return op; // The last sequence only has literals
+	}
+	*op++ = (char)(offset & 0xFF);
+	*op++ = (char)(offset >> 8);
+	size_t len = match_len - MIN_MATCH;
+	*token |= (char)std::min(len, (size_t)15);
+	if (len >= 15) {
+		op = write_length(op, len - 15);
+	}
+	return op;
+}
+
+size_t lz_compress_bound(size_t n) {
+	return n + n / 255 + 16;
+}
+
+size_t lz_compress(const char* src, size_t n, char* dst) {
+	char* op = dst;
+	const char* anchor = src;
+	if (n > MATCH_LIMIT) {
+		std::vector<uint32_t> table(1 << HASH_BITS, 0);
+		const char* ip = src + 1;
+		const char* match_start_limit = src + n - MATCH_LIMIT;
+		const char* match_end_limit = src + n - LAST_LITERALS;
+		size_t misses = 0;
+		while (ip < match_start_limit) {
+			uint32_t seq = read32(ip);
+			uint32_t h = hash32(seq);
+			const char* ref = src + table[h];
+			table[h] = ip - src;
+			if (ref >= ip || (size_t)(ip - ref) > MAX_OFFSET || read32(ref) != seq) {
+				// Skip ahead faster through incompressible data:
+				ip += 1 + (misses++ >> 6);
+				continue;
+			}
+			misses = 0;
+			// Extend backwards over literals, then forwards:
+			while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+				ip--, ref--;
+			}
+			size_t len = MIN_MATCH;
+			while (ip + len < match_end_limit && ip[len] == ref[len]) {
+				len++;
+			}
+			op = write_sequence(op, anchor, ip - anchor, ip - ref, len);
+			ip += len;
+			anchor = ip;
+		}
+	}
+	return write_sequence(op, anchor, src + n - anchor, 0, 0) - dst;
+}
+
+static inline bool read_length(const char*& ip, const char* iend, size_t& len) {
+	while (true) {
+		if (ip >= iend) {
+			return false;
+		}
+		uint8_t b = *ip++;
+		len += b;
+		if (b != 255) {
+			return true;
+		}
+	}
+}
+
+bool lz_decompress(const char* src, size_t n, char* dst, size_t dst_size) {
+	const char* ip = src;
+	const char* iend = src + n;
+	char* op = dst;
+	char* oend = dst + dst_size;
+	while (ip < iend) {
+		uint8_t token = *ip++;
+		size_t n_literals = token >> 4;
+		if (n_literals == 15 && !read_length(ip, iend, n_literals)) {
+			return false;
+		}
+		if ((size_t)(iend - ip) < n_literals || (size_t)(oend - op) < n_literals) {
+			return false;
+		}
+		memcpy(op, ip, n_literals);
+		ip += n_literals, op += n_literals;
+		if (ip == iend) {
+			break; // The last sequence
+		}
+		if (iend - ip < 2) {
+			return false;
+		}
+		size_t offset = (uint8_t)ip[0] | ((size_t)(uint8_t)ip[1] << 8);
+		ip += 2;
+		size_t len = token & 15;
+		if (len == 15 && !read_length(ip, iend, len)) {
+			return false;
+		}
+		len += MIN_MATCH;
+		if (offset == 0 || offset > (size_t)(op - dst) || (size_t)(oend - op) < len) {
+			return false;
+		}
+		const char* ref = op - offset;
+		if (offset >= len) {
+			memcpy(op, ref, len);
+			op += len;
+		} else {
+			// Overlapping, ie a repeating pattern
+			for (size_t i = 0; i < len; i++) {
+				*op++ = *ref++;
+			}
+		}
+	}
+	return op == oend;
+}
+
+/*****************************************************************************
+ * Writer
+ *****************************************************************************/
+
+static void append(std::vector<char>& out, const void* data, size_t n) {
+	out.insert(out.end(), (const char*)data, (const char*)data + n);
+}
+
+CompressedFileWriter::CompressedFileWriter(const std::string& filename, int n_threads, bool direct_io) :
+		file(filename, AsyncFileIO::WRITE, direct_io), pool(n_threads) {
+	// Two blocks per thread, so that a batch keeps every thread busy:
+	raw.resize(2 * pool.size());
+	packed.resize(raw.size());
+	for (std::vector<char>& block : raw) {
+		block.reserve(BLOCK_SIZE);
+	}
+	if (!is_open()) {
+		return;
+	}
+	uint32_t block_size = BLOCK_SIZE;
+	file.write(LZ_FILE_MAGIC, sizeof(LZ_FILE_MAGIC));
+	file.write((const char*)&block_size, 4);
+	file_offset = HEADER_SIZE;
+}
+
+void CompressedFileWriter::write(const char* data, size_t n) {
+	while (n > 0) {
+		std::vector<char>& block = raw[n_filled];
+		size_t piece = std::min(n, BLOCK_SIZE - block.size());
+		block.insert(block.end(), data, data + piece);
+		data += piece, n -= piece;
+		if (block.size() == BLOCK_SIZE && ++n_filled == raw.size()) {
+			write_blocks();
+		}
+	}
+}
+
+void CompressedFileWriter::write_blocks() {
+	pool.parallel_for(n_filled, 1, [&](int, size_t begin, size_t end) {
+		for (size_t i = begin; i < end; i++) {
+			packed[i].resize(lz_compress_bound(raw[i].size()));
+			packed[i].resize(lz_compress(raw[i].data(), raw[i].size(), packed[i].data()));
+		}
+	});
+	for (size_t i = 0; i < n_filled; i++) {
+		uint32_t raw_size = raw[i].size();
+		bool stored = packed[i].size() >= raw[i].size();
+		const std::vector<char>& data = stored ? raw[i] : packed[i];
+		uint32_t packed_size = data.size() | (stored ? STORED_FLAG : 0);
+		file.write((const char*)&packed_size, 4);
+		file.write((const char*)&raw_size, 4);
+		file.write(data.data(), data.size());
+
+		uint64_t data_offset = file_offset + 8;
+		append(index, &data_offset, 8);
+		append(index, &raw_offset, 8);
+		append(index, &packed_size, 4);
+		append(index, &raw_size, 4);
+		file_offset += 8 + data.size();
+		raw_offset += raw_size;
+		raw[i].clear();
+	}
+	n_filled = 0;
+}
+
+bool CompressedFileWriter::close() {
+	if (closed) {
+		return false;
+	}
+	closed = true;
+	if (!raw[n_filled].empty()) {
+		n_filled++;
+	}
+	write_blocks();
+	uint64_t index_offset = file_offset;
+	uint64_t n_blocks = index.size() / INDEX_ENTRY_SIZE;
+	file.write(index.data(), index.size());
+	file.write((const char*)&index_offset, 8);
+	file.write((const char*)&n_blocks, 8);
+	file.write(LZ_INDEX_MAGIC, sizeof(LZ_INDEX_MAGIC));
+	file_offset += index.size() + TRAILER_SIZE;
+	return file.close();
+}
+
+void CompressedFileWriter::flushf(void* context, const char* data, size_t size) {
+	((CompressedFileWriter*)context)->write(data, size);
+}
+
+void CompressedFileWriter::closef(void* context) {
+	CompressedFileWriter* writer = (CompressedFileWriter*)context;
+	bool ok = writer->close();
+	delete writer;
+	if (!ok) {
+		serialize_buffer_error("Could not write the compressed file out durably");
+	}
+}
+
+/*****************************************************************************
+ * Reader
+ *****************************************************************************/
+
+static bool pread_all(int fd, void* data, size_t n, uint64_t offset) {
+	char* p = (char*)data;
+	while (n > 0) {
+		ssize_t got = pread(fd, p, n, offset);
+		if (got <= 0) {
+			return false;
+		}
+		p += got, n -= got, offset += got;
+	}
+	return true;
+}
+
+bool CompressedFileReader::is_compressed(const std::string& filename) {
+	int fd = open(filename.c_str(), O_RDONLY);
+	if (fd < 0) {
+		return false;
+	}
+	char magic[sizeof(LZ_FILE_MAGIC)];
+	bool result = pread_all(fd, magic, sizeof(magic), 0) && memcmp(magic, LZ_FILE_MAGIC, sizeof(magic)) == 0;
+	::close(fd);
+	return result;
+}
+
+CompressedFileReader::CompressedFileReader(const std::string& filename, int n_threads) :
+		pool(n_threads) {
+	fd = open(filename.c_str(), O_RDONLY);
+	if (fd < 0) {
+		return;
+	}
+	// The trailer locates the index:
+	off_t size = lseek(fd, 0, SEEK_END);
+	char trailer[TRAILER_SIZE];
+	uint64_t index_offset = 0, n_blocks = 0;
+	bool ok = size >= (off_t)(HEADER_SIZE + TRAILER_SIZE) && pread_all(fd, trailer, TRAILER_SIZE, size - TRAILER_SIZE)
+			&& memcmp(trailer + 16, LZ_INDEX_MAGIC, sizeof(LZ_INDEX_MAGIC)) == 0;
+	if (ok) {
+		memcpy(&index_offset, trailer, 8);
+		memcpy(&n_blocks, trailer + 8, 8);
+		ok = index_offset + n_blocks * INDEX_ENTRY_SIZE + TRAILER_SIZE == (uint64_t)size;
+	}
+	std::vector<char> index(ok ? n_blocks * INDEX_ENTRY_SIZE : 0);
+	ok = ok && pread_all(fd, index.data(), index.size(), index_offset);
+	if (!ok) {
+		serialize_buffer_error("Compressed file '" + filename + "' is truncated or corrupt");
+	}
+	blocks.resize(n_blocks);
+	for (size_t i = 0; i < n_blocks; i++) {
+		const char* entry = &index[i * INDEX_ENTRY_SIZE];
+		Block& b = blocks[i];
+		memcpy(&b.file_offset, entry, 8);
+		memcpy(&b.raw_offset, entry + 8, 8);
+		memcpy(&b.packed_size, entry + 16, 4);
+		memcpy(&b.raw_size, entry + 20, 4);
+		LSERIALIZE_CHECK(b.raw_offset == total_raw_size);
+		total_raw_size += b.raw_size;
+	}
+}
+
+CompressedFileReader::~CompressedFileReader() {
+	if (fd >= 0) {
+		::close(fd);
+	}
+}
+
+void CompressedFileReader::decode_blocks(size_t first, size_t n) {
+	batch_first = first;
+	decoded.resize(n);
+	// Failures are only reported once every thread is done: throwing from a pool job
+	// would take down the worker (or unwind under the others)
+	std::vector<char> ok(n, false);
+	pool.parallel_for(n, 1, [&](int, size_t begin, size_t end) {
+		std::vector<char> packed;
+		for (size_t i = begin; i < end; i++) {
+			const Block& b = blocks[first + i];
+			uint32_t packed_size = b.packed_size & ~STORED_FLAG;
+			decoded[i].resize(b.raw_size);
+			if (b.packed_size & STORED_FLAG) {
+				ok[i] = packed_size == b.raw_size && pread_all(fd, decoded[i].data(), packed_size, b.file_offset);
+			} else {
+				packed.resize(packed_size);
+				ok[i] = pread_all(fd, packed.data(), packed_size, b.file_offset)
+						&& lz_decompress(packed.data(), packed_size, decoded[i].data(), b.raw_size);
+			}
+		}
+	});
+	for (size_t i = 0; i < n; i++) {
+		if (!ok[i]) {
+			// Nothing of the batch is kept, so reading again retries it
+			decoded.clear();
+			serialize_buffer_error(format("Compressed block %zu is corrupt or could not be read", first + i));
+		}
+	}
+}
+
+size_t CompressedFileReader::read_at(uint64_t offset, char* data, size_t n) {
+	size_t total = 0;
+	while (total < n && offset < total_raw_size) {
+		// The block holding 'offset':
+		size_t i = std::upper_bound(blocks.begin(), blocks.end(), offset, [](uint64_t o, const Block& b) {
+			return o < b.raw_offset;
+		}) - blocks.begin() - 1;
+		if (i < batch_first || i >= batch_first + decoded.size()) {
+			// Decode a batch ahead, two blocks per thread:
+			decode_blocks(i, std::min(blocks.size() - i, (size_t)2 * pool.size()));
+		}
+		const Block& b = blocks[i];
+		const std::vector<char>& block = decoded[i - batch_first];
+		size_t start = offset - b.raw_offset;
+		size_t piece = std::min(n - total, (size_t)b.raw_size - start);
+		memcpy(data + total, block.data() + start, piece);
+		total += piece, offset += piece;
+	}
+	return total;
+}
+
+size_t CompressedFileReader::read(char* data, size_t n) {
+	size_t got = read_at(position, data, n);
+	position += got;
+	return got;
+}
+
+void CompressedFileReader::fillf(void* context, std::vector<char>& buffer, size_t maxsize) {
+	size_t end = buffer.size();
+	buffer.resize(maxsize);
+	size_t got = ((CompressedFileReader*)context)->read(&buffer[end], maxsize - end);
+	buffer.resize(end + got);
+}
+
+size_t CompressedFileReader::readf(void* context, char* data, size_t size) {
+	return ((CompressedFileReader*)context)->read(data, size);
+}
+
+void CompressedFileReader::closef(void* context) {
+	delete (CompressedFileReader*)context;
+}
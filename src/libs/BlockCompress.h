@@ -0,0 +1,125 @@
+/*
+ * BlockCompress.h:
+ *  In-process LZ compression for serialized files, as SerializeBuffer backends.
+ *
+ *  The codec is LZ77 with LZ4's sequence layout: a token byte with the literal and match
+ *  lengths, the literals, a 2-byte offset, and 255-runs for long lengths. It compresses
+ *  at hundreds of MB/s, and decompression is a tight copy loop.
+ *
+ *  Files are split into 1MB blocks, compressed independently (in parallel, on a ThreadPool):
+ *    magic "INFSLZ1\0", u32 block size
+ *    per block: u32 packed size (top bit set if stored uncompressed), u32 raw size, data
+ *    index: per block u64 file offset, u64 raw offset, u32 packed size, u32 raw size
+ *    trailer: u64 index offset, u64 block count, magic "INFSLZI\0"
+ *  Streams can be read front to back from the block headers alone; the index at the end
+ *  gives random access to any raw offset.
+ */
+
+#ifndef BLOCKCOMPRESS_H_
+#define BLOCKCOMPRESS_H_
+
+#include <string>
+#include <vector>
+
+#include "int_types.h"
+
+#include "AsyncFileIO.h"
+#include "ThreadPool.h"
+
+// Worst case compressed size of 'n' bytes
+size_t lz_compress_bound(size_t n);
+// Compresses 'n' bytes into 'dst' (of at least lz_compress_bound(n) bytes), returning the size
+size_t lz_compress(const char* src, size_t n, char* dst);
+// Decompresses into exactly 'dst_size' bytes; returns false on malformed input
+bool lz_decompress(const char* src, size_t n, char* dst, size_t dst_size);
+
+class CompressedFileWriter {
+public:
+	static const size_t BLOCK_SIZE = 1024 * 1024;
+
+	// n_threads <= 0 uses every core
+	CompressedFileWriter(const std::string& filename, int n_threads = 0, bool direct_io = false);
+
+	bool is_open() const {
+		return file.is_open();
+	}
+	void write(const char* data, size_t n);
+	// Compresses and writes out the rest, then the index, and fsyncs (see AsyncFileIO).
+	// Returns false if any write failed.
+	bool close();
+
+	uint64_t raw_size() const {
+		return raw_offset;
+	}
+	uint64_t compressed_size() const {
+		return file_offset;
+	}
+
+	// SerializeBuffer callbacks, with a CompressedFileWriter* as the context.
+	// closef deletes it, throwing SerializeBufferError if the file could not be written.
+	static void flushf(void* context, const char* data, size_t size);
+	static void closef(void* context);
+
+private:
+	// Compresses the filled blocks in parallel, and writes them out in order
+	void write_blocks();
+
+	AsyncFileIO file;
+	ThreadPool pool;
+	// Blocks being filled, and their compressed forms
+	std::vector<std::vector<char>> raw, packed;
+	size_t n_filled = 0;
+	// Index entries, as written to the file
+	std::vector<char> index;
+	uint64_t file_offset = 0, raw_offset = 0;
+	bool closed = false;
+};
+
+class CompressedFileReader {
+public:
+	// n_threads <= 0 uses every core
+	CompressedFileReader(const std::string& filename, int n_threads = 0);
+	~CompressedFileReader();
+
+	// True if 'filename' starts with the compressed file magic
+	static bool is_compressed(const std::string& filename);
+
+	bool is_open() const {
+		return fd >= 0;
+	}
+	size_t n_blocks() const {
+		return blocks.size();
+	}
+	uint64_t raw_size() const {
+		return total_raw_size;
+	}
+	// Random access: the raw bytes [offset, offset + n), returning fewer at the end of the data
+	size_t read_at(uint64_t offset, char* data, size_t n);
+	// Sequential reads, decompressing a batch of blocks ahead in parallel
+	size_t read(char* data, size_t n);
+
+	// SerializeBuffer callbacks, with a CompressedFileReader* as the context. closef deletes it.
+	static void fillf(void* context, std::vector<char>& buffer, size_t maxsize);
+	static size_t readf(void* context, char* data, size_t size);
+	static void closef(void* context);
+
+private:
+	struct Block {
+		uint64_t file_offset, raw_offset;
+		uint32_t packed_size, raw_size;
+	};
+	// Decompresses blocks [first, first + n) into 'decoded', in parallel
+	void decode_blocks(size_t first, size_t n);
+
+	int fd = -1;
+	ThreadPool pool;
+	std::vector<Block> blocks;
+	uint64_t total_raw_size = 0;
+	// The decoded batch: blocks [batch_first, batch_first + decoded.size())
+	std::vector<std::vector<char>> decoded;
+	size_t batch_first = 0;
+	// Sequential position
+	uint64_t position = 0;
+};
+
+#endif /* BLOCKCOMPRESS_H_ */
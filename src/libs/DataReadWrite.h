@@ -4,19 +4,52 @@
 #include <cstdio>
 #include <iostream>
 #include <string>
+#include <type_traits>
+#include <vector>
 
 #include <map>
 
+#include "AsyncFileIO.h"
+#include "BlockCompress.h"
 #include "SerializeBuffer.h"
 #include "smartptr.h"
 
 #include "customassert.h"
 
+/*
+ * Files start with a header: DATA_FILE_MAGIC, then a byte that is 1 if the rest is
+ * native-endian, in which case the writer's byte order mark follows (as written).
+ * Native-endian files are the fast path; portable files store scalars big-endian.
+ */
+static const char DATA_FILE_MAGIC[8] = {'I', 'N', 'F', 'S', 'D', 'A', 'T', '2'};
+static const uint32_t DATA_FILE_BYTE_ORDER = 0x01020304;
+
 /* Passed to objects visit() method during writing: */
 struct DataWriter {
-	DataWriter(const std::string& fname) {
-		FILE* file = fopen(fname.c_str(), "wb"); // write-binary
-		buffer.set( new SerializeBuffer(file, SerializeBuffer::OUTPUT, /* Close file: */ true));
+	// Writes on a background thread (see AsyncFileIO.h); direct_io bypasses the page cache.
+	// If 'compressed', the file is LZ-compressed in blocks (see BlockCompress.h).
+	DataWriter(const std::string& fname, bool native_endian = true, bool direct_io = false, bool compressed = false) {
+		if (compressed) {
+			CompressedFileWriter* file = new CompressedFileWriter(fname, 0, direct_io);
+			if (!file->is_open()) {
+				delete file;
+				ASSERT(false, "Could not open file for writing!");
+			}
+			buffer.set(new SerializeBuffer(file, CompressedFileWriter::flushf, NULL, CompressedFileWriter::closef));
+		} else {
+			AsyncFileIO* file = new AsyncFileIO(fname, AsyncFileIO::WRITE, direct_io);
+			if (!file->is_open()) {
+				delete file;
+				ASSERT(false, "Could not open file for writing!");
+			}
+			buffer.set(new SerializeBuffer(file, AsyncFileIO::flushf, NULL, AsyncFileIO::closef));
+		}
+		buffer->write_raw(DATA_FILE_MAGIC, sizeof(DATA_FILE_MAGIC));
+		buffer->write_byte(native_endian);
+		if (native_endian) {
+			buffer->write_raw((const char*)&DATA_FILE_BYTE_ORDER, sizeof(DATA_FILE_BYTE_ORDER));
+		}
+		buffer->set_native_endian(native_endian);
 	}
 
     template <typename T>
@@ -26,12 +59,12 @@ struct DataWriter {
 
     template <typename T>
     void visit(std::vector<T>& obj) {
-        buffer->write_container(obj);
+        write_elements(obj, std::is_arithmetic<T>());
     }
 
     template <typename T>
     void visit(const std::vector<T>& obj) {
-        buffer->write_container(obj);
+        write_elements(obj, std::is_arithmetic<T>());
     }
 
     /**
@@ -92,6 +125,12 @@ struct DataWriter {
         (*this) << size;
     }
 
+    // Writes everything out and fsyncs, throwing SerializeBufferError on failure.
+    // Otherwise done on destruction, where errors cannot be reported.
+    void close() {
+        buffer->close();
+    }
+
     bool is_reading() {
         return false;
     }
@@ -107,16 +146,48 @@ struct DataWriter {
 private:
     std::map<void*, smartptr<void*>> ptr_map;
     smartptr<SerializeBuffer> buffer;
+
+    template <typename T>
+    void write_elements(const std::vector<T>& obj, std::true_type /* arithmetic */) {
+        buffer->write_container(obj);
+    }
+    // Structs are bulk copied when native-endian, and otherwise written field by field
+    // through their visit(); read back by DataReader::read_elements
+    template <typename T>
+    void write_elements(const std::vector<T>& obj, std::false_type /* arithmetic */) {
+        if (buffer->native_endian() || sizeof(T) == 1) {
+            buffer->write_container(obj);
+            return;
+        }
+        buffer->write((uint64_t)obj.size());
+        for (const T& elem : obj) {
+            const_cast<T&>(elem).visit(*this);
+        }
+    }
 };
 
 /* Passed to objects visit() method during reading: */
 struct DataReader {
-	DataReader(const std::string& fname) {
-        FILE* file = fopen(fname.c_str(), "rb"); // read-binary
-        buffer.set(new SerializeBuffer(file, SerializeBuffer::INPUT, /* Close file: */true));
+	// Reads ahead on a background thread (see AsyncFileIO.h), or decompresses
+	// blocks ahead in parallel if the file was written compressed
+	DataReader(const std::string& fname, bool direct_io = false) {
+        if (CompressedFileReader::is_compressed(fname)) {
+            CompressedFileReader* file = new CompressedFileReader(fname);
+            buffer.set(new SerializeBuffer(file, NULL, CompressedFileReader::fillf, CompressedFileReader::closef, CompressedFileReader::readf));
+            read_header();
+            return;
+        }
+        AsyncFileIO* file = new AsyncFileIO(fname, AsyncFileIO::READ, direct_io);
+        if (!file->is_open()) {
+            delete file;
+            ASSERT(false, "Could not open file for reading!");
+        }
+        buffer.set(new SerializeBuffer(file, NULL, AsyncFileIO::fillf, AsyncFileIO::closef, AsyncFileIO::readf));
+        read_header();
     }
 	DataReader() {
 		buffer.set(new SerializeBuffer(stdin, SerializeBuffer::INPUT, /* Do not close file: */false));
+		read_header();
 	}
 
     template <typename T>
@@ -162,7 +233,7 @@ struct DataReader {
 
     template <typename T>
     void visit(std::vector<T>& obj) {
-        buffer->read_container(obj);
+        read_elements(obj, std::is_arithmetic<T>());
     }
 
     template <typename T>
@@ -208,9 +279,38 @@ struct DataReader {
 private:
     std::map<void*, smartptr<void*>> ptr_map;
     smartptr<SerializeBuffer> buffer;
+    void read_header() {
+        char magic[sizeof(DATA_FILE_MAGIC)];
+        buffer->read_raw(magic, sizeof(magic));
+        ASSERT(memcmp(magic, DATA_FILE_MAGIC, sizeof(magic)) == 0, "Not a data file, or written by an older version!");
+        bool native_endian = buffer->read_byte();
+        if (native_endian) {
+            uint32_t byte_order;
+            buffer->read_raw((char*)&byte_order, sizeof(byte_order));
+            ASSERT(byte_order == DATA_FILE_BYTE_ORDER, "Data file was written with a different byte order!");
+        }
+        buffer->set_native_endian(native_endian);
+    }
     void visit_raw(char* data, size_t n) {
         buffer->read_raw(data, n);
     }
+    template <typename T>
+    void read_elements(std::vector<T>& obj, std::true_type /* arithmetic */) {
+        buffer->read_container(obj);
+    }
+    template <typename T>
+    void read_elements(std::vector<T>& obj, std::false_type /* arithmetic */) {
+        if (buffer->native_endian() || sizeof(T) == 1) {
+            buffer->read_container(obj);
+            return;
+        }
+        uint64_t size;
+        buffer->read(size);
+        obj.resize(size);
+        for (T& elem : obj) {
+            elem.visit(*this);
+        }
+    }
 };
 
 // Read-write macro with 1 variable:
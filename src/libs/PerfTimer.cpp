@@ -4,111 +4,500 @@
  *  Public domain (by Adam Domurad)
  */
 
-#include <map>
 #include <string>
+#include <clocale>
 #include <cstdio>
+#include <cstring>
 #include <cmath>
 #include <algorithm>
 #include <vector>
 #include "PerfTimer.h"
 
-void MethodPerfProfile::begin_timer() {
-	timer.start();
+static uint64_t monotonic_nanoseconds() {
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
 
-void MethodPerfProfile::end_timer() {
-	long timemicro = timer.get_microseconds();
-	total_calls++;
-	total_microseconds += timemicro;
+// Both clocks at startup, for calibrating ticks against CLOCK_MONOTONIC_RAW
+static const uint64_t start_ticks = perf_ticks(), start_nanoseconds = monotonic_nanoseconds();
 
-	// Note, converting to float can be pricey
-	double ftime = timemicro;
-	double avg2 = total_microseconds / double(total_calls);
+double PerfTimer::ticks_per_microsecond() {
+	uint64_t ns = monotonic_nanoseconds();
+	// Too short a baseline would make for a poor estimate:
+	while (ns - start_nanoseconds < 1000000) {
+		ns = monotonic_nanoseconds();
+	}
+	return (perf_ticks() - start_ticks) / ((ns - start_nanoseconds) / 1000.0);
+}
 
-	max_microseconds = std::max(max_microseconds, timemicro);
-	qvalue += (ftime - avg) * (ftime - avg2); // Part of a standard deviation formula, hell if I understand it
-	avg = avg2;
+int PerfTimer::register_site(const char* name) {
+	std::lock_guard<std::mutex> lock(mutex);
+	for (size_t i = 0; i < names.size(); i++) {
+		if (names[i] == name) {
+			return i;
+		}
+	}
+	names.push_back(name);
+	return names.size() - 1;
 }
 
-void PerfTimer::begin(const char* method) {
-	perf_map[method].begin_timer();
+uint64_t perf_bucket_limit(int bucket) {
+	if (bucket < PERF_SUB_BUCKETS) {
+		return bucket;
+	}
+	int shift = bucket / PERF_SUB_BUCKETS - 1;
+	uint64_t lowest = uint64_t(PERF_SUB_BUCKETS + bucket % PERF_SUB_BUCKETS) << shift;
+	return lowest + ((uint64_t(1) << shift) - 1);
 }
 
-void PerfTimer::end(const char* method) {
-	perf_map[method].end_timer();
+uint64_t PerfSlot::percentile(double fraction) const {
+	uint64_t seen = 0;
+	for (int i = 0; i < (int)histogram.size(); i++) {
+		seen += histogram[i];
+		if (seen > 0 && seen >= fraction * calls) {
+			return std::min(perf_bucket_limit(i), max);
+		}
+	}
+	return max;
 }
 
-struct PProfile {
-	std::string func_name;
-	MethodPerfProfile profile;
-	bool operator<(const PProfile& pp) const {
-		return profile.total_microseconds > pp.profile.total_microseconds;
+static int find_child(const std::vector<PerfNode>& tree, int parent, int site) {
+	for (int c = tree[parent].first_child; c >= 0; c = tree[c].next_sibling) {
+		if (tree[c].site == site) {
+			return c;
+		}
 	}
-};
+	return -1;
+}
+
+static int link_child(std::vector<PerfNode>& tree, int parent, int site) {
+	tree.emplace_back(site, parent);
+	tree.back().slot.histogram.resize(PERF_BUCKETS);
+	int child = tree.size() - 1;
+	tree[child].next_sibling = tree[parent].first_child;
+	tree[parent].first_child = child;
+	return child;
+}
+
+PerfThread* PerfTimer::add_thread() {
+	std::lock_guard<std::mutex> lock(mutex);
+	if (!released.empty()) {
+		PerfThread* thread = released.back();
+		released.pop_back();
+		return thread;
+	}
+	threads.emplace_back(new PerfThread());
+	threads.back()->id = threads.size() - 1;
+	threads.back()->nodes.emplace_back(-1, -1);
+	return threads.back().get();
+}
+
+void PerfTimer::release_thread(PerfThread* thread) {
+	std::lock_guard<std::mutex> lock(mutex);
+	released.push_back(thread);
+}
+
+int PerfTimer::add_child(PerfThread* thread, int parent, int site) {
+	std::lock_guard<std::mutex> lock(mutex);
+	return link_child(thread->nodes, parent, site);
+}
+
+std::vector<PerfNode> PerfTimer::merged() {
+	std::lock_guard<std::mutex> lock(mutex);
+	std::vector<PerfNode> tree;
+	tree.emplace_back(-1, -1);
+	std::vector<int> merged_index;
+	for (auto& thread : threads) {
+		const std::vector<PerfNode>& nodes = thread->nodes;
+		merged_index.assign(nodes.size(), 0);
+		tree[0].child_total += nodes[0].child_total;
+		for (size_t i = 1; i < nodes.size(); i++) {
+			const PerfNode& node = nodes[i];
+			int parent = merged_index[node.parent];
+			int m = find_child(tree, parent, node.site);
+			if (m < 0) {
+				m = link_child(tree, parent, node.site);
+			}
+			merged_index[i] = m;
+			tree[m].slot.merge(node.slot);
+			tree[m].recursive += node.recursive;
+			tree[m].child_total += node.child_total;
+		}
+	}
+	return tree;
+}
+
+std::vector<PerfSiteTotals> PerfTimer::site_totals(const std::vector<PerfNode>& tree) {
+	std::vector<PerfSiteTotals> totals;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		totals.resize(names.size());
+	}
+	for (size_t i = 1; i < tree.size(); i++) {
+		const PerfNode& node = tree[i];
+		PerfSiteTotals& site = totals[node.site];
+		// Exclusive times never overlap, so every node contributes
+		if (node.slot.total > node.child_total) {
+			site.exclusive += node.slot.total - node.child_total;
+		}
+		site.recursive += node.recursive;
+		bool nested = false;
+		for (int a = node.parent; a > 0 && !nested; a = tree[a].parent) {
+			nested = (tree[a].site == node.site);
+		}
+		// Indirect recursion: already inside the outer activation's time
+		if (nested) {
+			site.recursive += node.slot.calls;
+		} else {
+			site.slot.merge(node.slot);
+		}
+	}
+	return totals;
+}
+
+int PerfTimer::find(const char* name) {
+	std::lock_guard<std::mutex> lock(mutex);
+	for (size_t i = 0; i < names.size(); i++) {
+		if (names[i] == name) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+void PerfTimer::print_tree(const std::vector<PerfNode>& tree, int node, int depth,
+		double root_total, double ticks_per_ms) {
+	std::vector<int> children;
+	for (int c = tree[node].first_child; c >= 0; c = tree[c].next_sibling) {
+		const PerfNode& child = tree[c];
+		if (child.slot.calls > 0 || child.recursive > 0 || child.child_total > 0) {
+			children.push_back(c);
+		}
+	}
+	std::sort(children.begin(), children.end(), [&](int a, int b) {
+		return tree[a].slot.total > tree[b].slot.total;
+	});
+	for (int c : children) {
+		const PerfNode& child = tree[c];
+		uint64_t exclusive = (child.slot.total > child.child_total) ? child.slot.total - child.child_total : 0;
+		printf("%*s%6.2f%% %'10.2fms  self %'.2fms  calls %'d  %s\n",
+				depth * 2, "",
+				(root_total > 0) ? child.slot.total * 100.0 / root_total : 0.0,
+				child.slot.total / ticks_per_ms, exclusive / ticks_per_ms,
+				int(child.slot.calls + child.recursive),
+				names[child.site].c_str());
+		print_tree(tree, c, depth + 1, root_total, ticks_per_ms);
+	}
+}
+
+std::vector<PerfSummary> PerfTimer::summaries(const std::vector<PerfNode>& tree, double ticks_per_ms) {
+	std::vector<PerfSiteTotals> totals = site_totals(tree);
+	std::vector<PerfSummary> sorted_perfs;
+	for (size_t i = 0; i < totals.size(); i++) {
+		const PerfSlot& mpp = totals[i].slot;
+		if (mpp.calls == 0) {
+			continue;
+		}
+		double mean_ticks = mpp.total / double(mpp.calls);
+		double variance = std::max(0.0, mpp.sum_squares / mpp.calls - mean_ticks * mean_ticks);
+		PerfSummary summary;
+		summary.name = names[i];
+		summary.calls = mpp.calls + totals[i].recursive;
+		summary.total = mpp.total / ticks_per_ms;
+		summary.exclusive = totals[i].exclusive / ticks_per_ms;
+		summary.average = mean_ticks / ticks_per_ms;
+		summary.max = mpp.max / ticks_per_ms;
+		summary.stddev = sqrt(variance) / ticks_per_ms;
+		summary.p50 = mpp.percentile(0.5) / ticks_per_ms;
+		summary.p90 = mpp.percentile(0.9) / ticks_per_ms;
+		summary.p99 = mpp.percentile(0.99) / ticks_per_ms;
+		summary.p999 = mpp.percentile(0.999) / ticks_per_ms;
+		sorted_perfs.push_back(summary);
+	}
+	std::sort(sorted_perfs.begin(), sorted_perfs.end(), [](const PerfSummary& a, const PerfSummary& b) {
+		return a.total > b.total;
+	});
+	return sorted_perfs;
+}
+
+std::vector<PerfSummary> PerfTimer::summaries() {
+	return summaries(merged(), ticks_per_microsecond() * 1000);
+}
 
 void PerfTimer::print_results() {
 //	printf("**** START PERFORMANCE STATS ****\n");
-	std::vector<PProfile> sorted_perfs;
-	for (auto& perf : perf_map) {
-		PProfile profile;
-		profile.func_name = perf.first;
-		profile.profile = perf.second;
-		sorted_perfs.push_back(profile);
-	}
-	std::sort(sorted_perfs.begin(), sorted_perfs.end());
+	double ticks_per_ms = ticks_per_microsecond() * 1000;
+	std::vector<PerfNode> tree = merged();
+	std::vector<PerfSummary> sorted_perfs = summaries(tree, ticks_per_ms);
 
     setlocale(LC_NUMERIC, "");
 	for (int i = 0; i < sorted_perfs.size(); i++) {
-		MethodPerfProfile& mpp = sorted_perfs[i].profile;
-		float total = mpp.total_microseconds / 1000.0f;
-		float max = mpp.max_microseconds / 1000.0f;
-		float avg = total / mpp.total_calls;
-		float stddev = sqrt(mpp.qvalue / mpp.total_calls) / 1000.0f;
-		float stddev_percentage = (stddev / avg) * 100.0f;
+		PerfSummary& mpp = sorted_perfs[i];
+		float stddev_percentage = (mpp.stddev / mpp.average) * 100.0f;
 		printf("func %s:\n"
 				"\t>> total %'*.2fms"
+				"\n\texclusive %'*.2fms"
 				"\n\tcalls %'*d"
 		        "\n\taverage %'*.2fms"
 		        "\n\tmax %'*.2fms"
-				"\n\tstd.dev    +-%'.4fms, +-%'.2f%%\n",
-				sorted_perfs[i].func_name.c_str(),
-				10, total, 13, int(mpp.total_calls),
-				11, avg, 15, max,
-				stddev, stddev_percentage);
+				"\n\tstd.dev    +-%'.4fms, +-%'.2f%%"
+				"\n\tp50 %'.4fms  p90 %'.4fms  p99 %'.4fms  p99.9 %'.4fms  max %'.4fms\n",
+				mpp.name.c_str(),
+				10, mpp.total, 9, mpp.exclusive,
+				13, int(mpp.calls),
+				11, mpp.average, 15, mpp.max,
+				mpp.stddev, stddev_percentage,
+				mpp.p50, mpp.p90, mpp.p99, mpp.p999, mpp.max);
+	}
+	if (!sorted_perfs.empty()) {
+		printf("call tree (%% of all timed scopes, total, exclusive):\n");
+		print_tree(tree, 0, 1, tree[0].child_total, ticks_per_ms);
 	}
     setlocale(LC_CTYPE, "");
 //	printf("**** END PERFORMANCE STATS ****\n");
 }
 
-double PerfTimer::average_time(const char* method) {
-	MethodPerfProfile& mpp = perf_map[method];
-	float total = mpp.total_microseconds / 1000.0f;
-	return total / mpp.total_calls;
+void PerfTimer::clear() {
+	std::lock_guard<std::mutex> lock(mutex);
+	for (auto& thread : threads) {
+		for (PerfNode& node : thread->nodes) {
+			node.slot.reset();
+			node.recursive = 0;
+			node.child_total = 0;
+		}
+	}
 }
 
-void PerfTimer::clear() {
-	perf_map.clear();
+void PerfTimer::start_trace(size_t min_events) {
+	std::lock_guard<std::mutex> lock(mutex);
+	events_per_thread = 2;
+	while (events_per_thread < min_events) {
+		events_per_thread *= 2;
+	}
+}
+
+void PerfTimer::add_events(PerfThread* thread) {
+	std::lock_guard<std::mutex> lock(mutex);
+	thread->events.resize(events_per_thread);
+}
+
+static std::string json_string(const std::string& str) {
+	std::string result = "\"";
+	for (char c : str) {
+		if (c == '"' || c == '\\') {
+			result += '\\';
+			result += c;
+		} else if ((unsigned char)c < 0x20) {
+			char escaped[8];
+			snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+			result += escaped;
+		} else {
+			result += c;
+		}
+	}
+	return result + "\"";
+}
+
+static std::string csv_string(const std::string& str) {
+	std::string result = "\"";
+	for (char c : str) {
+		result += c;
+		if (c == '"') {
+			result += c;
+		}
+	}
+	return result + "\"";
+}
+
+// Machine-readable output always uses '.' for decimals (print_results sets the user's locale)
+struct NumericLocaleC {
+	std::string previous;
+	NumericLocaleC() : previous(setlocale(LC_NUMERIC, NULL)) {
+		setlocale(LC_NUMERIC, "C");
+	}
+	~NumericLocaleC() {
+		setlocale(LC_NUMERIC, previous.c_str());
+	}
+};
+
+bool PerfTimer::write_trace(const char* filename) {
+	double ticks_per_us = ticks_per_microsecond();
+	FILE* file = fopen(filename, "w");
+	if (file == NULL) {
+		return false;
+	}
+	NumericLocaleC locale;
+	std::lock_guard<std::mutex> lock(mutex);
+	std::vector<std::string> json_names;
+	for (std::string& name : names) {
+		json_names.push_back(json_string(name));
+	}
+	fprintf(file, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+	for (size_t t = 0; t < threads.size(); t++) {
+		PerfThread& thread = *threads[t];
+		fprintf(file, "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, "
+				"\"args\": {\"name\": \"thread %d\"}}", (t == 0) ? "" : ",\n", thread.id, thread.id);
+		uint64_t capacity = thread.events.size();
+		uint64_t first = (thread.n_events > capacity) ? thread.n_events - capacity : 0;
+		for (uint64_t i = first; i < thread.n_events; i++) {
+			const PerfEvent& event = thread.events[i & (capacity - 1)];
+			fprintf(file, ",\n{\"name\": %s, \"cat\": \"perf\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, "
+					"\"ts\": %.3f, \"dur\": %.3f}", json_names[event.site].c_str(), thread.id,
+					int64_t(event.start - start_ticks) / ticks_per_us, event.ticks / ticks_per_us);
+		}
+	}
+	fprintf(file, "\n]}\n");
+	bool ok = !ferror(file);
+	return (fclose(file) == 0) && ok;
+}
+
+void PerfTimer::summarize(const char* unitname) {
+	std::vector<PerfSummary> rows = summaries();
+	for (PerfSummary& row : rows) {
+		row.unit = unitname;
+	}
+	std::lock_guard<std::mutex> lock(mutex);
+	kept_summaries.insert(kept_summaries.end(), rows.begin(), rows.end());
+}
+
+bool PerfTimer::write_summary(const char* filename) {
+	std::vector<PerfSummary> rows;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		rows = kept_summaries;
+	}
+	FILE* file = fopen(filename, "w");
+	if (file == NULL) {
+		return false;
+	}
+	NumericLocaleC locale;
+	size_t length = strlen(filename);
+	bool csv = (length >= 4 && strcmp(filename + length - 4, ".csv") == 0);
+	if (csv) {
+		fprintf(file, "unit,name,calls,total_ms,exclusive_ms,average_ms,max_ms,stddev_ms,"
+				"p50_ms,p90_ms,p99_ms,p999_ms\n");
+	} else {
+		fprintf(file, "[");
+	}
+	for (size_t i = 0; i < rows.size(); i++) {
+		PerfSummary& row = rows[i];
+		if (csv) {
+			fprintf(file, "%s,%s,%llu,%.6f,%.6f,%.6f,%.6f,%.6f,%.6f,%.6f,%.6f,%.6f\n",
+					csv_string(row.unit).c_str(), csv_string(row.name).c_str(), (unsigned long long)row.calls,
+					row.total, row.exclusive, row.average, row.max, row.stddev,
+					row.p50, row.p90, row.p99, row.p999);
+		} else {
+			fprintf(file, "%s\n{\"unit\": %s, \"name\": %s, \"calls\": %llu, \"total_ms\": %.6f, "
+					"\"exclusive_ms\": %.6f, \"average_ms\": %.6f, \"max_ms\": %.6f, \"stddev_ms\": %.6f, "
+					"\"p50_ms\": %.6f, \"p90_ms\": %.6f, \"p99_ms\": %.6f, \"p999_ms\": %.6f}",
+					(i == 0) ? "" : ",", json_string(row.unit).c_str(), json_string(row.name).c_str(),
+					(unsigned long long)row.calls, row.total, row.exclusive, row.average, row.max,
+					row.stddev, row.p50, row.p90, row.p99, row.p999);
+		}
+	}
+	if (!csv) {
+		fprintf(file, "\n]\n");
+	}
+	bool ok = !ferror(file);
+	return (fclose(file) == 0) && ok;
 }
 
-static PerfTimer __global_timer;
+// Constructed on first use, as callsites may register during static initialization
+static PerfTimer& global_timer() {
+	static PerfTimer timer;
+	return timer;
+}
+
+thread_local PerfThread* perf_thread = NULL;
+std::atomic<bool> perf_tracing(false);
+uint64_t perf_trace_min_ticks = 0;
 
-void perf_timer_begin(const char* funcname) {
-	__global_timer.begin(funcname);
+int perf_register_site(const char* name) {
+	return global_timer().register_site(name);
+}
+
+// Hands the thread's call tree (and event ring) on when the thread exits, so that
+// short-lived threads do not each keep their own
+struct PerfThreadRelease {
+	PerfThread* thread = NULL;
+	~PerfThreadRelease() {
+		if (thread != NULL) {
+			perf_thread = NULL;
+			global_timer().release_thread(thread);
+		}
+	}
+};
+
+static thread_local PerfThreadRelease perf_thread_release;
+
+PerfThread* perf_add_thread() {
+	perf_thread = global_timer().add_thread();
+	perf_thread_release.thread = perf_thread;
+	return perf_thread;
+}
+
+int perf_child_slow(PerfThread* thread, int parent, int site) {
+	// Only this thread changes its tree's shape, so searching needs no lock
+	int child = find_child(thread->nodes, parent, site);
+	if (child < 0) {
+		child = global_timer().add_child(thread, parent, site);
+	}
+	thread->nodes[parent].last_child = child;
+	return child;
 }
 
 void perf_timer_clear() {
-	__global_timer.clear();
+	global_timer().clear();
 }
 
-void perf_timer_end(const char* funcname) {
-	__global_timer.end(funcname);
+PerfSiteTotals perf_timer_totals(const char* funcname) {
+	int site = global_timer().find(funcname);
+	if (site < 0) {
+		return PerfSiteTotals();
+	}
+	return global_timer().site_totals(global_timer().merged())[site];
 }
 
 double perf_timer_average_time(const char* funcname) {
-	return __global_timer.average_time(funcname);
+	PerfSlot slot = perf_timer_totals(funcname).slot;
+	if (slot.calls == 0) {
+		return 0;
+	}
+	return slot.total / global_timer().ticks_per_microsecond() / 1000.0 / slot.calls;
+}
+
+uint64_t perf_timer_calls(const char* funcname) {
+	PerfSiteTotals totals = perf_timer_totals(funcname);
+	return totals.slot.calls + totals.recursive;
 }
 
 void perf_print_results() {
-	__global_timer.print_results();
+	global_timer().print_results();
 }
 
+void perf_events_slow(PerfThread* thread) {
+	global_timer().add_events(thread);
+}
+
+void perf_trace_start(size_t events_per_thread, double min_microseconds) {
+	global_timer().start_trace(events_per_thread);
+	perf_trace_min_ticks = (min_microseconds > 0) ? min_microseconds * global_timer().ticks_per_microsecond() : 0;
+	perf_tracing.store(true);
+}
+
+void perf_trace_stop() {
+	perf_tracing.store(false);
+}
+
+bool perf_write_trace(const char* filename) {
+	return global_timer().write_trace(filename);
+}
+
+void perf_summarize(const char* unitname) {
+	global_timer().summarize(unitname);
+}
+
+bool perf_write_summary(const char* filename) {
+	return global_timer().write_summary(filename);
+}
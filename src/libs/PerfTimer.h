@@ -1,41 +1,77 @@
 /*
  * PerfTimer.h:
- *  Provides timing information on a per-method basis>
+ *  Provides timing information on a per-method basis.
+ *  The registry behind perf_timer.h: the callsite names, and every thread's call tree.
  *  Public domain (by Adam Domurad)
  */
 
 #ifndef PERFTIMER_H_
 #define PERFTIMER_H_
 
-#include "google/dense_hash_map"
-#include "Timer.h"
-
-struct MethodPerfProfile {
-	Timer timer;
-	int total_calls;
-	long max_microseconds;
-	double total_microseconds;
-	double avg;
-	double qvalue; // used in formula standard deviation = square root of (Q / total calls)
-	MethodPerfProfile() :
-			total_calls(0), max_microseconds(0), total_microseconds(0), avg(0), qvalue(0) {
-	}
-	void begin_timer();
-	void end_timer();
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "perf_timer.h"
+
+// One site's totals over every node of the call tree it appears in
+struct PerfSiteTotals {
+	// Only activations not nested in another of the same site are timed here
+	PerfSlot slot;
+	uint64_t recursive = 0, exclusive = 0;
+};
+
+// One site's totals in milliseconds, as reported
+struct PerfSummary {
+	std::string unit, name;
+	// Including recursive calls
+	uint64_t calls;
+	double total, exclusive, average, max, stddev;
+	double p50, p90, p99, p999;
 };
 
 class PerfTimer {
 public:
-	// Call start(), stop() at the start and end of a method call
-	// Note: Does not work with recursive methods
-	void begin(const char* method);
-	void end(const char* method);
-	double average_time(const char* method);
+	int register_site(const char* name);
+	// Registers the calling thread's call tree, which outlives the thread:
+	// once released, the next thread to register carries on with it
+	PerfThread* add_thread();
+	void release_thread(PerfThread* thread);
+	int add_child(PerfThread* thread, int parent, int site);
+
+	// Every thread's call tree merged into one, with the same layout as a PerfThread's
+	std::vector<PerfNode> merged();
+	std::vector<PerfSiteTotals> site_totals(const std::vector<PerfNode>& tree);
+	// -1 if no site has that name
+	int find(const char* name);
+	// Every site with calls, by descending total
+	std::vector<PerfSummary> summaries();
 	void print_results();
 	void clear();
+
+	void start_trace(size_t events_per_thread);
+	void add_events(PerfThread* thread);
+	bool write_trace(const char* filename);
+	void summarize(const char* unitname);
+	bool write_summary(const char* filename);
+	// Ticks per microsecond, calibrated from the start of the program until now
+	double ticks_per_microsecond();
 private:
-	typedef google::dense_hash_map<const char*, MethodPerfProfile> MethodPerfProfileMap;
-	std::map<const char*, MethodPerfProfile> perf_map;
+	std::vector<PerfSummary> summaries(const std::vector<PerfNode>& tree, double ticks_per_ms);
+	void print_tree(const std::vector<PerfNode>& tree, int node, int depth,
+			double root_total, double ticks_per_ms);
+
+	std::mutex mutex;
+	std::vector<std::string> names;
+	std::vector<std::unique_ptr<PerfThread>> threads;
+	std::vector<PerfThread*> released;
+	size_t events_per_thread = 0;
+	// Kept by summarize
+	std::vector<PerfSummary> kept_summaries;
 };
 
+// Totals for 'funcname' across every thread; all zero if no site has that name
+PerfSiteTotals perf_timer_totals(const char* funcname);
+
 #endif /* PERFTIMER_H_ */
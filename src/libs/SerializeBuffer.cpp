@@ -3,6 +3,8 @@
  *  Buffer for serialization, with a buffer-full callback
  */
 
+#include <algorithm>
+
 #include "SerializeBuffer.h"
 
 static void file_buffer_flushf(void* context, const char* data, size_t size) {
@@ -19,6 +21,10 @@ static void file_buffer_fillf(void* context, std::vector<char>& buffer,
 	buffer.resize(end + readn);
 }
 
+static size_t file_buffer_readf(void* context, char* data, size_t size) {
+	return fread(data, 1, size, (FILE*)context);
+}
+
 static void file_buffer_closef(void* context) {
 	fclose((FILE*)context);
 }
@@ -29,18 +35,21 @@ void SerializeBuffer::clear() {
 }
 
 SerializeBuffer::SerializeBuffer(void* context, buffer_flushf flushf,
-		buffer_fillf fillf, buffer_closef closef) :
-		_read_position(0), _context(context), _flushf(flushf), _fillf(fillf), _closef(closef) {
+		buffer_fillf fillf, buffer_closef closef, buffer_readf readf) :
+		_read_position(0), _context(context), _flushf(flushf), _fillf(fillf), _closef(closef),
+		_readf(readf), _native_endian(false) {
 }
 
 SerializeBuffer::SerializeBuffer() :
-		_read_position(0), _context(NULL), _flushf(NULL), _fillf(NULL), _closef(NULL) {
+		_read_position(0), _context(NULL), _flushf(NULL), _fillf(NULL), _closef(NULL),
+		_readf(NULL), _native_endian(false) {
 }
 
 SerializeBuffer::SerializeBuffer(FILE* file, SerializeBuffer::IOType type, bool close_file) :
-		_read_position(0), _context(file) {
+		_read_position(0), _context(file), _native_endian(false) {
 	_flushf = type == OUTPUT ? file_buffer_flushf : NULL;
 	_fillf = type == INPUT ? file_buffer_fillf : NULL;
+	_readf = type == INPUT ? file_buffer_readf : NULL;
 	_closef = close_file ? file_buffer_closef : NULL;
 }
 
@@ -58,11 +67,14 @@ void SerializeBuffer::flush() {
 void SerializeBuffer::close() {
 	if (_context != NULL) {
 		flush();
-		if (_closef) {
-			_closef(_context);
-		}
+		// Detach first, as closing may throw (eg on a failed durable write):
+		void* context = _context;
+		buffer_closef closef = _closef;
 		_context = NULL, _flushf = NULL;
-		_fillf = NULL, _closef = NULL;
+		_fillf = NULL, _closef = NULL, _readf = NULL;
+		if (closef) {
+			closef(context);
+		}
 	}
 }
 
@@ -72,3 +84,22 @@ void SerializeBuffer::fill() {
 	_fillf(_context, _buffer, MAX_ALLOC_SIZE);
 }
 
+
+void SerializeBuffer::read_bulk(char* bytes, size_t n) {
+	// Whatever is already buffered first:
+	size_t buffered = std::min(n, _buffer.size() - _read_position);
+	if (buffered > 0) {
+		read_raw(bytes, buffered);
+		bytes += buffered, n -= buffered;
+	}
+	if (n >= MAX_BUFFER_SIZE && _readf != NULL) {
+		LSERIALIZE_CHECK(_readf(_context, bytes, n) == n);
+		return;
+	}
+	// Otherwise in buffer-sized pieces:
+	while (n > 0) {
+		size_t piece = std::min(n, (size_t)MAX_ALLOC_SIZE / 2);
+		read_raw(bytes, piece);
+		bytes += piece, n -= piece;
+	}
+}
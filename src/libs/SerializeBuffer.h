@@ -9,6 +9,7 @@
 #include <stdexcept>
 #include <string>
 #include <cstring>
+#include <type_traits>
 #include <vector>
 #include <cstdio>
 #include "int_types.h"
@@ -73,6 +74,8 @@ typedef void (*buffer_flushf)(void* context, const char* data, size_t size);
 typedef void (*buffer_fillf)(void* context, std::vector<char>& buffer,
 		size_t maxsize);
 typedef void (*buffer_closef)(void* context);
+// Reads exactly 'size' bytes straight into 'data', returning the number read
+typedef size_t (*buffer_readf)(void* context, char* data, size_t size);
 
 class SerializeBufferError : public std::runtime_error {
 public:
@@ -105,7 +108,8 @@ public:
 		OUTPUT
 	};
 
-	SerializeBuffer(void* context, buffer_flushf flushf, buffer_fillf fillf, buffer_closef closef);
+	SerializeBuffer(void* context, buffer_flushf flushf, buffer_fillf fillf, buffer_closef closef,
+			buffer_readf readf = NULL);
 	SerializeBuffer();
 	SerializeBuffer(FILE* file, IOType type, bool close_file = false);
 
@@ -132,6 +136,27 @@ public:
 		_buffer.insert(_buffer.end(), bytes, bytes + n);
 	}
 
+	// Bulk read/writes of any size. Large arrays go straight between the file and
+	// the caller's memory, bypassing the buffer, where the file allows it.
+	void write_bulk(const char* bytes, size_t n) {
+		if (n >= MAX_BUFFER_SIZE && _flushf != NULL) {
+			flush();
+			_flushf(_context, bytes, n);
+		} else {
+			write_raw(bytes, n);
+		}
+	}
+	void read_bulk(char* bytes, size_t n);
+
+	// Native-endian mode writes scalars as they are in memory, rather than big-endian.
+	// Both sides must agree, see DataWriter / DataReader for the file header recording it.
+	void set_native_endian(bool native) {
+		_native_endian = native;
+	}
+	bool native_endian() const {
+		return _native_endian;
+	}
+
 	// Specialized write/reads:
 	void write_int(int32_t i) {
 		write(i);
@@ -200,6 +225,9 @@ public:
 	template<class T>
 	void read(T& t) {
 		read_raw((char*)&t, sizeof(T));
+		if (_native_endian) {
+			return;
+		}
 		if (sizeof(T) == 2) {
 			*(uint16_t*)&t = be16toh(*(uint16_t*)&t);
 		} else if (sizeof(T) == 4) {
@@ -214,7 +242,9 @@ public:
 	// TODO: Error on different passed lengths
 	template<class T>
 	void write(const T& t) {
-		if (sizeof(T) == 2) {
+		if (_native_endian) {
+			write_raw((const char*)&t, sizeof(T));
+		} else if (sizeof(T) == 2) {
 			uint16_t val = be16toh(*(uint16_t*)&t);
 			write_raw((const char*)&val, sizeof(T));
 		} else if (sizeof(T) == 4) {
@@ -228,26 +258,44 @@ public:
 		}
 	}
 	// High-level read/writes:
+	// Containers of any size, with a 64-bit length. Elements are bulk copied, except that
+	// outside of native-endian mode they are endian-swapped one by one, which only works
+	// for arithmetic elements: structs must be written field by field by the caller.
 	template<class T>
 	void write_container(const T& t) {
-		write((int)t.size());
-        write_raw((const char*)&t[0], t.size() * sizeof(typename T::value_type));
+		typedef typename T::value_type V;
+		write((uint64_t)t.size());
+		if (t.empty()) {
+			return;
+		}
+		if (_native_endian || sizeof(V) == 1) {
+			write_bulk((const char*)&t[0], t.size() * sizeof(V));
+		} else {
+			LSERIALIZE_CHECK(std::is_arithmetic<V>::value);
+			for (size_t i = 0; i < t.size(); i++) {
+				write(t[i]);
+			}
+		}
 	}
-    template<class T>
-    void write_container(T& t) {
-        write((int)t.size());
-        write_raw((const char*)&t[0], t.size() * sizeof(typename T::value_type));
-    }
 	template<class T>
 	void read_container(T& t) {
-		int size;
+		typedef typename T::value_type V;
+		uint64_t size;
 		read(size);
-		LSERIALIZE_CHECK(size_t(size * sizeof(typename T::value_type)) < MAX_ALLOC_SIZE);
 		t.resize(size);
-        read_raw((char*)&t[0], size * sizeof(typename T::value_type));
+		if (size == 0) {
+			return;
+		}
+		if (_native_endian || sizeof(V) == 1) {
+			read_bulk((char*)&t[0], size * sizeof(V));
+		} else {
+			LSERIALIZE_CHECK(std::is_arithmetic<V>::value);
+			for (size_t i = 0; i < size; i++) {
+				read(t[i]);
+			}
+		}
 	}
 
-
 	~SerializeBuffer();
 
 	const char* data() const {
@@ -279,6 +327,8 @@ private:
 	buffer_flushf _flushf;
 	buffer_fillf _fillf;
 	buffer_closef _closef;
+	buffer_readf _readf;
+	bool _native_endian;
 };
 
 // The following functions are hacks for quick and dirty serialization of known POD regions
@@ -0,0 +1,81 @@
+/*
+ * SpscRing.h:
+ *  Bounded lock-free ring buffer for exactly one producer thread and one consumer thread.
+ *  Each side keeps a cached copy of the other's index, so the shared cache lines are
+ *  only touched when the cached view says the ring is full (or empty).
+ */
+
+#ifndef SPSCRING_H_
+#define SPSCRING_H_
+
+#include <algorithm>
+#include <atomic>
+#include <vector>
+
+template <typename T>
+class SpscRing {
+public:
+	// Capacity is rounded up to a power of 2
+	explicit SpscRing(size_t min_capacity) {
+		size_t capacity = 2;
+		while (capacity < min_capacity) {
+			capacity *= 2;
+		}
+		slots.resize(capacity);
+		mask = capacity - 1;
+	}
+
+	size_t capacity() const {
+		return slots.size();
+	}
+
+	// Producer: pushes as many of the 'n' items as fit, returning how many did
+	size_t push(const T* items, size_t n) {
+		size_t t = tail.load(std::memory_order_relaxed);
+		if (t + n - cached_head > capacity()) {
+			cached_head = head.load(std::memory_order_acquire);
+		}
+		n = std::min(n, capacity() - (t - cached_head));
+		for (size_t i = 0; i < n; i++) {
+			slots[(t + i) & mask] = items[i];
+		}
+		tail.store(t + n, std::memory_order_release);
+		return n;
+	}
+
+	// Consumer: pops up to 'max' items, returning how many it did
+	size_t pop(T* items, size_t max) {
+		size_t h = head.load(std::memory_order_relaxed);
+		if (cached_tail - h < max) {
+			cached_tail = tail.load(std::memory_order_acquire);
+		}
+		size_t n = std::min(max, cached_tail - h);
+		for (size_t i = 0; i < n; i++) {
+			items[i] = slots[(h + i) & mask];
+		}
+		head.store(h + n, std::memory_order_release);
+		return n;
+	}
+
+	// Either side: a snapshot, exact only when the other side is idle
+	bool empty() const {
+		return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire);
+	}
+
+private:
+	// Indices only ever grow; slots are indexed modulo the capacity.
+	// Padded so that the two sides do not share cache lines.
+	std::vector<T> slots;
+	size_t mask;
+	char pad0[64];
+	// Next to pop, written by the consumer, and its copy of the tail
+	std::atomic<size_t> head {0};
+	size_t cached_tail = 0;
+	char pad1[64];
+	// Next to push, written by the producer, and its copy of the head
+	std::atomic<size_t> tail {0};
+	size_t cached_head = 0;
+	char pad2[64];
+};
+
+#endif /* SPSCRING_H_ */
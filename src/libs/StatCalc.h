@@ -20,6 +20,9 @@ struct StatCalc {
     }
 
     void add_element(double element) {
+        if (n_elements == 0) {
+            min = max = element;
+        }
         n_elements++;
         sum += element;
         max = std::max(max, element);
@@ -0,0 +1,68 @@
+/*
+ * ThreadPool.cpp:
+ *  Minimal fork-join thread pool.
+ */
+
+#include <algorithm>
+
+#include "ThreadPool.h"
+
+ThreadPool::ThreadPool(int n) {
+	if (n <= 0) {
+		n = std::max(1u, std::thread::hardware_concurrency());
+	}
+	n_threads = n;
+	for (int i = 1; i < n_threads; i++) {
+		workers.push_back(std::thread(&ThreadPool::worker_loop, this, i));
+	}
+}
+
+ThreadPool::~ThreadPool() {
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	job_ready.notify_all();
+	for (std::thread& worker : workers) {
+		worker.join();
+	}
+}
+
+void ThreadPool::run(const std::function<void(int)>& f) {
+	if (n_threads == 1) {
+		f(0);
+		return;
+	}
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		job = &f;
+		n_running = n_threads - 1;
+		generation++;
+	}
+	job_ready.notify_all();
+	f(0);
+	std::unique_lock<std::mutex> lock(mutex);
+	job_done.wait(lock, [&]() {return n_running == 0;});
+	job = NULL;
+}
+
+void ThreadPool::worker_loop(int thread_index) {
+	size_t seen_generation = 0;
+	while (true) {
+		const std::function<void(int)>* f;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			job_ready.wait(lock, [&]() {return stopping || generation != seen_generation;});
+			if (stopping) {
+				return;
+			}
+			seen_generation = generation;
+			f = job;
+		}
+		(*f)(thread_index);
+		std::unique_lock<std::mutex> lock(mutex);
+		if (--n_running == 0) {
+			job_done.notify_one();
+		}
+	}
+}
@@ -0,0 +1,67 @@
+/*
+ * ThreadPool.h:
+ *  Minimal fork-join thread pool. The calling thread takes part as thread 0,
+ *  and every call blocks until all threads have finished their share.
+ */
+
+#ifndef THREADPOOL_H_
+#define THREADPOOL_H_
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class ThreadPool {
+public:
+	// n_threads <= 0 uses the hardware concurrency
+	ThreadPool(int n_threads = 0);
+	~ThreadPool();
+
+	int size() const {
+		return n_threads;
+	}
+
+	// Runs job(thread_index) once on every thread of the pool
+	void run(const std::function<void(int)>& job);
+
+	// Calls func(thread_index, begin, end) over chunks of [0, n) of at most 'grain' elements.
+	// Chunks are handed out dynamically, so uneven work (eg high degree nodes) balances itself.
+	// Small ranges are run directly on the calling thread.
+	template <typename Func>
+	void parallel_for(size_t n, size_t grain, Func func) {
+		if (n <= grain || n_threads == 1) {
+			if (n > 0) {
+				func(0, (size_t)0, n);
+			}
+			return;
+		}
+		std::atomic<size_t> next(0);
+		run([&](int thread_index) {
+			while (true) {
+				size_t begin = next.fetch_add(grain);
+				if (begin >= n) {
+					break;
+				}
+				func(thread_index, begin, std::min(n, begin + grain));
+			}
+		});
+	}
+
+private:
+	void worker_loop(int thread_index);
+
+	int n_threads;
+	std::vector<std::thread> workers;
+	std::mutex mutex;
+	std::condition_variable job_ready, job_done;
+	const std::function<void(int)>* job = NULL;
+	size_t generation = 0;
+	int n_running = 0;
+	bool stopping = false;
+};
+
+#endif /* THREADPOOL_H_ */
@@ -167,6 +167,15 @@ public:
 		return r;
     }
 
+    // Saves or restores the generator's position, eg for checkpoints
+    template <typename Visitor>
+    void visit(Visitor& rw) {
+        for (int i = 0; i < N; i++) {
+            rw << mt[i];
+        }
+        rw << mti;
+    }
+
 private:
     unsigned int mt[N];
     int mti;
@@ -283,6 +292,17 @@ public:
 		return -log(u) * mean;
     }
 
+    // Saves or restores the generator's position, eg for checkpoints
+    template <typename Visitor>
+    void visit(Visitor& rw) {
+        for (int i = 0; i < SFMT_N; i++) {
+            for (int j = 0; j < 4; j++) {
+                rw << state.state[i].u[j];
+            }
+        }
+        rw << state.idx;
+    }
+
 private:
     sfmt_t state;
 };
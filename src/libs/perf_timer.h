@@ -1,15 +1,30 @@
 /*
  * perf_timer.h:
  *  Provides timing information on a per-method basis.
- *  Based on a global PerfTimer, but does not expose that class.
+ *  Each PERF_TIMER callsite registers a site once. Every thread keeps a stack of the
+ *  timed scopes it is in, as a path through its own call tree; timing a scope costs two
+ *  timestamp reads, a check of the last child entered, and a few adds into the node.
+ *  The threads' trees are merged when reporting (see PerfTimer.h). Optionally, each
+ *  thread also keeps a ring of its latest scopes, for a timeline.
  *  Public domain (by Adam Domurad)
  */
 
 #ifndef LCOMMON_PERF_TIMER_H_
 #define LCOMMON_PERF_TIMER_H_
 
+#include <algorithm>
+#include <atomic>
 #include <cstring>
 #include <cstdio>
+#include <vector>
+
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "int_types.h"
 
 // Define a cross-platform function name identifier
 #ifdef _MSC_VER
@@ -22,21 +37,202 @@
 #endif
 #endif
 
-void perf_timer_begin(const char* funcname);
-void perf_timer_end(const char* funcname);
+// Timestamps: the TSC where there is one, otherwise CLOCK_MONOTONIC_RAW nanoseconds.
+// Reports convert ticks to time by calibrating against CLOCK_MONOTONIC_RAW.
+inline uint64_t perf_ticks() {
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+// Log-linear latency buckets (as in HDR histograms): exact below 32 ticks, then 32
+// buckets per power of two, so a bucket's values are within ~3% of each other
+const int PERF_SUB_BITS = 5, PERF_SUB_BUCKETS = 1 << PERF_SUB_BITS;
+const int PERF_BUCKETS = (64 - PERF_SUB_BITS + 1) * PERF_SUB_BUCKETS;
+
+inline int perf_bucket(uint64_t ticks) {
+	if (ticks < PERF_SUB_BUCKETS) {
+		return ticks;
+	}
+	int exponent = 63 - __builtin_clzll(ticks);
+	int shift = exponent - PERF_SUB_BITS;
+	return (shift + 1) * PERF_SUB_BUCKETS + ((ticks >> shift) & (PERF_SUB_BUCKETS - 1));
+}
+
+// The largest number of ticks that falls in 'bucket'
+uint64_t perf_bucket_limit(int bucket);
+
+// Statistics for one node of the call tree, in ticks
+struct PerfSlot {
+	uint64_t calls = 0, total = 0, max = 0;
+	// For the standard deviation
+	double sum_squares = 0;
+	// Calls per perf_bucket; empty until allocated (along with the node, see PerfTimer.cpp)
+	std::vector<uint64_t> histogram;
+
+	void add(uint64_t ticks) {
+		calls++;
+		total += ticks;
+		max = (ticks > max) ? ticks : max;
+		sum_squares += (double)ticks * ticks;
+		histogram[perf_bucket(ticks)]++;
+	}
+	void merge(const PerfSlot& o) {
+		calls += o.calls;
+		total += o.total;
+		max = (o.max > max) ? o.max : max;
+		sum_squares += o.sum_squares;
+		if (!o.histogram.empty()) {
+			histogram.resize(PERF_BUCKETS);
+			for (int i = 0; i < PERF_BUCKETS; i++) {
+				histogram[i] += o.histogram[i];
+			}
+		}
+	}
+	// Zeroes the statistics, keeping the histogram allocated
+	void reset() {
+		calls = total = max = 0;
+		sum_squares = 0;
+		std::fill(histogram.begin(), histogram.end(), 0);
+	}
+	// The smallest bucket limit that at least 'fraction' of the calls are within (capped by max)
+	uint64_t percentile(double fraction) const;
+};
+
+// A callsite reached through one particular chain of enclosing timed scopes.
+// Direct recursion stays on the same node: only the outermost activation is timed,
+// and the nested ones are counted in 'recursive'.
+struct PerfNode {
+	int site, parent;
+	int first_child = -1, next_sibling = -1;
+	// The child entered most recently, checked before searching the children
+	int last_child = -1;
+	// Activations currently on this thread's stack
+	int active = 0;
+	PerfSlot slot;
+	uint64_t recursive = 0;
+	// Inclusive ticks of the children; the rest is exclusive to this node
+	uint64_t child_total = 0;
+
+	PerfNode(int site, int parent) : site(site), parent(parent) {
+	}
+};
+
+// One timed scope on the timeline, in ticks
+struct PerfEvent {
+	uint64_t start, ticks;
+	int site;
+};
+
+// One thread's call tree. Node 0 is the root, and parents come before their children.
+// Only the owning thread changes the tree's shape, always under the registry's lock.
+struct PerfThread {
+	std::vector<PerfNode> nodes;
+	int current = 0;
+	// With perf_trace_start, the last events.size() scopes to end (a power of 2 once
+	// allocated); n_events counts every one recorded.
+	std::vector<PerfEvent> events;
+	uint64_t n_events = 0;
+	int id = 0;
+};
+
+// Returns the site index for 'name'; callsites with the same name share a site
+int perf_register_site(const char* name);
+// Registers the calling thread's call tree
+PerfThread* perf_add_thread();
+// The child of 'parent' for 'site', created if needed
+int perf_child_slow(PerfThread* thread, int parent, int site);
+
+// Allocates the thread's event ring
+void perf_events_slow(PerfThread* thread);
+
+extern thread_local PerfThread* perf_thread;
+extern std::atomic<bool> perf_tracing;
+extern uint64_t perf_trace_min_ticks;
+
+// Enters 'site' below the current scope, returning its node
+inline int perf_enter(PerfThread* thread, int site) {
+	int current = thread->current;
+	PerfNode* node = &thread->nodes[current];
+	if (node->site == site) {
+		node->active++;
+		node->recursive++;
+		return current;
+	}
+	int child = node->last_child;
+	if (child < 0 || thread->nodes[child].site != site) {
+		child = perf_child_slow(thread, current, site);
+	}
+	thread->nodes[child].active++;
+	thread->current = child;
+	return child;
+}
+
+inline void perf_exit(PerfThread* thread, int node_index, uint64_t ticks) {
+	PerfNode& node = thread->nodes[node_index];
+	if (--node.active == 0) {
+		node.slot.add(ticks);
+		thread->nodes[node.parent].child_total += ticks;
+		thread->current = node.parent;
+	}
+}
+
+inline void perf_record(PerfThread* thread, int node, uint64_t start, uint64_t end) {
+	if (thread->events.empty()) {
+		perf_events_slow(thread);
+	}
+	PerfEvent& event = thread->events[thread->n_events & (thread->events.size() - 1)];
+	event.start = start;
+	event.ticks = end - start;
+	event.site = thread->nodes[node].site;
+	thread->n_events++;
+}
+
 double perf_timer_average_time(const char* funcname);
+// Every entry into 'funcname', including recursive ones
+uint64_t perf_timer_calls(const char* funcname);
 void perf_timer_clear();
+// Merges every thread's call tree, then prints the totals per site by descending
+// inclusive time, followed by the call tree. Threads still timing scopes meanwhile
+// may or may not be counted.
 void perf_print_results();
 
+// Starts recording every timed scope that ends (and took at least 'min_microseconds'),
+// keeping the last 'events_per_thread' of each thread
+void perf_trace_start(size_t events_per_thread = 1 << 20, double min_microseconds = 0);
+void perf_trace_stop();
+// Writes the recorded scopes as Chrome trace-event JSON (for chrome://tracing or Perfetto).
+// Write once the threads are done with timed scopes: scopes still open are not on the timeline.
+bool perf_write_trace(const char* filename);
+// Keeps the current totals per site, under 'unitname' (every PERF_UNIT does, before clearing)
+void perf_summarize(const char* unitname);
+// Writes every summary kept so far as JSON, or as CSV if 'filename' ends with .csv
+bool perf_write_summary(const char* filename);
+
 struct PerfCount {
-    PerfCount(const char* funcname) : funcname(funcname){
-        perf_timer_begin(funcname);
+    PerfCount(int site) {
+    	thread = perf_thread;
+    	if (thread == NULL) {
+    		thread = perf_add_thread();
+    	}
+    	node = perf_enter(thread, site);
+    	start = perf_ticks();
     }
     ~PerfCount() {
-        perf_timer_end(funcname);
+    	uint64_t end = perf_ticks();
+        perf_exit(thread, node, end - start);
+        if (perf_tracing.load(std::memory_order_relaxed) && end - start >= perf_trace_min_ticks) {
+        	perf_record(thread, node, start, end);
+        }
     }
 private:
-    const char* funcname;
+    PerfThread* thread;
+    int node;
+    uint64_t start;
 };
 
 struct PerfUnit {
@@ -46,6 +242,7 @@ struct PerfUnit {
     ~PerfUnit() {
     	printf("-------------- %s -----------------\n", unitname);
     	perf_print_results();
+    	perf_summarize(unitname);
         perf_timer_clear();
     	printf("-----------------");
     	for (int i = 0; i < strlen(unitname); i++) {
@@ -57,9 +254,19 @@ private:
     const char* unitname;
 };
 
-#define PERF_TIMER() PerfCount __perf_count(FUNCNAME)
-#define PERF_TIMER2(name) PerfCount __perf_count(name)
+// PERF_TIMERS_DISABLED (eg the headless build) compiles every timer out
+#ifdef PERF_TIMERS_DISABLED
+#define PERF_TIMER() do {} while (0)
+#define PERF_TIMER2(name) do {} while (0)
+#define PERF_UNIT(unitname) do {} while (0)
+#else
+// The site is looked up once per callsite (and template instantiation)
+#define PERF_TIMER2(name) \
+	static const int __perf_site = perf_register_site(name); \
+	PerfCount __perf_count(__perf_site)
+#define PERF_TIMER() PERF_TIMER2(FUNCNAME)
 #define PERF_UNIT(unitname) PerfUnit __perf_unit(unitname)
+#endif
 
 
 #endif /* LCOMMON_PERF_TIMER_H_ */
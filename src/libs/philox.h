@@ -0,0 +1,62 @@
+/*
+ * philox.h:
+ *  Philox4x32-10 counter-based random number generator (Salmon et al., "Parallel random
+ *  numbers: as easy as 1, 2, 3"). Output is a pure function of (key, counter), so any
+ *  thread can reproduce the numbers for any counter without sharing generator state.
+ */
+
+#ifndef PHILOX_H_
+#define PHILOX_H_
+
+#include "int_types.h"
+
+class Philox {
+public:
+	Philox(uint64_t seed = 0) {
+		set_seed(seed);
+	}
+	void set_seed(uint64_t seed) {
+		key[0] = (uint32_t)seed;
+		key[1] = (uint32_t)(seed >> 32);
+	}
+
+	/* Generate four random 32-bit words for the 128-bit counter (a, b) */
+	void generate(uint64_t a, uint64_t b, uint32_t out[4]) const {
+		uint32_t c[4] = {(uint32_t)a, (uint32_t)(a >> 32), (uint32_t)b, (uint32_t)(b >> 32)};
+		uint32_t k[2] = {key[0], key[1]};
+		for (int i = 0; i < 10; i++) {
+			uint64_t p0 = (uint64_t)M0 * c[0], p1 = (uint64_t)M1 * c[2];
+			uint32_t n[4] = {
+				(uint32_t)(p1 >> 32) ^ c[1] ^ k[0], (uint32_t)p1,
+				(uint32_t)(p0 >> 32) ^ c[3] ^ k[1], (uint32_t)p0
+			};
+			c[0] = n[0], c[1] = n[1], c[2] = n[2], c[3] = n[3];
+			k[0] += W0, k[1] += W1;
+		}
+		out[0] = c[0], out[1] = c[1], out[2] = c[2], out[3] = c[3];
+	}
+
+	/* Grab a 64-bit random value for the counter (a, b) */
+	uint64_t rand_uint64(uint64_t a, uint64_t b) const {
+		uint32_t out[4];
+		generate(a, b, out);
+		return ((uint64_t)out[0] << 32) | out[1];
+	}
+
+	/* Convert two random words to a real number within [0,1) with 53-bit resolution */
+	static double to_real_not1(uint32_t hi, uint32_t lo) {
+		uint64_t bits = (((uint64_t)hi << 32) | lo) >> 11;
+		return bits * (1.0 / 9007199254740992.0);
+	}
+	/* Convert two random words to a real number within (0,1] with 53-bit resolution */
+	static double to_real_not0(uint32_t hi, uint32_t lo) {
+		return 1.0 - to_real_not1(hi, lo);
+	}
+
+private:
+	static const uint32_t M0 = 0xD2511F53, M1 = 0xCD9E8D57;
+	static const uint32_t W0 = 0x9E3779B9, W1 = 0xBB67AE85;
+	uint32_t key[2];
+};
+
+#endif /* PHILOX_H_ */
@@ -1,76 +1,180 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cstdio>
+#include <exception>
+#include <memory>
 #include <string>
 #include <sstream>
+#include <thread>
+#include <utility>
 #include <vector>
 
+#include "libs/SpscRing.h"
+#include "libs/StatCalc.h"
 #include "libs/unittest.h"
 
+#include "checkpoint.h"
+#include "edge_list.h"
+#include "reorder.h"
 #include "sdl.h"
+#include "snapshot.h"
 #include "state.h"
 #include "state_alt.h"
+#include "state_bitparallel.h"
+#include "state_percolation.h"
+#include "state_sssp.h"
+#include "trace.h"
 
 using namespace std;
 
-//#define State StateAlt
-
 /*****************************************************************************
  * Test driver
  *****************************************************************************/
 
-struct OutputData {
-	vector<bool> wasInfected;
-	vector<pair<entity_id, size_t>> newlyInfected;
+// An infection on its way to the renderer
+struct RenderEvent {
+	entity_id id;
+	size_t step;
+};
+
+// Draws infections as they arrive from the simulation: newly infected entities in red,
+// turning orange after keep_alive steps.
+struct Renderer {
+	vector<RenderEvent> newlyInfected;
 	int keep_alive = 4000;
-	bool SDL_INITIALIZED = false;
 	double scale;
 	int rows;
-	State* network;
-} O;
-
-static void output_init(Config& config, State& network) {
-	O.scale = config.window_size / double(config.sqrt_size);
-	O.rows = config.sqrt_size;
-	O.wasInfected.resize(network.size(), false);
-	O.network = &network;
-	sdl_init(O.scale * config.sqrt_size, O.scale * config.sqrt_size, config.sqrt_size, config.sqrt_size);
-}
 
-static void on_infect(entity_id id) {
-	int x = id % O.rows,y = id/O.rows;
-	sdl_fill_pixel(x, y, COL_RED1);
-	O.wasInfected[id] = true;
-	O.newlyInfected.push_back({id, O.network->n_steps});
-}
+	void init(Config& config) {
+		scale = config.window_size / double(config.sqrt_size);
+		rows = config.sqrt_size;
+		newlyInfected.clear();
+		sdl_init(scale * config.sqrt_size, scale * config.sqrt_size, config.sqrt_size, config.sqrt_size);
+	}
 
-static void output_network(Config& config, string label, State& network) {
-	if (!config.visualize) {
-		return;
+	void add(const RenderEvent* events, size_t n) {
+		for (size_t i = 0; i < n; i++) {
+			entity_id id = events[i].id;
+			sdl_fill_pixel(id % rows, id / rows, COL_RED1);
+			newlyInfected.push_back(events[i]);
+		}
 	}
-	PERF_TIMER();
 
-	sdl_predraw();
-	sdl_copybuffer();
-	stringstream ss(label);
-	char buff[500];
-	int y = 30;
-	while (!ss.eof()) {
-		ss.getline(buff, 500);
-		sdl_draw_text(buff, 30, y);
-		y += 30;
-	}
-	sdl_postdraw(config.saved_image_base_path);
-	auto copy = O.newlyInfected;
-	O.newlyInfected.clear();
-	for (auto& pair : copy) {
-		int id = pair.first;
-		if (pair.second > network.n_steps - O.keep_alive) {
-			O.newlyInfected.push_back(pair);
-		} else {
-			sdl_fill_pixel(id % O.rows, id / O.rows, COL_ORANGE);
+	// 'n_steps' is the step count of the network being drawn
+	void draw(Config& config, string label, size_t n_steps) {
+		if (!config.visualize) {
+			return;
+		}
+		PERF_TIMER();
+		sdl_predraw();
+		sdl_copybuffer();
+		stringstream ss(label);
+		char buff[500];
+		int y = 30;
+		while (!ss.eof()) {
+			ss.getline(buff, 500);
+			sdl_draw_text(buff, 30, y);
+			y += 30;
+		}
+		sdl_postdraw(config.saved_image_base_path);
+		auto copy = newlyInfected;
+		newlyInfected.clear();
+		for (auto& event : copy) {
+			int id = event.id;
+			if (event.step > n_steps - keep_alive) {
+				newlyInfected.push_back(event);
+			} else {
+				sdl_fill_pixel(id % rows, id / rows, COL_ORANGE);
+			}
+		}
+	}
+};
+
+// Hands infections to the render thread (see run_visual). Only waits, counting a stall,
+// when the renderer is a whole ring behind.
+struct RenderFeed {
+	SpscRing<RenderEvent>& ring;
+	vector<RenderEvent> staging;
+	size_t n_stalls = 0;
+
+	RenderFeed(SpscRing<RenderEvent>& ring) :
+			ring(ring) {
+	}
+	bool active() const {
+		return true;
+	}
+	void on_infections(const InfectionBatch& batch) {
+		staging.resize(batch.n);
+		for (size_t i = 0; i < batch.n; i++) {
+			staging[i] = {batch.infected[i], batch.step[i]};
+		}
+		size_t pushed = ring.push(staging.data(), staging.size());
+		while (pushed < staging.size()) {
+			PERF_TIMER2("render stall");
+			n_stalls++;
+			this_thread::yield();
+			pushed += ring.push(staging.data() + pushed, staging.size() - pushed);
 		}
 	}
+};
+
+// The simulation's progress, published by its thread for the render thread's status text
+struct SimStatus {
+	atomic<double> total_weight {0}, time_elapsed {0};
+	atomic<size_t> n_steps {0}, n_infections {0};
+	atomic<bool> finished {false};
+
+	template <typename StateT>
+	void publish(StateT& state) {
+		total_weight.store(state.total_weight(), memory_order_relaxed);
+		time_elapsed.store(state.time_elapsed, memory_order_relaxed);
+		n_steps.store(state.n_steps, memory_order_relaxed);
+		n_infections.store(state.n_infections, memory_order_relaxed);
+	}
+	string label() const {
+		stringstream ss("Simulation ");
+	    ss.imbue(std::locale(""));
+		ss << "W = "         << total_weight.load(memory_order_relaxed) << endl
+		   << "sim-time ="   << time_elapsed.load(memory_order_relaxed) << "s" << endl
+		   << "step: "       << n_steps.load(memory_order_relaxed)      << endl
+		   << "infections: " << n_infections.load(memory_order_relaxed);
+		return ss.str();
+	}
+};
+
+// Snapshots hold the sorted graph, and the walker tables when State built them
+static void save_snapshot(const string& filename, int sqrt_size, State& state, Graph& graph) {
+	graph.sort_by_prob();
+	SnapshotWriter writer;
+	writer.add_graph(graph);
+	writer.add_alias_tables(state.alias);
+	writer.write(filename, sqrt_size);
+}
+static void save_snapshot(const string& filename, int sqrt_size, StateAlt& state, Graph&) {
+	SnapshotWriter writer;
+	writer.add_graph(state.graph);
+	writer.write(filename, sqrt_size);
+}
+template <typename StateT, typename GraphT>
+static void save_snapshot(const string&, int, StateT&, GraphT&) {
+	ASSERT(false, "Snapshots hold uncompressed explicit graphs only!");
 }
 
+static void attach_snapshot(State& state, const shared_ptr<Snapshot>& snapshot) {
+	if (snapshot->has(SECTION_ALIAS_CONNECTIONS)) {
+		state.set_alias_tables(snapshot->alias_tables());
+	} else {
+		state.set_graph(snapshot->graph());
+	}
+}
+static void attach_snapshot(StateAltView& state, const shared_ptr<Snapshot>& snapshot) {
+	state.set_graph(snapshot->graph());
+}
+template <typename StateT>
+static void attach_snapshot(StateT&, const shared_ptr<Snapshot>&) {
+	ASSERT(false, "Engine cannot run on a snapshot!");
+}
 
 static int scan_flag(string flag, int argn, const char** argv) {
 	for (int i = 1; i < argn; i++) {
@@ -88,6 +192,45 @@ struct CmdLineParser {
 	int sqrt_size = -1;// -1 if not set here
 	int seed = -1;
 	bool visualize = true;
+	// kmc, event, or the final-size engines sssp, percolation and bitparallel (see main())
+	string engine = "kmc";
+	// torus: generate_graph, lattice: the same torus computed on demand (LatticeGraph),
+	// lattice-pop: LatticeGraph with per-node popularity,
+	// er, ws, ba, config: random networks (see graph.h)
+	string graph_type = "torus";
+	double mean_degree = -1, rewire_prob = -1, edge_prob = -1;
+	string degree_file;
+	// Text edge list to import instead of generating a graph:
+	string import_filename;
+	// Entity renumbering for locality (see reorder.h), empty for none:
+	string reorder;
+	// Bits per quantized probability of the compressed graph, 0 for no compression:
+	int compress_bits = 0;
+	// Snapshot to run on in place, and to save the preprocessed network to (see snapshot.h):
+	string snapshot_filename, save_snapshot_filename;
+	bool verify_snapshot = false;
+	// -w writes big-endian scalars rather than the native-endian fast path
+	bool portable = false;
+	// -w and -r bypass the page cache, where the file system allows
+	bool direct_io = false;
+	// -w and checkpoints are LZ-compressed in blocks (see BlockCompress.h); -r detects it
+	bool lz = false;
+	// Checkpoints of the run, every checkpoint_interval seconds, and one to resume from.
+	// Checkpoints do not hold the network: resume with the same network flags (or -r / --snapshot).
+	string checkpoint_filename, restore_filename;
+	double checkpoint_interval = 60;
+	// Trace of every infection (see trace.h), compressed with --lz
+	string trace_filename;
+	// Input ids of the network's entities, kept for the trace (empty if not imported or reordered)
+	vector<int64_t> original_ids;
+	// Report transmission chain depths per trial
+	bool generations = false;
+	// Timeline of the timed scopes, as Chrome trace-event JSON, and the PERF_UNIT
+	// reports as JSON (or CSV, for a .csv file name); see perf_timer.h
+	string perf_trace_filename, perf_summary_filename;
+	// Scopes shorter than this are left off the timeline, so that the hot loop's do not
+	// push the rest out of the trace's rings
+	double perf_trace_min_us = 0;
 	~CmdLineParser() {
 		delete reader;
 		delete writer;
@@ -96,8 +239,90 @@ struct CmdLineParser {
 		int w_loc = scan_flag("-w", argn, argv);
 		int r_loc = scan_flag("-r", argn, argv);
 		int i_loc = scan_flag("-i", argn, argv);
+#ifdef INFECTSIM_HEADLESS
+		// Built without SDL (see CMakeLists.txt), as if always given -0
+		visualize = false;
+#else
 		visualize = (scan_flag("-0", argn, argv) == argn);
+#endif
+		portable = (scan_flag("--portable", argn, argv) != argn);
+		direct_io = (scan_flag("--direct-io", argn, argv) != argn);
+		lz = (scan_flag("--lz", argn, argv) != argn);
+		generations = (scan_flag("--generations", argn, argv) != argn);
 		int s_loc = scan_flag("-seed", argn, argv);
+		int e_loc = scan_flag("--engine", argn, argv);
+		int g_loc = scan_flag("--graph", argn, argv);
+		if (e_loc + 1 < argn) {
+			engine = argv[e_loc + 1];
+		}
+		if (g_loc + 1 < argn) {
+			graph_type = argv[g_loc + 1];
+		}
+		int k_loc = scan_flag("--degree", argn, argv);
+		if (k_loc + 1 < argn) {
+			stringstream(argv[k_loc + 1]) >> mean_degree;
+		}
+		int b_loc = scan_flag("--rewire", argn, argv);
+		if (b_loc + 1 < argn) {
+			stringstream(argv[b_loc + 1]) >> rewire_prob;
+		}
+		int p_loc = scan_flag("--prob", argn, argv);
+		if (p_loc + 1 < argn) {
+			stringstream(argv[p_loc + 1]) >> edge_prob;
+		}
+		int im_loc = scan_flag("--import", argn, argv);
+		if (im_loc + 1 < argn) {
+			import_filename = argv[im_loc + 1];
+		}
+		int o_loc = scan_flag("--reorder", argn, argv);
+		if (o_loc + 1 < argn) {
+			reorder = argv[o_loc + 1];
+		}
+		int c_loc = scan_flag("--compress", argn, argv);
+		if (c_loc + 1 < argn) {
+			stringstream(argv[c_loc + 1]) >> compress_bits;
+		}
+		int sn_loc = scan_flag("--snapshot", argn, argv);
+		if (sn_loc + 1 < argn) {
+			snapshot_filename = argv[sn_loc + 1];
+		}
+		int ss_loc = scan_flag("--save-snapshot", argn, argv);
+		if (ss_loc + 1 < argn) {
+			save_snapshot_filename = argv[ss_loc + 1];
+		}
+		verify_snapshot = (scan_flag("--verify-snapshot", argn, argv) != argn);
+		int cp_loc = scan_flag("--checkpoint", argn, argv);
+		if (cp_loc + 1 < argn) {
+			checkpoint_filename = argv[cp_loc + 1];
+		}
+		int ci_loc = scan_flag("--checkpoint-interval", argn, argv);
+		if (ci_loc + 1 < argn) {
+			stringstream(argv[ci_loc + 1]) >> checkpoint_interval;
+		}
+		int rs_loc = scan_flag("--restore", argn, argv);
+		if (rs_loc + 1 < argn) {
+			restore_filename = argv[rs_loc + 1];
+		}
+		int t_loc = scan_flag("--trace", argn, argv);
+		if (t_loc + 1 < argn) {
+			trace_filename = argv[t_loc + 1];
+		}
+		int pt_loc = scan_flag("--perf-trace", argn, argv);
+		if (pt_loc + 1 < argn) {
+			perf_trace_filename = argv[pt_loc + 1];
+		}
+		int pm_loc = scan_flag("--perf-trace-min-us", argn, argv);
+		if (pm_loc + 1 < argn) {
+			stringstream(argv[pm_loc + 1]) >> perf_trace_min_us;
+		}
+		int ps_loc = scan_flag("--perf-summary", argn, argv);
+		if (ps_loc + 1 < argn) {
+			perf_summary_filename = argv[ps_loc + 1];
+		}
+		int d_loc = scan_flag("--degrees", argn, argv);
+		if (d_loc + 1 < argn) {
+			degree_file = argv[d_loc + 1];
+		}
 		if (i_loc + 1 < argn) {
 			saved_image_base_path = argv[i_loc + 1];
 		}
@@ -107,14 +332,14 @@ struct CmdLineParser {
 		if (w_loc + 2 < argn) {
 			stringstream(argv[w_loc+1]) >> sqrt_size;
 			write_filename = argv[w_loc+2];
-			writer = new DataWriter(write_filename);
+			writer = new DataWriter(write_filename, !portable, direct_io, lz);
 		} else if (w_loc + 1 < argn) {
 			// Size wasn't explicit:
 			write_filename = argv[w_loc+1];
-			writer = new DataWriter(write_filename);
+			writer = new DataWriter(write_filename, !portable, direct_io, lz);
 		} else if (r_loc + 1 < argn) {
 			read_filename = argv[r_loc+1];
-			reader = new DataReader(read_filename);
+			reader = new DataReader(read_filename, direct_io);
 		} else if (argn > 1 && string(argv[1]).at(0) != '-') {
 			stringstream(argv[1]) >> sqrt_size;
 		}
@@ -125,12 +350,77 @@ struct CmdLineParser {
 			printf("Will be writing to '%s'\n", write_filename.c_str());
 		}
 	}
-	bool init_state(Config& config, State& state) {
+	void configure(Config& config) {
 		config.saved_image_base_path = saved_image_base_path;
 		config.seed = seed == -1 ? config.seed : seed;
 		config.sqrt_size = sqrt_size == -1 ? config.sqrt_size : sqrt_size;
 		config.size = config.sqrt_size * config.sqrt_size;
 		config.visualize = visualize;
+		config.mean_degree = mean_degree < 0 ? config.mean_degree : mean_degree;
+		config.rewire_prob = rewire_prob < 0 ? config.rewire_prob : rewire_prob;
+		config.edge_prob = edge_prob < 0 ? config.edge_prob : edge_prob;
+		config.degree_file = degree_file;
+	}
+	// The final-size engines (see simulate_final_sizes) only run on a generated or imported
+	// Graph, and have no progress to checkpoint. Prints what is not supported, if anything.
+	bool final_size_engine_supported(const char* engine_name) {
+		const char* unsupported = (reader != NULL) ? "-r" : (writer != NULL) ? "-w"
+				: !snapshot_filename.empty() ? "--snapshot" : !save_snapshot_filename.empty() ? "--save-snapshot"
+				: !checkpoint_filename.empty() ? "--checkpoint" : !restore_filename.empty() ? "--restore"
+				: compress_bits != 0 ? "--compress" : generations ? "--generations"
+				: (graph_type == "lattice" || graph_type == "lattice-pop") ? "--graph lattice"
+				: NULL;
+		if (unsupported != NULL) {
+			printf("Engine '%s' does not support %s\n", engine_name, unsupported);
+			return false;
+		}
+		if (visualize) {
+			printf("Engine '%s' does not draw, running as with -0\n", engine_name);
+		}
+		return true;
+	}
+	void make_graph(Config& config, Graph& graph) {
+		if (!import_filename.empty()) {
+			graph = import_edge_list(import_filename, config);
+		} else if (graph_type == "er") {
+			graph = generate_erdos_renyi(config);
+		} else if (graph_type == "ws") {
+			graph = generate_watts_strogatz(config);
+		} else if (graph_type == "ba") {
+			graph = generate_barabasi_albert(config);
+		} else if (graph_type == "config") {
+			graph = generate_configuration_model(config);
+		} else {
+			graph = generate_graph(config);
+		}
+		printf("Generated %zu edges\n", graph.n_edges());
+		if (!reorder.empty()) {
+			// Validated by main()
+			ASSERT(reorder_graph(graph, reorder, config.sqrt_size, config.unpadded_size), "Unknown ordering!");
+		}
+		if (!trace_filename.empty()) {
+			original_ids = graph.original_ids;
+		}
+	}
+	void make_graph(Config& config, CompressedGraph& graph) {
+		Graph uncompressed;
+		make_graph(config, uncompressed);
+		graph = CompressedGraph::compress(uncompressed, compress_bits, config.n_threads);
+		report_compression(graph);
+	}
+	void make_graph(Config& config, GraphView& graph) {
+		shared_ptr<Graph> g(new Graph());
+		make_graph(config, *g);
+		g->sort_by_prob();
+		graph = GraphView::of(g);
+	}
+	void make_graph(Config& config, LatticeGraph& graph) {
+		int popularity_seed = (graph_type == "lattice-pop") ? config.seed : -1;
+		graph = LatticeGraph(config.sqrt_size, 0.9, popularity_seed);
+	}
+	template <typename GraphT, typename StateT>
+	bool init_state(Config& config, StateT& state) {
+		configure(config);
 		PERF_UNIT("Initialization of Network");
 		PERF_TIMER();
 		bool do_simulation = true;
@@ -140,20 +430,53 @@ struct CmdLineParser {
 			config.size = config.sqrt_size * config.sqrt_size;
 			printf("Creating network of size %d\n", config.size);
 			state.init(config);
+			Timer timer;
 			state.visit(*reader);
-			printf("Loaded from '%s': Graph of size %d by %d\n",
-					read_filename.c_str(), config.sqrt_size, config.sqrt_size);
+			printf("Loaded from '%s': Graph of size %d by %d (%.9gms)\n",
+					read_filename.c_str(), config.sqrt_size, config.sqrt_size, timer.get_microseconds() / 1000.0);
+		} else if (!snapshot_filename.empty()) {
+			shared_ptr<Snapshot> snapshot = Snapshot::open(snapshot_filename);
+			if (verify_snapshot) {
+				ASSERT(snapshot->verify(), "Snapshot section checksums do not match!");
+			}
+			config.sqrt_size = snapshot->sqrt_size();
+			config.size = config.sqrt_size * config.sqrt_size;
+			if (snapshot->has(SECTION_GRAPH_ORIGINAL_IDS)) {
+				// Imported: the padding has no original id
+				GraphView view = snapshot->graph();
+				config.unpadded_size = view.n;
+				while (config.unpadded_size > 0 && view.original_ids[config.unpadded_size - 1] == -1) {
+					config.unpadded_size--;
+				}
+				if (!trace_filename.empty()) {
+					original_ids.assign(view.original_ids, view.original_ids + view.n);
+				}
+			}
+			printf("Creating network of size %d\n", config.size);
+			state.init(config);
+			attach_snapshot(state, snapshot);
 		} else {
+			// Before init: importing sets the size
+			GraphT graph;
+			make_graph(config, graph);
 			printf("Creating network of size %d\n", config.size);
 			state.init(config);
-			state.set_graph(generate_graph(config));
+			state.set_graph(std::move(graph));
+			if (!save_snapshot_filename.empty()) {
+				save_snapshot(save_snapshot_filename, config.sqrt_size, state, graph);
+				do_simulation = false;
+			}
 			if (writer != NULL) {
 				printf("Saving to '%s': Graph of size %d by %d\n",
 						write_filename.c_str(), config.sqrt_size, config.sqrt_size);
+				Timer timer;
 				(*writer) << config.sqrt_size;
 				state.visit(*writer);
-				printf("Saved to '%s': Graph of size %d by %d\n",
-						write_filename.c_str(), config.sqrt_size, config.sqrt_size);
+				// Durable once this returns:
+				writer->close();
+				delete writer; writer = NULL;
+				printf("Saved to '%s': Graph of size %d by %d (%.9gms)\n",
+						write_filename.c_str(), config.sqrt_size, config.sqrt_size, timer.get_microseconds() / 1000.0);
 				printf("Exiting. Run with ./run.sh -r '%s'\n", write_filename.c_str());
 				do_simulation = false; // We are just writing & quitting
 			}
@@ -165,74 +488,394 @@ struct CmdLineParser {
 	}
 };
 
-static void run(Config& C, State& state) {
+// Templated, so that the hot loop calls the engine and the observer directly.
+// tick() is called between steps, every 'tick_us' microseconds. The observer gets the
+// infections in batches, and has them all before each tick().
+template <typename StateT, typename Observer, typename Tick>
+static void run(Config& C, StateT& state, Observer& observer, Tick tick, double tick_us = 100 * 1000) {
 	PERF_TIMER();
-	output_network(C, "Initial Conditions", state);
-    if (C.delay) {
-//    	sdl_delay(100);
-    }
+	deliver_infections(state, observer);
     MilestoneRep rep;
     bool finished = false;
     while (!finished) {
-//		sdl_delay(10);
 		Timer timer;
 		double last_time = timer.get_microseconds();
-		// Draw after every 100 milliseconds of simulation:
-		while (last_time + 100*1000 > timer.get_microseconds()) {
+		while (last_time + tick_us > timer.get_microseconds()) {
 			if (state.finished(C)) {
 				finished = true;
 				break; // Done
 			}
 			state.step();
+			if (state.infections.full()) {
+				deliver_infections(state, observer);
+			}
 			rep.report("Simulated step %d");
 		}
-		stringstream ss("Simulation ");
-	    ss.imbue(std::locale(""));
-		ss << "W = "         << state.total_weight() << endl
-		   << "sim-time ="   << state.time_elapsed << "s"              << endl
-		   << "step: "       << state.n_steps                          << endl
-		   << "infections: " << state.n_infections;
-		output_network(C, ss.str(), state);
-	}
-    output_network(C, "Simulation Complete", state);
-    if (C.delay) {
-//    	sdl_delay(1000);
-    }
+		deliver_infections(state, observer);
+		tick();
+	}
 }
 
-int main(int argn, const char** argv) {
-	if (scan_flag("--test", argn, argv) != argn) {
-		return run_unittests();
+// Visual mode: run() goes on a thread of its own, which feeds the infections through a
+// lock-free ring to this thread, which owns SDL and draws at most every FRAME_US.
+// The simulation never waits for a frame to be drawn; frames are skipped instead.
+template <typename StateT, typename Observer, typename Tick>
+static void run_visual(Config& C, StateT& state, Renderer& renderer, Observer& observer, Tick tick) {
+	const double FRAME_US = 1e6 / 30, PUBLISH_US = 10 * 1000;
+	SpscRing<RenderEvent> ring(1 << 20);
+	RenderFeed feed(ring);
+	auto feed_and_observe = observe(feed, observer);
+	SimStatus status;
+	status.publish(state);
+	exception_ptr error;
+	thread simulation([&]() {
+		try {
+			run(C, state, feed_and_observe, [&]() {
+				status.publish(state);
+				tick();
+			}, PUBLISH_US);
+		} catch (...) {
+			error = current_exception();
+		}
+		status.publish(state);
+		status.finished.store(true, memory_order_release);
+	});
+	vector<RenderEvent> events(64 * 1024);
+	Timer timer;
+	size_t n_frames = 0;
+	renderer.draw(C, "Initial Conditions", status.n_steps);
+	double last_frame = timer.get_microseconds();
+	while (true) {
+		// Once finished is seen, everything is in the ring
+		bool done = status.finished.load(memory_order_acquire);
+		size_t n = ring.pop(events.data(), events.size());
+		renderer.add(events.data(), n);
+		if (done && n == 0) {
+			break;
+		}
+		if (timer.get_microseconds() - last_frame >= FRAME_US) {
+			renderer.draw(C, status.label(), status.n_steps);
+			last_frame = timer.get_microseconds();
+			n_frames++;
+		} else if (n == 0) {
+			this_thread::sleep_for(chrono::milliseconds(1));
+		}
 	}
-    time_t seed;
-    time(&seed);
-    seed = 3; // Fixed for comparison purposes.
-    CmdLineParser cmd(argn, argv);
-    Config config(seed, Config::DEFAULT_SQRT_SIZE);
-	State state;
+	simulation.join();
+	if (error) {
+		rethrow_exception(error);
+	}
+	renderer.draw(C, "Simulation Complete", state.n_steps);
+	printf("Drew %zu frames (%.1f fps); the simulation waited on drawing %zu times\n",
+			n_frames, n_frames / (timer.get_microseconds() / 1e6), feed.n_stalls);
+}
+
+// The trial loop's progress, saved in checkpoints along with the engine's
+struct TrialProgress {
+	string engine;
+	size_t network_size = 0;
+	int trial = 0;
+	int n_infections = 0;
+	size_t n_steps = 0;
+	// Time spent simulating
+	double seconds = 0;
+	StatCalc final_sizes;
+	READ_WRITE(rw) {
+		rw << engine << network_size << trial << n_infections << n_steps << seconds;
+		rw << final_sizes.min << final_sizes.max << final_sizes.average;
+		rw << final_sizes.sum << final_sizes.q_value << final_sizes.n_elements;
+	}
+};
+
+// The same summary for every engine: steps are engine-specific (a generation, for
+// percolation and bitparallel), trials are comparable.
+static void report_trials(const char* engine_name, int n_trials, double seconds, size_t n_steps,
+		size_t n_infections, StatCalc& final_sizes) {
+	printf("Total infections = %zu\n", n_infections);
+	printf("Engine %s: %d trials in %.3fs (%.2f trials/sec), %zu steps (%.0f steps/sec)\n",
+			engine_name, n_trials, seconds, n_trials / seconds, n_steps, n_steps / seconds);
+	printf("Final sizes: ");
+	final_sizes.print_summary();
+}
+
+// Runs the trials with the chosen engine, and reports timing and final size statistics
+// in the same form for every engine.
+template <typename StateT, typename GraphT>
+static int simulate(const char* engine_name, CmdLineParser& cmd, Config& config) {
+	StateT state;
 	// Create the network according to passed settings
-	if (!cmd.init_state(config, state)) {
+	if (!cmd.init_state<GraphT>(config, state)) {
 		// We are just writing the graph and exiting
 		return 0;
 	}
 
 	PERF_UNIT("Network Simulation Stats");
 	int N_SIMS = 10;
-	int n_infections = 0;
-	for (int i = 0; i < N_SIMS; i++) {
-		printf("SIMULATION TRIAL (%d/%d)\n", i+1, N_SIMS);
+	TrialProgress progress;
+	progress.engine = engine_name;
+	progress.network_size = state.size();
+	// Resuming mid-trial, which must not be seeded again:
+	bool resumed = false;
+	if (!cmd.restore_filename.empty()) {
+		DataReader reader(cmd.restore_filename);
+		progress.visit(reader);
+		ASSERT(progress.engine == engine_name, "Checkpoint is of another engine!");
+		ASSERT(progress.network_size == state.size(), "Checkpoint is of another network!");
+		state.visit_progress(reader);
+		resumed = true;
+		printf("Restored '%s': trial %d, step %zu\n", cmd.restore_filename.c_str(), progress.trial + 1, state.n_steps);
+	}
+	Checkpointer checkpointer(cmd.checkpoint_filename, cmd.checkpoint_interval, cmd.lz);
+	unique_ptr<TraceWriter> trace;
+	TraceObserver tracer;
+	if (!cmd.trace_filename.empty()) {
+		trace.reset(new TraceWriter(cmd.trace_filename, cmd.lz));
+		ASSERT(trace->is_open(), "Could not open trace file for writing!");
+		trace->write_original_ids(cmd.original_ids);
+		tracer.writer = trace.get();
+	}
+	Renderer renderer;
+	GenerationStats generations;
+	generations.enabled = cmd.generations;
+	auto observer = observe(tracer, generations);
+	state.infections.enable(cmd.visualize || observer.active());
+	Timer timer;
+	double restored_seconds = progress.seconds;
+	for (; progress.trial < N_SIMS; progress.trial++) {
+		printf("SIMULATION TRIAL (%d/%d)\n", progress.trial + 1, N_SIMS);
+		if (trace) {
+			trace->set_trial(progress.trial);
+		}
+		if (cmd.visualize) {
+			renderer.init(config);
+		}
+		if (generations.enabled) {
+			// Chains cut by a restore are counted from where it resumed
+			generations.reset(state.size());
+		}
+		if (!resumed) {
+			// Small (imported) networks cannot take the usual 1000, and padding is never seeded
+			int n_seeds = min(1000, config.n_seedable());
+			printf("Infecting %d random\n", n_seeds);
+			state.infect_n_random(n_seeds);
+		}
+		resumed = false;
+		auto tick = [&]() {
+			if (checkpointer.due()) {
+				progress.seconds = restored_seconds + timer.get_microseconds() / 1e6;
+				checkpointer.write([&](DataWriter& writer) {
+					progress.visit(writer);
+					state.visit_progress(writer);
+				});
+			}
+		};
 		if (cmd.visualize) {
-			output_init(config, state);
-			state.on_infect_func = on_infect;
+			run_visual(config, state, renderer, observer, tick);
+		} else {
+			run(config, state, observer, tick);
 		}
-		printf("Infecting 10 random\n");
-		state.infect_n_random(1000);
-		output_network(config, "Initial Conditions", state);
-		run(config, state);
+		progress.n_infections += state.n_infections;
+		progress.n_steps += state.n_steps;
+		progress.final_sizes.add_element(state.n_infections);
+		printf("Simulation complete!\n");
+		if (generations.enabled) {
+			generations.print();
+		}
+		state.fast_reset(config);
+	}
+	checkpointer.wait();
+	if (trace) {
+		ASSERT(trace->close(), "Could not write the trace out!");
+		printf("Traced %llu infections to '%s' (%.1fMB)\n", (unsigned long long)trace->n_records(),
+				cmd.trace_filename.c_str(), trace->file_size() / 1e6);
+	}
+	double seconds = restored_seconds + timer.get_microseconds() / 1e6;
+	report_trials(engine_name, N_SIMS, seconds, progress.n_steps, progress.n_infections, progress.final_sizes);
+	return 0;
+}
+
+// Runs the trials with an engine that computes final sizes (and infection times, for sssp)
+// over a Graph it does not own: StateSSSP or StatePercolation. Without drawing, -r/-w,
+// snapshots or checkpoints, and reported like simulate().
+template <typename StateT>
+static int simulate_final_sizes(const char* engine_name, CmdLineParser& cmd, Config& config) {
+	if (!cmd.final_size_engine_supported(engine_name)) {
+		return 1;
+	}
+	cmd.configure(config);
+	config.visualize = false;
+	Graph graph;
+	StateT state;
+	{
+		PERF_UNIT("Initialization of Network");
+		cmd.make_graph(config, graph);
+		printf("Creating network of size %d\n", config.size);
+		state.init(config);
+		state.set_graph(graph);
+	}
+
+	PERF_UNIT("Network Simulation Stats");
+	int N_SIMS = 10;
+	unique_ptr<TraceWriter> trace;
+	TraceObserver tracer;
+	if (!cmd.trace_filename.empty()) {
+		trace.reset(new TraceWriter(cmd.trace_filename, cmd.lz));
+		ASSERT(trace->is_open(), "Could not open trace file for writing!");
+		trace->write_original_ids(cmd.original_ids);
+		tracer.writer = trace.get();
+	}
+	state.infections.enable(tracer.active());
+	StatCalc final_sizes;
+	size_t n_steps = 0;
+	int n_infections = 0;
+	Timer timer;
+	for (int trial = 0; trial < N_SIMS; trial++) {
+		printf("SIMULATION TRIAL (%d/%d)\n", trial + 1, N_SIMS);
+		if (trace) {
+			trace->set_trial(trial);
+		}
+		int n_seeds = min(1000, config.n_seedable());
+		printf("Infecting %d random\n", n_seeds);
+		state.infect_n_random(n_seeds);
+		run(config, state, tracer, []() {});
 		n_infections += state.n_infections;
+		n_steps += state.n_steps;
+		final_sizes.add_element(state.n_infections);
 		printf("Simulation complete!\n");
 		state.fast_reset(config);
 	}
-	printf("Total infections = %d\n", n_infections);
+	if (trace) {
+		ASSERT(trace->close(), "Could not write the trace out!");
+		printf("Traced %llu infections to '%s' (%.1fMB)\n", (unsigned long long)trace->n_records(),
+				cmd.trace_filename.c_str(), trace->file_size() / 1e6);
+	}
+	report_trials(engine_name, N_SIMS, timer.get_microseconds() / 1e6, n_steps, n_infections, final_sizes);
+	return 0;
+}
+
+// Runs one pass of StateBitParallel<W>: 64 * W trials at once, final sizes only
+template <int W>
+static int simulate_bitparallel(const char* engine_name, CmdLineParser& cmd, Config& config) {
+	if (!cmd.final_size_engine_supported(engine_name) || !cmd.trace_filename.empty()) {
+		if (!cmd.trace_filename.empty()) {
+			printf("Engine '%s' does not support --trace\n", engine_name);
+		}
+		return 1;
+	}
+	cmd.configure(config);
+	config.visualize = false;
+	Graph graph;
+	StateBitParallel<W> state;
+	{
+		PERF_UNIT("Initialization of Network");
+		cmd.make_graph(config, graph);
+		printf("Creating network of size %d\n", config.size);
+		state.init(config);
+		state.set_graph(graph);
+	}
+
+	PERF_UNIT("Network Simulation Stats");
+	const int N_SIMS = StateBitParallel<W>::TRIALS;
+	printf("SIMULATION TRIALS (%d at once)\n", N_SIMS);
+	Timer timer;
+	int n_seeds = min(1000, config.n_seedable());
+	printf("Infecting %d random in every trial\n", n_seeds);
+	state.infect_n_random(n_seeds);
+	{
+		PERF_TIMER2("StateBitParallel pass");
+		while (!state.finished(config)) {
+			state.step();
+		}
+	}
+	StatCalc final_sizes;
+	for (size_t n : state.trial_sizes()) {
+		final_sizes.add_element(n);
+	}
+	printf("Simulation complete!\n");
+	report_trials(engine_name, N_SIMS, timer.get_microseconds() / 1e6, state.n_steps, state.n_infections, final_sizes);
 	return 0;
 }
+
+int main(int argn, const char** argv) {
+	if (scan_flag("--test", argn, argv) != argn) {
+		return run_unittests();
+	}
+    time_t seed;
+    time(&seed);
+    seed = 3; // Fixed for comparison purposes.
+    CmdLineParser cmd(argn, argv);
+    Config config(seed, Config::DEFAULT_SQRT_SIZE);
+    bool lattice = (cmd.graph_type == "lattice" || cmd.graph_type == "lattice-pop");
+    bool known = lattice || cmd.graph_type == "torus" || cmd.graph_type == "er"
+    		|| cmd.graph_type == "ws" || cmd.graph_type == "ba" || cmd.graph_type == "config";
+    if (!known) {
+    	printf("Unknown graph '%s', expected 'torus', 'lattice', 'lattice-pop', 'er', 'ws', 'ba' or 'config'\n",
+    			cmd.graph_type.c_str());
+    	return 1;
+    }
+    // Imported graphs and snapshots are always explicit
+    bool from_snapshot = !cmd.snapshot_filename.empty();
+    lattice = lattice && cmd.import_filename.empty() && !from_snapshot;
+    bool compressed = !lattice && !from_snapshot && cmd.compress_bits != 0;
+    if (compressed && cmd.compress_bits != 8 && cmd.compress_bits != 16) {
+    	printf("Unknown compression '%d', expected 8 or 16 bits\n", cmd.compress_bits);
+    	return 1;
+    }
+    if (!cmd.reorder.empty() && cmd.reorder != "bfs" && cmd.reorder != "rcm" && cmd.reorder != "hilbert") {
+    	printf("Unknown ordering '%s', expected 'bfs', 'rcm' or 'hilbert'\n", cmd.reorder.c_str());
+    	return 1;
+    }
+    if (!cmd.reorder.empty() && (lattice || from_snapshot || !cmd.read_filename.empty())) {
+    	printf("--reorder renumbers generated or imported graphs, not --graph lattice, --snapshot or -r networks\n");
+    	return 1;
+    }
+    if (!cmd.save_snapshot_filename.empty() && (lattice || compressed)) {
+    	printf("Snapshots hold uncompressed explicit graphs only, drop --graph lattice / --compress\n");
+    	return 1;
+    }
+    if (cmd.engine != "kmc" && cmd.engine != "event" && cmd.engine != "sssp"
+    		&& cmd.engine != "percolation" && cmd.engine != "bitparallel") {
+    	printf("Unknown engine '%s', expected 'kmc', 'event', 'sssp', 'percolation' or 'bitparallel'\n",
+    			cmd.engine.c_str());
+    	return 1;
+    }
+#ifdef PERF_TIMERS_DISABLED
+    if (!cmd.perf_trace_filename.empty() || !cmd.perf_summary_filename.empty()) {
+    	printf("Timers are compiled out of this build (PERF_TIMERS_DISABLED), so --perf-trace and --perf-summary would be empty\n");
+    	return 1;
+    }
+#endif
+    if (!cmd.perf_trace_filename.empty()) {
+    	perf_trace_start(1 << 20, cmd.perf_trace_min_us);
+    }
+    int result;
+    // kmc: Approach 1 (State), event: Approach 2 (StateAlt), see state_alt.h.
+    // sssp, percolation and bitparallel: the same dynamics as event, see state_sssp.h,
+    // state_percolation.h and state_bitparallel.h
+    if (cmd.engine == "kmc") {
+    	// State keeps no graph, so snapshots need no special graph type
+    	result = lattice ? simulate<State, LatticeGraph>("kmc", cmd, config)
+    			: compressed ? simulate<State, CompressedGraph>("kmc", cmd, config)
+    			: simulate<State, Graph>("kmc", cmd, config);
+    } else if (cmd.engine == "sssp") {
+    	result = simulate_final_sizes<StateSSSP>("sssp", cmd, config);
+    } else if (cmd.engine == "percolation") {
+    	result = simulate_final_sizes<StatePercolation>("percolation", cmd, config);
+    } else if (cmd.engine == "bitparallel") {
+    	result = simulate_bitparallel<4>("bitparallel", cmd, config);
+    } else {
+    	result = lattice ? simulate<StateAltLattice, LatticeGraph>("event", cmd, config)
+    			: compressed ? simulate<StateAltCompressed, CompressedGraph>("event", cmd, config)
+    			: from_snapshot ? simulate<StateAltView, GraphView>("event", cmd, config)
+    			: simulate<StateAlt, Graph>("event", cmd, config);
+    }
+    if (!cmd.perf_trace_filename.empty()) {
+    	ASSERT(perf_write_trace(cmd.perf_trace_filename.c_str()), "Could not write the perf trace!");
+    	printf("Wrote the timeline of timed scopes to '%s'\n", cmd.perf_trace_filename.c_str());
+    }
+    if (!cmd.perf_summary_filename.empty()) {
+    	ASSERT(perf_write_summary(cmd.perf_summary_filename.c_str()), "Could not write the perf summary!");
+    	printf("Wrote the timing summary to '%s'\n", cmd.perf_summary_filename.c_str());
+    }
+    return result;
+}
@@ -0,0 +1,160 @@
+#ifndef OBSERVERS_H_
+#define OBSERVERS_H_
+
+#include <algorithm>
+#include <cstdio>
+#include <vector>
+
+#include "libs/int_types.h"
+
+#include "discrete_common.h"
+
+/*
+ * Infection events, handed from the engines to observers in batches.
+ *
+ * Engines append every infection to their InfectionLog, which only stores anything once
+ * enabled (a predictable branch otherwise). The run loop hands the logged events to an
+ * observer in batches, as columns, and clears the log. Observers are template parameters
+ * of the run loop, so delivery is a direct call per batch, and ObserverList composes
+ * several (eg drawing, tracing and statistics) into a single pass.
+ *
+ * An observer has:
+ *    bool active() const;                          // false if it wants no events
+ *    void on_infections(const InfectionBatch& b);
+ */
+
+// A span of infections, as columns. The infector is -1 for seeded infections.
+struct InfectionBatch {
+	const double* time;
+	const entity_id* infector;
+	const entity_id* infected;
+	const uint64_t* step;
+	size_t n;
+	size_t size() const {
+		return n;
+	}
+};
+
+class InfectionLog {
+public:
+	// Batches are handed over once this size is reached
+	static const size_t BATCH_SIZE = 4096;
+
+	bool enabled() const {
+		return on;
+	}
+	void enable(bool on) {
+		this->on = on;
+		clear();
+	}
+	void add(double t, entity_id infector_id, entity_id infected_id, uint64_t s) {
+		if (on) {
+			time.push_back(t);
+			infector.push_back(infector_id);
+			infected.push_back(infected_id);
+			step.push_back(s);
+		}
+	}
+	bool empty() const {
+		return infected.empty();
+	}
+	bool full() const {
+		return infected.size() >= BATCH_SIZE;
+	}
+	InfectionBatch batch() const {
+		return {time.data(), infector.data(), infected.data(), step.data(), infected.size()};
+	}
+	void clear() {
+		time.clear(), infector.clear(), infected.clear(), step.clear();
+	}
+private:
+	bool on = false;
+	std::vector<double> time;
+	std::vector<entity_id> infector, infected;
+	std::vector<uint64_t> step;
+};
+
+struct NullObserver {
+	bool active() const {
+		return false;
+	}
+	void on_infections(const InfectionBatch&) {
+	}
+};
+
+// Hands each batch to every active observer in turn
+template <typename... Observers>
+struct ObserverList;
+
+template <>
+struct ObserverList<> {
+	bool active() const {
+		return false;
+	}
+	void on_infections(const InfectionBatch&) {
+	}
+};
+
+template <typename First, typename... Rest>
+struct ObserverList<First, Rest...> {
+	ObserverList(First& first, Rest&... rest) :
+			first(first), rest(rest...) {
+	}
+	bool active() const {
+		return first.active() || rest.active();
+	}
+	void on_infections(const InfectionBatch& batch) {
+		if (first.active()) {
+			first.on_infections(batch);
+		}
+		rest.on_infections(batch);
+	}
+	First& first;
+	ObserverList<Rest...> rest;
+};
+
+template <typename... Observers>
+inline ObserverList<Observers...> observe(Observers&... observers) {
+	return ObserverList<Observers...>(observers...);
+}
+
+// Hands the infections logged by 'state' to 'observer', and clears the log
+template <typename StateT, typename Observer>
+inline void deliver_infections(StateT& state, Observer& observer) {
+	if (!state.infections.empty()) {
+		observer.on_infections(state.infections.batch());
+		state.infections.clear();
+	}
+}
+
+// Transmission chain depths: seeds are generation 0, and each infection is one
+// generation past its infector.
+struct GenerationStats {
+	bool enabled = false;
+	std::vector<int> generation;
+	size_t n_infections = 0, sum = 0;
+	int max = 0;
+
+	bool active() const {
+		return enabled;
+	}
+	void reset(size_t n_entities) {
+		generation.assign(n_entities, 0);
+		n_infections = 0, sum = 0, max = 0;
+	}
+	void on_infections(const InfectionBatch& batch) {
+		for (size_t i = 0; i < batch.n; i++) {
+			entity_id infector = batch.infector[i];
+			int g = (infector < 0) ? 0 : generation[infector] + 1;
+			generation[batch.infected[i]] = g;
+			sum += g;
+			max = std::max(max, g);
+		}
+		n_infections += batch.n;
+	}
+	void print() const {
+		printf("Transmission chains: mean generation %.2f, max %d\n", n_infections ? sum / (double)n_infections : 0.0, max);
+	}
+};
+
+#endif /* OBSERVERS_H_ */
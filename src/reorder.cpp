@@ -0,0 +1,175 @@
+#include <algorithm>
+#include <utility>
+
+#include "libs/perf_timer.h"
+
+#include "reorder.h"
+
+using namespace std;
+
+vector<entity_id> bfs_order(const Graph& g) {
+	PERF_TIMER();
+	size_t n = g.size();
+	vector<entity_id> order;
+	order.reserve(n);
+	vector<bool> visited(n, false);
+	for (size_t start = 0; start < n; start++) {
+		if (visited[start]) {
+			continue;
+		}
+		visited[start] = true;
+		order.push_back(start);
+		// 'order' doubles as the queue:
+		for (size_t head = order.size() - 1; head < order.size(); head++) {
+			entity_id u = order[head];
+			for (size_t e = g.offsets[u]; e < g.offsets[u + 1]; e++) {
+				entity_id v = g.targets[e];
+				if (!visited[v]) {
+					visited[v] = true;
+					order.push_back(v);
+				}
+			}
+		}
+	}
+	return order;
+}
+
+vector<entity_id> rcm_order(const Graph& g) {
+	PERF_TIMER();
+	size_t n = g.size();
+	// Entities by increasing degree (a stable counting sort), for picking each component's start:
+	size_t max_degree = 0;
+	for (size_t i = 0; i < n; i++) {
+		max_degree = std::max(max_degree, g.degree(i));
+	}
+	vector<size_t> first(max_degree + 2, 0);
+	for (size_t i = 0; i < n; i++) {
+		first[g.degree(i) + 1]++;
+	}
+	for (size_t d = 0; d <= max_degree; d++) {
+		first[d + 1] += first[d];
+	}
+	vector<entity_id> by_degree(n);
+	for (size_t i = 0; i < n; i++) {
+		by_degree[first[g.degree(i)]++] = i;
+	}
+
+	vector<entity_id> order;
+	order.reserve(n);
+	vector<bool> visited(n, false);
+	vector<entity_id> neighbours;
+	for (entity_id start : by_degree) {
+		if (visited[start]) {
+			continue;
+		}
+		visited[start] = true;
+		order.push_back(start);
+		for (size_t head = order.size() - 1; head < order.size(); head++) {
+			entity_id u = order[head];
+			neighbours.clear();
+			for (size_t e = g.offsets[u]; e < g.offsets[u + 1]; e++) {
+				entity_id v = g.targets[e];
+				if (!visited[v]) {
+					visited[v] = true;
+					neighbours.push_back(v);
+				}
+			}
+			std::stable_sort(neighbours.begin(), neighbours.end(), [&](entity_id a, entity_id b) {
+				return g.degree(a) < g.degree(b);
+			});
+			order.insert(order.end(), neighbours.begin(), neighbours.end());
+		}
+	}
+	std::reverse(order.begin(), order.end());
+	return order;
+}
+
+// Position of (x, y) along the Hilbert curve filling a side x side square (side a power of 2)
+static uint64_t hilbert_index(uint64_t side, uint64_t x, uint64_t y) {
+	uint64_t d = 0;
+	for (uint64_t s = side / 2; s > 0; s /= 2) {
+		uint64_t rx = (x & s) > 0, ry = (y & s) > 0;
+		d += s * s * ((3 * rx) ^ ry);
+		// Rotate the quadrant:
+		if (ry == 0) {
+			if (rx == 1) {
+				x = side - 1 - x;
+				y = side - 1 - y;
+			}
+			std::swap(x, y);
+		}
+	}
+	return d;
+}
+
+vector<entity_id> hilbert_order(const Graph& g, int rows) {
+	PERF_TIMER();
+	size_t n = g.size();
+	uint64_t side = 1;
+	while (side < (uint64_t)rows) {
+		side *= 2;
+	}
+	vector<pair<uint64_t, entity_id>> keyed(n);
+	for (size_t i = 0; i < n; i++) {
+		// Position from the original id, as renumbering says nothing about space:
+		int64_t id = g.original_ids.empty() ? i : g.original_ids[i];
+		keyed[i] = {id < 0 ? UINT64_MAX : hilbert_index(side, id % rows, id / rows), (entity_id)i};
+	}
+	std::sort(keyed.begin(), keyed.end());
+	vector<entity_id> order(n);
+	for (size_t i = 0; i < n; i++) {
+		order[i] = keyed[i].second;
+	}
+	return order;
+}
+
+void apply_order(Graph& g, const vector<entity_id>& order) {
+	PERF_TIMER();
+	size_t n = g.size();
+	ASSERT(order.size() == n, "Ordering must cover every entity!");
+	vector<entity_id> new_id(n);
+	for (size_t i = 0; i < n; i++) {
+		new_id[order[i]] = i;
+	}
+	Graph h;
+	h.offsets.resize(n + 1);
+	h.offsets[0] = 0;
+	for (size_t i = 0; i < n; i++) {
+		h.offsets[i + 1] = h.offsets[i] + g.degree(order[i]);
+	}
+	h.targets.resize(g.n_edges());
+	h.probs.resize(g.n_edges());
+	h.original_ids.resize(n);
+	for (size_t i = 0; i < n; i++) {
+		entity_id old = order[i];
+		size_t e = h.offsets[i];
+		for (size_t k = g.offsets[old]; k < g.offsets[old + 1]; k++, e++) {
+			h.targets[e] = new_id[g.targets[k]];
+			h.probs[e] = g.probs[k];
+		}
+		h.original_ids[i] = g.original_ids.empty() ? old : g.original_ids[old];
+	}
+	g = std::move(h);
+}
+
+bool reorder_graph(Graph& g, const string& method, int rows, int unpadded_size) {
+	Timer timer;
+	vector<entity_id> order;
+	if (method == "bfs") {
+		order = bfs_order(g);
+	} else if (method == "rcm") {
+		order = rcm_order(g);
+	} else if (method == "hilbert") {
+		order = hilbert_order(g, rows);
+	} else {
+		return false;
+	}
+	if (unpadded_size >= 0) {
+		std::stable_partition(order.begin(), order.end(), [&](entity_id old) {
+			return old < unpadded_size;
+		});
+	}
+	apply_order(g, order);
+	printf("Reordered %zu entities by %s (%.9gms)\n", g.size(), method.c_str(), timer.get_microseconds() / 1000.0);
+	return true;
+}
@@ -0,0 +1,32 @@
+#ifndef REORDER_H_
+#define REORDER_H_
+
+#include <string>
+#include <vector>
+
+#include "graph.h"
+
+/*
+ * Entity renumbering for memory locality: entities that infect each other should sit close
+ * together in the per-entity arrays of the engines.
+ * Each ordering returns the entities in their new order, ie order[new_id] = old_id.
+ */
+
+// Breadth-first order, starting each component from its lowest id
+std::vector<entity_id> bfs_order(const Graph& g);
+// Reverse Cuthill-McKee: breadth-first from a minimum degree entity, visiting neighbours by
+// increasing degree, then reversed. Keeps the adjacency bandwidth small.
+std::vector<entity_id> rcm_order(const Graph& g);
+// Entities at (id % rows, id / rows) in order of their position along a Hilbert curve,
+// for spatial graphs such as the torus. Uses the original ids where the graph has them.
+std::vector<entity_id> hilbert_order(const Graph& g, int rows);
+
+// Renumbers the entities of 'g' to 'order'. g.original_ids keeps mapping entities back
+// to the ids they had before any reordering (or import).
+void apply_order(Graph& g, const std::vector<entity_id>& order);
+
+// Applies the ordering named 'method' ("bfs", "rcm" or "hilbert"); returns false if unknown.
+// Padding entities, from 'unpadded_size' on (see Config::unpadded_size), are kept at the end.
+bool reorder_graph(Graph& g, const std::string& method, int rows, int unpadded_size = -1);
+
+#endif /* REORDER_H_ */
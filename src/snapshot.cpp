@@ -0,0 +1,216 @@
+#include <cstdio>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "libs/AsyncFileIO.h"
+#include "libs/perf_timer.h"
+
+#include "snapshot.h"
+
+using namespace std;
+
+static const char SNAPSHOT_MAGIC[8] = {'I', 'N', 'F', 'S', 'N', 'A', 'P', '\0'};
+static const uint32_t BYTE_ORDER_MARK = 0x01020304;
+
+static inline uint64_t mix(uint64_t h, uint64_t w) {
+	h ^= w * 0x9E3779B97F4A7C15ULL;
+	h = (h << 31) | (h >> 33);
+	return h * 0xC2B2AE3D27D4EB4FULL;
+}
+
+uint64_t snapshot_checksum(const void* data, size_t n) {
+	const char* p = (const char*)data;
+	// Four independent lanes, so that the multiplies overlap:
+	uint64_t h[4] = {1, 2, 3, 4};
+	size_t i = 0;
+	for (; i + 32 <= n; i += 32) {
+		for (int lane = 0; lane < 4; lane++) {
+			uint64_t w;
+			memcpy(&w, p + i + lane * 8, 8);
+			h[lane] = mix(h[lane], w);
+		}
+	}
+	uint64_t tail = 0;
+	for (; i < n; i++) {
+		tail = (tail << 8) | (uint8_t)p[i];
+		if (i % 8 == 7) {
+			h[0] = mix(h[0], tail), tail = 0;
+		}
+	}
+	uint64_t result = mix(mix(h[0], h[1]), mix(h[2], h[3]));
+	return mix(mix(result, tail), n);
+}
+
+static uint64_t align_up(uint64_t offset) {
+	return (offset + SNAPSHOT_ALIGN - 1) / SNAPSHOT_ALIGN * SNAPSHOT_ALIGN;
+}
+
+void SnapshotWriter::add_graph(const Graph& g) {
+	ASSERT(sizeof(size_t) == sizeof(uint64_t), "Snapshots need 64-bit offsets!");
+	add(SECTION_GRAPH_OFFSETS, g.offsets.data(), g.offsets.size());
+	add(SECTION_GRAPH_TARGETS, g.targets.data(), g.targets.size());
+	add(SECTION_GRAPH_PROBS, g.probs.data(), g.probs.size());
+	if (!g.original_ids.empty()) {
+		add(SECTION_GRAPH_ORIGINAL_IDS, g.original_ids.data(), g.original_ids.size());
+	}
+}
+
+void SnapshotWriter::add_alias_tables(const AliasTables& tables) {
+	add(SECTION_ALIAS_OFFSETS, tables.offsets, tables.size() + 1);
+	add(SECTION_ALIAS_CONNECTIONS, tables.connections, tables.n_connections());
+	add(SECTION_ALIAS_TOTAL_PROBS, tables.total_probs, tables.size());
+}
+
+
+void SnapshotWriter::write(const string& filename, int sqrt_size) {
+	PERF_TIMER();
+	Timer timer;
+	vector<SnapshotSection> table(sections.size());
+	uint64_t offset = align_up(sizeof(SnapshotHeader) + table.size() * sizeof(SnapshotSection));
+	for (size_t i = 0; i < sections.size(); i++) {
+		const Pending& p = sections[i];
+		SnapshotSection& s = table[i];
+		s.kind = p.kind;
+		s.elem_size = p.elem_size;
+		s.offset = offset;
+		s.count = p.count;
+		s.checksum = snapshot_checksum(p.data, p.count * p.elem_size);
+		offset = align_up(offset + p.count * p.elem_size);
+	}
+
+	SnapshotHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+	header.version = SNAPSHOT_VERSION;
+	header.byte_order = BYTE_ORDER_MARK;
+	header.header_size = sizeof(SnapshotHeader);
+	header.n_sections = table.size();
+	header.sqrt_size = sqrt_size;
+	header.file_size = offset;
+	header.table_checksum = snapshot_checksum(table.data(), table.size() * sizeof(SnapshotSection));
+	header.header_checksum = snapshot_checksum(&header, sizeof(header));
+
+	string tmp_filename = filename + ".tmp";
+	AsyncFileIO file(tmp_filename, AsyncFileIO::WRITE);
+	ASSERT(file.is_open(), "Could not open snapshot file for writing!");
+	file.write((const char*)&header, sizeof(header));
+	file.write((const char*)table.data(), table.size() * sizeof(SnapshotSection));
+	vector<char> zeros(SNAPSHOT_ALIGN, 0);
+	uint64_t written = sizeof(header) + table.size() * sizeof(SnapshotSection);
+	for (size_t i = 0; i <= sections.size(); i++) {
+		uint64_t start = (i < sections.size()) ? table[i].offset : offset;
+		file.write(zeros.data(), start - written);
+		written = start;
+		if (i < sections.size()) {
+			size_t n_bytes = sections[i].count * sections[i].elem_size;
+			file.write(sections[i].data, n_bytes);
+			written += n_bytes;
+		}
+	}
+	// Durable before it replaces the old snapshot:
+	ASSERT(file.close(), "Could not write snapshot!");
+	ASSERT(rename(tmp_filename.c_str(), filename.c_str()) == 0, "Could not rename snapshot into place!");
+	printf("Wrote snapshot '%s': %zu sections, %.1fMB (%.9gms)\n", filename.c_str(), sections.size(),
+			offset / 1e6, timer.get_microseconds() / 1000.0);
+}
+
+shared_ptr<Snapshot> Snapshot::open(const string& filename) {
+	PERF_TIMER();
+	Timer timer;
+	int fd = ::open(filename.c_str(), O_RDONLY);
+	ASSERT(fd >= 0, "Could not open snapshot file!");
+	struct stat st;
+	ASSERT(fstat(fd, &st) == 0, "Could not stat snapshot file!");
+	size_t size = st.st_size;
+	ASSERT(size >= sizeof(SnapshotHeader), "Snapshot file is truncated!");
+	// Shared, so that every process mapping the snapshot uses the same page cache pages:
+	void* addr = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	ASSERT(addr != MAP_FAILED, "Could not map snapshot file!");
+
+	shared_ptr<Snapshot> snapshot(new Snapshot());
+	snapshot->data = (const char*)addr;
+	snapshot->size = size;
+
+	SnapshotHeader header;
+	memcpy(&header, addr, sizeof(header));
+	ASSERT(memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) == 0, "Not a snapshot file!");
+	ASSERT(header.byte_order == BYTE_ORDER_MARK, "Snapshot was written with a different byte order!");
+	ASSERT(header.version == SNAPSHOT_VERSION, "Unsupported snapshot version!");
+	ASSERT(header.header_size == sizeof(SnapshotHeader), "Snapshot header has the wrong size!");
+	uint64_t header_checksum = header.header_checksum;
+	header.header_checksum = 0;
+	ASSERT(snapshot_checksum(&header, sizeof(header)) == header_checksum, "Snapshot header is corrupt!");
+	ASSERT(header.file_size == size, "Snapshot file has the wrong size!");
+	size_t table_size = header.n_sections * sizeof(SnapshotSection);
+	ASSERT(sizeof(header) + table_size <= size, "Snapshot file is truncated!");
+	snapshot->header = (const SnapshotHeader*)addr;
+	snapshot->table = (const SnapshotSection*)(snapshot->data + sizeof(header));
+	ASSERT(snapshot_checksum(snapshot->table, table_size) == header.table_checksum, "Snapshot section table is corrupt!");
+	for (size_t i = 0; i < header.n_sections; i++) {
+		const SnapshotSection& s = snapshot->table[i];
+		ASSERT(s.offset % SNAPSHOT_ALIGN == 0, "Snapshot section is misaligned!");
+		ASSERT(s.elem_size > 0 && s.offset <= size && s.count <= (size - s.offset) / s.elem_size,
+				"Snapshot section is out of bounds!");
+	}
+	printf("Mapped snapshot '%s': %u sections, %.1fMB (%.9gms)\n", filename.c_str(), header.n_sections,
+			size / 1e6, timer.get_microseconds() / 1000.0);
+	return snapshot;
+}
+
+Snapshot::~Snapshot() {
+	if (data != NULL) {
+		munmap((void*)data, size);
+	}
+}
+
+const SnapshotSection* Snapshot::find(uint32_t kind) const {
+	for (size_t i = 0; i < header->n_sections; i++) {
+		if (table[i].kind == kind) {
+			return &table[i];
+		}
+	}
+	return NULL;
+}
+
+bool Snapshot::verify() const {
+	PERF_TIMER();
+	for (size_t i = 0; i < header->n_sections; i++) {
+		const SnapshotSection& s = table[i];
+		if (snapshot_checksum(data + s.offset, s.count * s.elem_size) != s.checksum) {
+			return false;
+		}
+	}
+	return true;
+}
+
+GraphView Snapshot::graph() {
+	GraphView view;
+	size_t n_offsets, n_targets, n_probs, n_ids;
+	view.offsets = section<size_t>(SECTION_GRAPH_OFFSETS, &n_offsets);
+	view.targets = section<entity_id>(SECTION_GRAPH_TARGETS, &n_targets);
+	view.probs = section<float>(SECTION_GRAPH_PROBS, &n_probs);
+	view.original_ids = section<int64_t>(SECTION_GRAPH_ORIGINAL_IDS, &n_ids);
+	ASSERT(view.offsets != NULL && view.targets != NULL && view.probs != NULL && n_offsets > 0, "Snapshot has no graph!");
+	view.n = n_offsets - 1;
+	ASSERT(view.n_edges() == n_targets && n_targets == n_probs, "Snapshot graph sections do not match!");
+	ASSERT(view.original_ids == NULL || n_ids == view.n, "Snapshot graph sections do not match!");
+	view.owner = shared_from_this();
+	return view;
+}
+
+AliasTables Snapshot::alias_tables() {
+	size_t n_offsets, n_connections, n_totals;
+	const uint64_t* offsets = section<uint64_t>(SECTION_ALIAS_OFFSETS, &n_offsets);
+	const AliasTables::Connection* connections = section<AliasTables::Connection>(SECTION_ALIAS_CONNECTIONS, &n_connections);
+	const double* total_probs = section<double>(SECTION_ALIAS_TOTAL_PROBS, &n_totals);
+	ASSERT(offsets != NULL && connections != NULL && total_probs != NULL && n_offsets > 0, "Snapshot has no walker tables!");
+	ASSERT(n_totals + 1 == n_offsets && offsets[n_totals] == n_connections, "Snapshot walker table sections do not match!");
+	AliasTables tables;
+	tables.set_view(offsets, connections, total_probs, n_totals, shared_from_this());
+	return tables;
+}
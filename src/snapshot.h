@@ -0,0 +1,134 @@
+#ifndef SNAPSHOT_H_
+#define SNAPSHOT_H_
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "libs/int_types.h"
+
+#include "graph.h"
+#include "state.h"
+
+/*
+ * Snapshot of a preprocessed network, mapped and used in place: loading costs a few
+ * page faults rather than a parse, and processes mapping the same file share its pages.
+ *
+ * Layout (native byte order, checked on load):
+ *   SnapshotHeader
+ *   SnapshotSection * n_sections
+ *   sections, each starting on a SNAPSHOT_ALIGN boundary
+ * The header and section table are checksummed and always verified. Sections have their
+ * own checksums, only verified by verify() as that reads every page.
+ *
+ * A snapshot holds the sorted CSR graph (for StateAltView, or for State to build its walker
+ * tables) and/or State's walker tables.
+ */
+
+const uint32_t SNAPSHOT_VERSION = 1;
+const uint64_t SNAPSHOT_ALIGN = 4096;
+
+enum SnapshotSectionKind {
+	SECTION_GRAPH_OFFSETS = 1,
+	SECTION_GRAPH_TARGETS = 2,
+	SECTION_GRAPH_PROBS = 3,
+	SECTION_GRAPH_ORIGINAL_IDS = 4,
+	SECTION_ALIAS_OFFSETS = 5,
+	SECTION_ALIAS_CONNECTIONS = 6,
+	SECTION_ALIAS_TOTAL_PROBS = 7
+};
+
+struct SnapshotHeader {
+	char magic[8];
+	uint32_t version;
+	// 0x01020304 as written, to catch a foreign byte order
+	uint32_t byte_order;
+	uint32_t header_size;
+	uint32_t n_sections;
+	int32_t sqrt_size;
+	uint32_t reserved;
+	uint64_t file_size;
+	uint64_t table_checksum;
+	// Of the header, with this field 0
+	uint64_t header_checksum;
+};
+
+struct SnapshotSection {
+	uint32_t kind;
+	// Checked against the type the section is read as
+	uint32_t elem_size;
+	uint64_t offset;
+	uint64_t count;
+	uint64_t checksum;
+};
+
+// 64-bit checksum of 'n' bytes, at several GB/s
+uint64_t snapshot_checksum(const void* data, size_t n);
+
+// Collects sections, then writes them out. The arrays must outlive write().
+struct SnapshotWriter {
+	template <typename T>
+	void add(uint32_t kind, const T* data, size_t count) {
+		sections.push_back(Pending {kind, (uint32_t)sizeof(T), (const char*)data, count});
+	}
+	// 'g' must be sorted by descending probability
+	void add_graph(const Graph& g);
+	void add_alias_tables(const AliasTables& tables);
+	// Writes to a temporary file renamed over 'filename', so that processes still mapping
+	// an older snapshot keep their (unlinked) copy intact
+	void write(const std::string& filename, int sqrt_size);
+private:
+	struct Pending {
+		uint32_t kind, elem_size;
+		const char* data;
+		size_t count;
+	};
+	std::vector<Pending> sections;
+};
+
+// A read-only mapping of a snapshot file. Views into it keep it mapped.
+class Snapshot : public std::enable_shared_from_this<Snapshot> {
+public:
+	// Maps 'filename' and validates the header and section table, ASSERTing on failure
+	static std::shared_ptr<Snapshot> open(const std::string& filename);
+	~Snapshot();
+
+	int sqrt_size() const {
+		return header->sqrt_size;
+	}
+	size_t file_size() const {
+		return size;
+	}
+	bool has(uint32_t kind) const {
+		return find(kind) != NULL;
+	}
+	// Checks every section's checksum
+	bool verify() const;
+
+	// Sections as a typed array, NULL if absent
+	template <typename T>
+	const T* section(uint32_t kind, size_t* count) const {
+		const SnapshotSection* s = find(kind);
+		if (s == NULL) {
+			*count = 0;
+			return NULL;
+		}
+		ASSERT(s->elem_size == sizeof(T), "Snapshot section has the wrong element size!");
+		*count = s->count;
+		return (const T*)(data + s->offset);
+	}
+
+	GraphView graph();
+	AliasTables alias_tables();
+private:
+	Snapshot() {
+	}
+	const SnapshotSection* find(uint32_t kind) const;
+
+	const char* data = NULL;
+	size_t size = 0;
+	const SnapshotHeader* header = NULL;
+	const SnapshotSection* table = NULL;
+};
+
+#endif /* SNAPSHOT_H_ */
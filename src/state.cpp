@@ -12,20 +12,89 @@ void State::init(const Config& C) {
 	// Make our infection structure aware of the maximum amount of nodes:
 	active_infections.init(C.size);
 	rng.init_genrand(C.seed);
-	entities.resize(C.size);
+	infected.assign(C.size, false);
 	time_elapsed = 0;
 	n_steps = 0, n_infections = 0;
 	halflife = C.halflife;
 	time_interval_overage = 0;
+	seed_range = C.unpadded_size;
 }
 
-void State::set_graph(const Graph& graph) {
+template <typename GraphT>
+void AliasTables::build(const GraphT& graph) {
 	MilestoneRep rep;
-	for (int i = 0; i < graph.size(); i++) {
+	size_t n_entities = graph.size();
+	own_offsets.assign(1, 0);
+	own_offsets.reserve(n_entities + 1);
+	own_connections.clear();
+	own_total_probs.clear();
+	own_total_probs.reserve(n_entities);
+	WalkerConnections walker;
+	for (size_t i = 0; i < n_entities; i++) {
 		rep.report("Preprocessed %d entities");
 		PERF_TIMER2("walker method preprocess");
-		entities[i].init(graph[i]);
+		walker.init(graph[i]);
+		own_connections.insert(own_connections.end(), walker.connections.begin(), walker.connections.end());
+		own_offsets.push_back(own_connections.size());
+		own_total_probs.push_back(walker.total_prob);
 	}
+	point_to_own();
+}
+template void AliasTables::build(const Graph& graph);
+template void AliasTables::build(const LatticeGraph& graph);
+template void AliasTables::build(const CompressedGraph& graph);
+template void AliasTables::build(const GraphView& graph);
+
+void AliasTables::set_view(const uint64_t* offsets, const Connection* connections, const double* total_probs,
+		size_t n, shared_ptr<const void> owner) {
+	own_offsets.clear(), own_connections.clear(), own_total_probs.clear();
+	this->offsets = offsets, this->connections = connections, this->total_probs = total_probs;
+	this->n = n;
+	this->owner = owner;
+}
+
+AliasTables& AliasTables::operator=(const AliasTables& o) {
+	own_offsets = o.own_offsets, own_connections = o.own_connections, own_total_probs = o.own_total_probs;
+	if (o.offsets == o.own_offsets.data()) {
+		point_to_own();
+	} else {
+		offsets = o.offsets, connections = o.connections, total_probs = o.total_probs;
+		n = o.n;
+		owner = o.owner;
+	}
+	return *this;
+}
+
+void AliasTables::materialize() {
+	if (offsets == own_offsets.data() || n == 0) {
+		return;
+	}
+	own_offsets.assign(offsets, offsets + n + 1);
+	own_connections.assign(connections, connections + n_connections());
+	own_total_probs.assign(total_probs, total_probs + n);
+	point_to_own();
+}
+
+void AliasTables::point_to_own() {
+	offsets = own_offsets.data();
+	connections = own_connections.data();
+	total_probs = own_total_probs.data();
+	n = own_offsets.empty() ? 0 : own_offsets.size() - 1;
+	owner.reset();
+}
+
+template <typename GraphT>
+void State::set_graph(const GraphT& graph) {
+	alias.build(graph);
+}
+template void State::set_graph(const Graph& graph);
+template void State::set_graph(const LatticeGraph& graph);
+template void State::set_graph(const CompressedGraph& graph);
+template void State::set_graph(const GraphView& graph);
+
+void State::set_alias_tables(const AliasTables& tables) {
+	ASSERT(tables.size() == size(), "Walker tables do not match the number of entities!");
+	alias = tables;
 }
 
 // Carefully picked to form a PDF
@@ -60,7 +129,7 @@ static bool test_if_null_step(MTwist& rng, double weight, double* delta_time) {
 void State::step() {
 	static MilestoneRep rep;
 	PERF_TIMER();
-	entity_id infected_id; // declared here to satisfy 'goto' constraints
+	entity_id infected_id, infector_id; // declared here to satisfy 'goto' constraints
 	bool valid_event_occurred = false;
 	while (!valid_event_occurred) {
 		double delta_time = current_timestep();
@@ -76,11 +145,14 @@ void State::step() {
 		// We employ the rejection method here if an entity would infect the same entity twice.
 		// However, if an infection occurs twice from different infectors,
 		// we simply do nothing but step time if a valid infection does not occur.
-		infected_id = generate_potential_infection();
+		infected_id = generate_potential_infection(infector_id);
 		if (infected_id == -1) {
 			continue; // Reject!
 		}
-		try_infection(infected_id);
+		if (try_infection(infected_id)) {
+			// Counted as happening at the end of this step
+			infections.add(time_elapsed + delta_time, infector_id, infected_id, n_steps + 1);
+		}
 
 		afterinfection:
 		valid_event_occurred = true;
@@ -96,14 +168,11 @@ void State::step() {
 	}
 }
 bool State::try_infection(entity_id infected_id) {
-        Entity& e = entities[infected_id];
-	if (e.infected) {
+	if (infected[infected_id]) {
 		return false;
 	}
-	if (on_infect_func) { PERF_TIMER2("on_infect callback"); on_infect_func(infected_id); }
-//	printf("INFECTING (%d) -> (%d)\n", this->last_infector, infected_id);
-	e.infected = true;
-	active_infections.insert(infected_id, e.total_probability());
+	infected[infected_id] = true;
+	active_infections.insert(infected_id, alias.total_prob(infected_id));
 	n_infections++;
 	// We have found a valid action
 	return true;
@@ -112,19 +181,18 @@ bool State::try_infection(entity_id infected_id) {
 void State::infect_n_random(int n) {
 	// Uses rejection method implicitly:
 	while (n > 0) {
-		entity_id id = rng.rand_int(size());
+		entity_id id = rng.rand_int(seed_range >= 0 ? seed_range : size());
 		if (try_infection(id)) {
+			infections.add(time_elapsed, -1, id, n_steps);
 			n--;
 		}
 	}
 }
 
-entity_id State::generate_potential_infection() {
+entity_id State::generate_potential_infection(entity_id& infector_id) {
 	PERF_TIMER();
-	entity_id infector_id = active_infections.random_select(rng);
-	this->last_infector = infector_id;
-	Entity& e = entities[infector_id];
-	return e.pick_influence(rng);
+	infector_id = active_infections.random_select(rng);
+	return alias.pick(infector_id, rng);
 }
 
 void State::fast_reset(Config& S) {
@@ -133,7 +201,5 @@ void State::fast_reset(Config& S) {
     n_steps = 0, n_infections = 0;
     halflife = S.halflife;
     time_interval_overage = 0;
-    for (Entity& e : entities) {
-    	e.infected = false;
-    }
+    infected.assign(infected.size(), false);
 }
@@ -2,6 +2,7 @@
 #define STATE_H_
 
 #include <cmath>
+#include <memory>
 #include <string>
 
 #include "libs/mtwist.h"
@@ -10,6 +11,9 @@
 #include "discrete_fixedtree.h"
 #include "discrete_searchtree.h"
 #include "graph.h"
+#include "lattice_graph.h"
+#include "compressed_graph.h"
+#include "observers.h"
 
 /*****************************************************************************
  * An entity in the random generation simulation
@@ -23,7 +27,8 @@ struct WalkerConnections {
 		size_t m = connections.size();
 		return connections[rng.rand_int(m)].pick(*this, rng);
 	}
-	void init(const Node& node) {
+	template <typename NodeT>
+	void init(const NodeT& node) {
 		// Initial values:
 		size_t n = node.size();
     	connections.resize(n);
@@ -31,8 +36,8 @@ struct WalkerConnections {
 	    std::vector<int> shortI, longI;
 	    shortI.reserve(n), longI.reserve(n);
 		total_prob = 0;
-    	for (auto& edge : node) {
-    		total_prob += edge.prob;
+    	for (int i = 0; i < n; i++) {
+    		total_prob += node[i].prob;
     	}
 
     	// Initialize with normalized probabilities, scaled by 'n':
@@ -80,6 +85,9 @@ public:
 			bool use_choice_a = (rng.rand_real_not1() < choice_a_prob);
 			return use_choice_a ? pickA() : W.connections[choice_b_index].pickA();
 		}
+		READ_WRITE(rw) {
+			rw << choice_a_prob << choice_a << choice_b_index << was_chosen;
+		}
 	};
 	std::vector<Connection> connections;
 	std::vector<bool> was_infected;
@@ -101,7 +109,8 @@ struct Entity {
 	}
 
     // Must call before simulation!
-    void init(const Node& node) {
+    template <typename NodeT>
+    void init(const NodeT& node) {
     	influence_set.init(node);
     }
 
@@ -123,29 +132,106 @@ public:
 	WalkerConnections influence_set;
 };
 
+/*
+ * The walker tables of every entity, flattened: entity i's connections are
+ * [offsets[i], offsets[i+1]) of 'connections', with choice_b_index relative to offsets[i].
+ * The arrays are either owned, or a view into memory that 'owner' keeps alive,
+ * such as a mapped snapshot (see snapshot.h).
+ */
+struct AliasTables {
+	typedef WalkerConnections::Connection Connection;
+	const uint64_t* offsets = NULL;
+	const Connection* connections = NULL;
+	const double* total_probs = NULL;
+	size_t n = 0;
+	std::shared_ptr<const void> owner;
+
+	AliasTables() {
+	}
+	AliasTables(const AliasTables& o) {
+		*this = o;
+	}
+	AliasTables(AliasTables&& o) = default;
+	AliasTables& operator=(const AliasTables& o);
+	AliasTables& operator=(AliasTables&& o) = default;
+
+	// GraphT is Graph, LatticeGraph, CompressedGraph or GraphView
+	template <typename GraphT>
+	void build(const GraphT& graph);
+	// Points at arrays owned by 'owner'
+	void set_view(const uint64_t* offsets, const Connection* connections, const double* total_probs,
+			size_t n, std::shared_ptr<const void> owner);
+
+	size_t size() const {
+		return n;
+	}
+	size_t n_connections() const {
+		return n == 0 ? 0 : offsets[n];
+	}
+	double total_prob(entity_id id) const {
+		return total_probs[id];
+	}
+	// Consumes the same random numbers as WalkerConnections::pick
+	entity_id pick(entity_id id, MTwist& rng) const {
+		const Connection* c = connections + offsets[id];
+		size_t m = offsets[id + 1] - offsets[id];
+		const Connection& chosen = c[rng.rand_int(m)];
+		bool use_choice_a = (rng.rand_real_not1() < chosen.choice_a_prob);
+		return use_choice_a ? chosen.choice_a : c[chosen.choice_b_index].choice_a;
+	}
+
+	READ_WRITE(rw) {
+		if (rw.is_writing()) {
+			materialize();
+		}
+		rw << own_offsets << own_connections << own_total_probs;
+		if (rw.is_reading()) {
+			point_to_own();
+		}
+	}
+private:
+	// Copies viewed arrays into owned storage
+	void materialize();
+	void point_to_own();
+	std::vector<uint64_t> own_offsets;
+	std::vector<Connection> own_connections;
+	std::vector<double> own_total_probs;
+};
+
 struct State {
-	typedef void (*oninfectf)(int infected_Id);
     size_t size() {
-    	return entities.size();
+    	return infected.size();
     }
 
 	void init(const Config& C);
-	void set_graph(const Graph& graph);
+	// Builds the walker tables from the graph, which is not kept.
+	// GraphT is Graph, LatticeGraph, CompressedGraph or GraphView.
+	template <typename GraphT>
+	void set_graph(const GraphT& graph);
+	// Uses prebuilt walker tables, eg from a snapshot
+	void set_alias_tables(const AliasTables& tables);
 
 	READ_WRITE(rw) {
-		rw << time_interval_overage << halflife << last_infector;
-		rw.visit_objs(entities);
+		rw << time_interval_overage << halflife;
+		rw << infected;
+		alias.visit(rw);
+	}
+	// Everything a run changes, for checkpoints: restoring it onto the same network
+	// continues the run exactly.
+	template <typename Visitor>
+	void visit_progress(Visitor& rw) {
+		rw << time_interval_overage << halflife;
+		rw << time_elapsed << n_steps << n_infections << infected;
+		rng.visit(rw);
+		active_infections.visit(rw);
 	}
     void step();
     // Returns false if entity was already infected
     bool try_infection(entity_id infected_id);
     void infect_n_random(int n);
-    // Generate an infection, possibly invalid
-    entity_id generate_potential_infection();
+    // Generate an infection, possibly invalid, and who it is from
+    entity_id generate_potential_infection(entity_id& infector_id);
 
-    Entity& get(entity_id id) {
-    	return entities.at(id);
-    }
     double current_timestep();
     void fast_reset(Config& C);
 
@@ -154,20 +240,23 @@ struct State {
     }
 
     bool finished(Config& C) const {
-    	return n_infections * 100 >= C.size * 99 || (time_elapsed >= C.min_time && total_weight() <= C.max_weight);
+    	return n_infections * 100 >= C.n_seedable() * 99 || (time_elapsed >= C.min_time && total_weight() <= C.max_weight);
     }
 
 public:
     double time_interval_overage = -1;
     double halflife = -1;
-    // Hack to store extra result from generate_potential_infection:
-    entity_id last_infector = -1;
     // Members:
     MTwist rng;
+    // Seeds are drawn from entities below this, -1 for all (see Config::unpadded_size)
+    int seed_range = -1;
     size_t n_steps = 0;
     size_t n_infections = 0;
-    oninfectf on_infect_func = NULL;
-    std::vector<Entity> entities;
+    // Every infection, once enabled (see observers.h)
+    InfectionLog infections;
+    // Per entity:
+    std::vector<char> infected;
+    AliasTables alias;
     double time_elapsed = 0;
 	Config::InfectionSet active_infections;
 };
@@ -8,17 +8,28 @@
 
 using namespace std;
 
-void StateAlt::init(const Config& C) {
+template <typename GraphT>
+void StateAltT<GraphT>::init(const Config& C) {
 	PERF_TIMER();
 	// Make our infection structure aware of the maximum amount of nodes:
 	rng.init_genrand(C.seed);
+	seed_range = C.unpadded_size;
 	time_elapsed = 0;
 	n_steps = 0, n_infections = 0;
 //	event_queue.reserve(C.size);
 	mean = (1.0 / C.halflife);
 }
 
-void StateAlt::queue_infection(entity_id id) {
+template <typename GraphT>
+void StateAltT<GraphT>::set_graph(GraphT&& g) {
+	graph = std::move(g);
+	// Edge order is arbitrary, sort by descending probability for sample_transmissions:
+	graph.sort_by_prob();
+	entities.resize(graph.size());
+}
+
+template <typename GraphT>
+void StateAltT<GraphT>::queue_infection(entity_id id, entity_id infector) {
 //	PERF_TIMER();
 	EntityAlt& e = get(id);
 	if (e.infected) {
@@ -29,61 +40,74 @@ void StateAlt::queue_infection(entity_id id) {
 	if (e.has_handle) {
 		if (t < (*e.event_handle).time) {
 			(*e.event_handle).time = t;
+			(*e.event_handle).infector = infector;
 			event_queue.decrease(e.event_handle);
 			event_queue.update(e.event_handle);
 		}
 	} else {
 		e.has_handle = true;
-		e.event_handle = event_queue.push({t, id});
+		e.event_handle = event_queue.push({t, id, infector});
 	}
 }
 
-void StateAlt::process_infection(entity_id id, double time) {
+template <typename GraphT>
+void StateAltT<GraphT>::process_infection(entity_id id, entity_id infector, double time) {
 //	PERF_TIMER();
 	EntityAlt& e = get(id);
 	e.infected = true;
 	n_infections++;
-	if (on_infect_func != NULL) {
-		on_infect_func(id);
-	}
-	for (int i = 0; i < e.node.size(); i++) {
-		double p = e.node[i].prob;
-		if (rng.rand_real_not0() < p) {
-			queue_infection(e.node[i].node);
-		}
-	}
+	infections.add(time, infector, id, n_steps);
+	auto node = graph[id];
+	sample_transmissions(node, rng, [&](size_t i) {
+		queue_infection(node[i].node, id);
+	});
 }
 
-void StateAlt::infect_n_random(int n) {
+template <typename GraphT>
+void StateAltT<GraphT>::infect_n_random(int n) {
 	// Uses rejection method implicitly:
 	while (n > 0) {
-		entity_id id = rng.rand_int(size());
-		if (!get(id).infected) {
-			process_infection(id, 0);
+		entity_id id = rng.rand_int(seed_range >= 0 ? seed_range : size());
+		EntityAlt& e = get(id);
+		if (!e.infected) {
+			// Drop any pending event, or the entity would be infected twice
+			if (e.has_handle) {
+				event_queue.erase(e.event_handle);
+				e.has_handle = false;
+			}
+			process_infection(id, -1, 0);
 			n--;
 		}
 	}
 }
 
-void StateAlt::step() {
+template <typename GraphT>
+void StateAltT<GraphT>::step() {
 	PERF_TIMER();
 //	ASSERT(!event_queue.empty(), "Can't step!");
 	InfectionEvent event = event_queue.top();
 //	printf("TEST %.3f\n", event.time);
 //	ASSERT(event.time >= time_elapsed, "Time cannot go backwards!");
 	event_queue.pop();
+	n_steps++;
 	time_elapsed = event.time;
-	process_infection(event.infected, event.time);
+	process_infection(event.infected, event.infector, event.time);
 }
 
-void StateAlt::fast_reset(Config& S) {
+template <typename GraphT>
+void StateAltT<GraphT>::fast_reset(Config& S) {
 	for (auto& entity : entities) {
 		entity.infected = false;
 		entity.has_handle = false;
 		entity.event_handle = EventHandle();
 	}
-	n_infections = 0;
+	n_steps = 0, n_infections = 0;
 	time_elapsed = 0;
 	event_queue.clear();
 //	event_queue.reserve(S.size);
 }
+
+template struct StateAltT<Graph>;
+template struct StateAltT<LatticeGraph>;
+template struct StateAltT<CompressedGraph>;
+template struct StateAltT<GraphView>;
@@ -1,6 +1,7 @@
 #ifndef STATE_ALT_H_
 #define STATE_ALT_H_
 
+#include <algorithm>
 #include <cmath>
 #include <string>
 #include <utility>
@@ -17,6 +18,9 @@
 #include "config.h"
 #include "discrete_fixedtree.h"
 #include "graph.h"
+#include "lattice_graph.h"
+#include "compressed_graph.h"
+#include "observers.h"
 
 /*
  * There are two approaches:
@@ -31,16 +35,23 @@
  *	    - Repeat until set of infections is empty.
  *
  * This is the second approach.
- * Unlike State, StateAlt uses Graph directly.
+ * Unlike State, StateAlt uses the graph directly, taking ownership of it.
+ * GraphT is Graph, LatticeGraph, CompressedGraph or GraphView (see state_alt.cpp for the instantiations).
  */
 
 // A not-yet processed infection event.
 struct InfectionEvent {
 	double time;
 	entity_id infected;
+	// Whose transmission the event is, -1 for none
+	entity_id infector;
 	bool operator<(const InfectionEvent& o) const {
 		return time > o.time;
 	}
+	template <typename Visitor>
+	void visit(Visitor& rw) {
+		rw << time << infected << infector;
+	}
 };
 
 //typedef boost::heap::d_ary_heap<InfectionEvent, boost::heap::mutable_<true>, boost::heap::arity<2>> EventQueue;
@@ -49,36 +60,127 @@ typedef boost::heap::fibonacci_heap<InfectionEvent> EventQueue;
 //typedef boost::heap::skew_heap<InfectionEvent, boost::heap::mutable_<true>> EventQueue;
 typedef EventQueue::handle_type EventHandle;
 
+/*
+ * Samples which out-edges of 'node' transmit, calling f(edge_index) for each.
+ * Requires the edges sorted by descending probability (see StateAlt::set_graph).
+ *
+ * Rather than flipping a coin per edge, edges are split into runs whose probabilities
+ * lie within a factor of 2 of the run's first edge, and we jump between candidate edges
+ * with geometric skips:
+ *  - A run of equal probabilities p costs one draw per transmission (one per
+ *    non-transmission if p > 0.5, where we skip over the failures instead).
+ *  - A mixed run is sampled at its maximum probability, and each candidate is then
+ *    accepted with prob / p_max >= 0.5.
+ * The cost scales with the number of transmissions rather than the degree.
+ */
+template <typename NodeT, typename Func>
+inline void sample_transmissions(const NodeT& node, MTwist& rng, Func f) {
+	size_t i = 0, n = node.size();
+	while (i < n) {
+		double p_max = node[i].prob;
+		if (p_max <= 0) {
+			return; // Sorted, so no remaining edge can transmit
+		}
+		// Binary search for the end of the run, ie the first edge with prob <= p_max / 2:
+		double p_min = (p_max >= 1) ? 1 : p_max / 2;
+		size_t lo = i + 1, hi = n;
+		while (lo < hi) {
+			size_t mid = (lo + hi) / 2;
+			if (p_max >= 1 ? node[mid].prob >= 1 : node[mid].prob > p_min) {
+				lo = mid + 1;
+			} else {
+				hi = mid;
+			}
+		}
+		size_t end = lo;
+		if (p_max >= 1) {
+			// Certain transmissions, no draws needed
+			for (size_t j = i; j < end; j++) {
+				f(j);
+			}
+		} else if (node[end - 1].prob == p_max && p_max > 0.5) {
+			// Equal probabilities, mostly transmitting: skip over the failures.
+			double log_p = log(p_max);
+			size_t j = i;
+			while (j < end) {
+				double n_success = floor(log(rng.rand_real_not0()) / log_p);
+				size_t run_end = (n_success < end - j) ? j + (size_t)n_success : end;
+				for (; j < run_end; j++) {
+					f(j);
+				}
+				j++; // Skip the failed edge
+			}
+		} else {
+			bool uniform = (node[end - 1].prob == p_max);
+			double log_q = log1p(-p_max);
+			size_t j = i;
+			while (true) {
+				double n_skip = floor(log(rng.rand_real_not0()) / log_q);
+				if (n_skip >= end - j) {
+					break;
+				}
+				j += (size_t)n_skip;
+				if (uniform || rng.rand_real_not1() * p_max < node[j].prob) {
+					f(j);
+				}
+				j++;
+			}
+		}
+		i = end;
+	}
+}
+
 struct EntityAlt {
-	Node node;
 	bool infected = false, has_handle = false;
 	EventHandle event_handle;
-	READ_WRITE(rw) {
-		rw << node;
-	}
 };
 
-struct StateAlt {
-	typedef void (*oninfectf)(int infected_Id);
+template <typename GraphT>
+struct StateAltT {
     size_t size() {
     	return entities.size();
     }
 
 	void init(const Config& C);
-	void set_graph(Graph&& g) {
-		entities.resize(g.size());
-		for (int i = 0; i < g.size(); i++) {
-			entities[i].node = std::move(g[i]);
-		}
-	}
+	void set_graph(GraphT&& g);
 
 	READ_WRITE(rw) {
 		rw << mean;
-		rw.visit_objs(entities);
+		graph.visit(rw);
+		entities.resize(graph.size());
+	}
+	// Everything a run changes, for checkpoints: restoring it onto the same network
+	// continues the run exactly. Events are stored in heap order, as pop order only
+	// depends on their times.
+	template <typename Visitor>
+	void visit_progress(Visitor& rw) {
+		rw << mean << time_elapsed << n_steps << n_infections;
+		rng.visit(rw);
+		std::vector<char> infected;
+		std::vector<InfectionEvent> events;
+		if (rw.is_writing()) {
+			for (EntityAlt& e : entities) {
+				infected.push_back(e.infected);
+			}
+			events.assign(event_queue.begin(), event_queue.end());
+		}
+		rw << infected << events;
+		if (rw.is_reading()) {
+			event_queue.clear();
+			entities.assign(infected.size(), EntityAlt());
+			for (size_t i = 0; i < infected.size(); i++) {
+				entities[i].infected = infected[i];
+			}
+			for (const InfectionEvent& event : events) {
+				EntityAlt& e = entities[event.infected];
+				e.has_handle = true;
+				e.event_handle = event_queue.push(event);
+			}
+		}
 	}
     void step();
-    void queue_infection(entity_id id);
-    void process_infection(entity_id id, double time);
+    void queue_infection(entity_id id, entity_id infector);
+    void process_infection(entity_id id, entity_id infector, double time);
     void infect_n_random(int n);
 
     EntityAlt& get(entity_id id) {
@@ -97,11 +199,14 @@ struct StateAlt {
     	return 0;
     }
 public:
-    // Incremental drawing function:
-    oninfectf on_infect_func = NULL;
+    // Every infection, once enabled (see observers.h)
+    InfectionLog infections;
     // The RNG:
     MTwist rng;
-    // The graph:
+    // Seeds are drawn from entities below this, -1 for all (see Config::unpadded_size)
+    int seed_range = -1;
+    // The graph, with edges sorted by descending probability:
+    GraphT graph;
     std::vector<EntityAlt> entities;
     double mean = -1, time_elapsed = 0;
     size_t n_steps = 0, n_infections = 0;
@@ -109,4 +214,10 @@ public:
     EventQueue event_queue;
 };
 
+typedef StateAltT<Graph> StateAlt;
+typedef StateAltT<LatticeGraph> StateAltLattice;
+typedef StateAltT<CompressedGraph> StateAltCompressed;
+// Runs on a mapped snapshot in place
+typedef StateAltT<GraphView> StateAltView;
+
 #endif /* STATE_ALT_H_ */
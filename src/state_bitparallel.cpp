@@ -0,0 +1,160 @@
+#include "libs/perf_timer.h"
+
+#include "state_bitparallel.h"
+
+using namespace std;
+
+// Bits of precision for edge probabilities:
+static const int PROB_BITS = 16;
+
+// SplitMix64 (Steele et al.), used both to derive streams and to step through them.
+static inline uint64_t mix64(uint64_t z) {
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+	return z ^ (z >> 31);
+}
+static inline uint64_t splitmix64(uint64_t& state) {
+	return mix64(state += 0x9E3779B97F4A7C15ULL);
+}
+
+template <int W>
+void StateBitParallel<W>::init(const Config& C) {
+	PERF_TIMER();
+	rng.init_genrand(C.seed);
+	seed = C.seed, pass = 0;
+	seed_range = C.unpadded_size;
+	n_steps = 0, n_infections = 0;
+}
+
+template <int W>
+void StateBitParallel<W>::set_graph(const Graph& g) {
+	PERF_TIMER();
+	graph = &g;
+	size_t n = g.size();
+	infected.assign(n, Mask::zero());
+	fresh.assign(n, Mask::zero());
+	next_fresh.assign(n, Mask::zero());
+}
+
+// Build a mask with each bit set with probability 'prob', for the lanes needed in 'need'.
+// Each lane compares a uniform U, drawn one bit per random word from the most significant
+// end, against the quantized probability q: the first differing bit decides U < q.
+// We stop as soon as every needed lane is decided, which takes about log2(lanes) + 1 words.
+// Lanes decide the same way whichever other lanes are needed, so revisiting is consistent.
+template <int W>
+typename StateBitParallel<W>::Mask StateBitParallel<W>::edge_mask(size_t e, double prob, const Mask& need) const {
+	Mask m = Mask::zero();
+	uint32_t q = (uint32_t)(prob * (1 << PROB_BITS) + 0.5);
+	if (q == 0) {
+		return m;
+	}
+	uint64_t key = mix64(seed ^ mix64(pass + 1));
+	for (int i = 0; i < W; i++) {
+		if (q >= (1u << PROB_BITS)) {
+			m.words[i] = need.words[i];
+			continue;
+		}
+		uint64_t state = key ^ mix64(e * W + i);
+		uint64_t undecided = need.words[i], below = 0;
+		for (int b = PROB_BITS - 1; b >= 0 && undecided != 0; b--) {
+			uint64_t r = splitmix64(state);
+			if ((q >> b) & 1) {
+				below |= undecided & ~r;
+				undecided &= r;
+			} else {
+				undecided &= ~r;
+			}
+		}
+		// Lanes still undecided have U == q in every bit, ie U >= q
+		m.words[i] = below;
+	}
+	return m;
+}
+
+template <int W>
+void StateBitParallel<W>::step() {
+	PERF_TIMER();
+	size_t new_infections = 0;
+	for (entity_id u : frontier) {
+		Mask f = fresh[u];
+		fresh[u] = Mask::zero();
+		Node node = (*graph)[u];
+		for (size_t k = 0; k < node.size(); k++) {
+			entity_id v = node[k].node;
+			// Only trials where 'v' is not yet infected matter; skip the edge mask if there are none
+			Mask candidates = f & ~infected[v];
+			if (!candidates.any()) {
+				continue;
+			}
+			Mask transmitted = candidates & edge_mask(graph->offsets[u] + k, node[k].prob, candidates);
+			if (!transmitted.any()) {
+				continue;
+			}
+			if (!next_fresh[v].any()) {
+				next_frontier.push_back(v);
+			}
+			next_fresh[v] |= transmitted;
+			infected[v] |= transmitted;
+			new_infections += transmitted.count();
+		}
+	}
+	frontier.swap(next_frontier);
+	next_frontier.clear();
+	fresh.swap(next_fresh);
+	if (new_infections > 0) {
+		generation_sizes.push_back(new_infections);
+	}
+	n_infections += new_infections;
+	n_steps++;
+}
+
+template <int W>
+void StateBitParallel<W>::infect_n_random(int n) {
+	size_t seeded = 0;
+	for (int trial = 0; trial < TRIALS; trial++) {
+		// Uses rejection method implicitly:
+		for (int left = n; left > 0;) {
+			entity_id id = rng.rand_int(seed_range >= 0 ? seed_range : size());
+			if (!infected[id].get(trial)) {
+				if (!fresh[id].any()) {
+					frontier.push_back(id);
+				}
+				infected[id].set(trial);
+				fresh[id].set(trial);
+				seeded++, left--;
+			}
+		}
+	}
+	if (generation_sizes.empty()) {
+		generation_sizes.push_back(0);
+	}
+	generation_sizes[0] += seeded;
+	n_infections += seeded;
+}
+
+template <int W>
+vector<size_t> StateBitParallel<W>::trial_sizes() const {
+	vector<size_t> sizes(TRIALS, 0);
+	for (const Mask& m : infected) {
+		for (int i = 0; i < W; i++) {
+			for (uint64_t bits = m.words[i]; bits != 0; bits &= bits - 1) {
+				sizes[i * 64 + __builtin_ctzll(bits)]++;
+			}
+		}
+	}
+	return sizes;
+}
+
+template <int W>
+void StateBitParallel<W>::fast_reset(Config& C) {
+	infected.assign(size(), Mask::zero());
+	fresh.assign(size(), Mask::zero());
+	frontier.clear();
+	generation_sizes.clear();
+	n_steps = 0, n_infections = 0;
+	pass++;
+}
+
+template struct StateBitParallel<1>;
+template struct StateBitParallel<4>;
+template struct StateBitParallel<8>;
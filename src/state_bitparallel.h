@@ -0,0 +1,117 @@
+#ifndef STATE_BITPARALLEL_H_
+#define STATE_BITPARALLEL_H_
+
+#include <vector>
+
+#include "libs/int_types.h"
+#include "libs/mtwist.h"
+
+#include "config.h"
+#include "graph.h"
+
+/*
+ * A set of 64 * W independent trials, one bit per trial.
+ * The operations are plain loops over the words, which the compiler turns into
+ * SSE/AVX2/AVX-512 instructions for W = 2, 4, 8 when the target supports them.
+ */
+template <int W>
+struct TrialMask {
+	uint64_t words[W];
+
+	static TrialMask zero() {
+		TrialMask m;
+		for (int i = 0; i < W; i++) m.words[i] = 0;
+		return m;
+	}
+	bool any() const {
+		uint64_t acc = 0;
+		for (int i = 0; i < W; i++) acc |= words[i];
+		return acc != 0;
+	}
+	int count() const {
+		int n = 0;
+		for (int i = 0; i < W; i++) n += __builtin_popcountll(words[i]);
+		return n;
+	}
+	void set(int trial) {
+		words[trial / 64] |= (uint64_t)1 << (trial % 64);
+	}
+	bool get(int trial) const {
+		return (words[trial / 64] >> (trial % 64)) & 1;
+	}
+	TrialMask operator&(const TrialMask& o) const {
+		TrialMask m;
+		for (int i = 0; i < W; i++) m.words[i] = words[i] & o.words[i];
+		return m;
+	}
+	TrialMask operator|(const TrialMask& o) const {
+		TrialMask m;
+		for (int i = 0; i < W; i++) m.words[i] = words[i] | o.words[i];
+		return m;
+	}
+	TrialMask operator~() const {
+		TrialMask m;
+		for (int i = 0; i < W; i++) m.words[i] = ~words[i];
+		return m;
+	}
+	TrialMask& operator|=(const TrialMask& o) {
+		for (int i = 0; i < W; i++) words[i] |= o.words[i];
+		return *this;
+	}
+};
+
+/*
+ * Runs 64 * W trials of the StateAlt dynamics at once, bit-sliced.
+ * Every entity holds a mask of 'infected in trial k', and the outbreak spreads as a
+ * frontier-based BFS over masks: an entity's new bits are ANDed with a per-edge
+ * Bernoulli(p) mask (bit k set with probability p, independently per trial) and
+ * handed to the neighbour. One pass yields 64 * W final sizes, and each BFS round is one
+ * generation, so only final-size and generation-based statistics are available.
+ *
+ * Edge masks are derived from a counter-based stream keyed by (seed, pass, edge), so an
+ * edge transmits the same way in a given trial however often it is revisited.
+ * Probabilities are quantized to 1/65536.
+ */
+template <int W>
+struct StateBitParallel {
+	typedef TrialMask<W> Mask;
+	static const int TRIALS = 64 * W;
+
+	size_t size() {
+		return infected.size();
+	}
+	void init(const Config& C);
+	// Note: The graph must outlive the state.
+	void set_graph(const Graph& graph);
+
+	// One generation, in every trial
+	void step();
+	// Infect 'n' random entities in every trial
+	void infect_n_random(int n);
+	// Start the next pass of TRIALS trials
+	void fast_reset(Config& C);
+
+	bool finished(Config& C) const {
+		return frontier.empty();
+	}
+	// Final size of every trial of this pass
+	std::vector<size_t> trial_sizes() const;
+
+public:
+	MTwist rng;
+	// Seeds are drawn from entities below this, -1 for all (see Config::unpadded_size)
+	int seed_range = -1;
+	// Summed over all trials:
+	size_t n_steps = 0, n_infections = 0;
+	// Newly infected entities in each generation, summed over all trials:
+	std::vector<size_t> generation_sizes;
+private:
+	Mask edge_mask(size_t e, double prob, const Mask& need) const;
+
+	const Graph* graph = NULL;
+	uint64_t seed = 0, pass = 0;
+	std::vector<Mask> infected, fresh, next_fresh;
+	std::vector<entity_id> frontier, next_frontier;
+};
+
+#endif /* STATE_BITPARALLEL_H_ */
@@ -0,0 +1,99 @@
+#include "libs/perf_timer.h"
+
+#include "state_percolation.h"
+
+using namespace std;
+
+// Entities per parallel work chunk:
+static const size_t GRAIN = 512;
+
+void StatePercolation::init(const Config& C) {
+	PERF_TIMER();
+	rng.init_genrand(C.seed);
+	edge_rng.set_seed(C.seed);
+	seed_range = C.unpadded_size;
+	trial = 0;
+	time_elapsed = 0;
+	n_steps = 0, n_infections = 0;
+	pool.reset(new ThreadPool(C.n_threads));
+	next.resize(pool->size());
+}
+
+// Note: The graph must outlive the state.
+void StatePercolation::set_graph(const Graph& g) {
+	PERF_TIMER();
+	graph = &g;
+	size_t n = g.size();
+	visited.reset(new atomic<bool>[n]);
+	for (size_t i = 0; i < n; i++) {
+		visited[i].store(false, memory_order_relaxed);
+	}
+}
+
+void StatePercolation::infect(entity_id id) {
+	n_infections++;
+	// Generations so far, ie the one being infected:
+	infections.add(generation_sizes.size(), -1, id, n_steps);
+}
+
+void StatePercolation::step() {
+	PERF_TIMER();
+	pool->parallel_for(frontier.size(), GRAIN, [&](int thread, size_t begin, size_t end) {
+		vector<entity_id>& out = next[thread];
+		uint32_t r[4];
+		for (size_t i = begin; i < end; i++) {
+			entity_id u = frontier[i];
+			Node node = (*graph)[u];
+			for (size_t k = 0; k < node.size(); k++) {
+				entity_id v = node[k].node;
+				// Cheap check first; an edge's coin is fixed per trial, so skipping it changes nothing
+				if (visited[v].load(memory_order_relaxed)
+						|| !edge_transmits(edge_rng, graph->offsets[u] + k, trial, node[k].prob, r)) {
+					continue;
+				}
+				if (!visited[v].exchange(true, memory_order_relaxed)) {
+					out.push_back(v);
+				}
+			}
+		}
+	});
+	frontier.clear();
+	for (vector<entity_id>& list : next) {
+		for (entity_id v : list) {
+			infect(v);
+			frontier.push_back(v);
+		}
+		list.clear();
+	}
+	if (!frontier.empty()) {
+		generation_sizes.push_back(frontier.size());
+	}
+	n_steps++;
+}
+
+void StatePercolation::infect_n_random(int n) {
+	// Uses rejection method implicitly:
+	while (n > 0) {
+		entity_id id = rng.rand_int(seed_range >= 0 ? seed_range : size());
+		if (!visited[id].exchange(true, memory_order_relaxed)) {
+			infect(id);
+			frontier.push_back(id);
+			n--;
+		}
+	}
+	if (generation_sizes.empty()) {
+		generation_sizes.push_back(0);
+	}
+	generation_sizes[0] = frontier.size();
+}
+
+void StatePercolation::fast_reset(Config& C) {
+	for (size_t i = 0; i < size(); i++) {
+		visited[i].store(false, memory_order_relaxed);
+	}
+	frontier.clear();
+	generation_sizes.clear();
+	time_elapsed = 0;
+	n_steps = 0, n_infections = 0;
+	trial++;
+}
@@ -0,0 +1,79 @@
+#ifndef STATE_PERCOLATION_H_
+#define STATE_PERCOLATION_H_
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+#include "libs/mtwist.h"
+#include "libs/philox.h"
+#include "libs/ThreadPool.h"
+
+#include "config.h"
+#include "edge_sampling.h"
+#include "graph.h"
+#include "observers.h"
+
+/*
+ * Final-size only variant of StateAlt/StateSSSP.
+ * Which entities end up infected does not depend on the delays at all: it is the set
+ * reachable from the initial infections over the transmitting edges (bond percolation).
+ * StatePercolation skips event timing entirely and finds that set with a parallel,
+ * level-synchronous BFS, flipping each edge's coin only when its target is still uninfected.
+ *
+ * Edges are directed with independent coins, so reachability is not symmetric and
+ * union-find (which would merge both directions) cannot be used.
+ *
+ * Edge coins are shared with StateSSSP (see edge_sampling.h): for the same seed and trial
+ * both engines infect exactly the same entities.
+ * Each step() processes one generation of the BFS; time_elapsed is not meaningful.
+ */
+struct StatePercolation {
+	size_t size() {
+		return graph == NULL ? 0 : graph->size();
+	}
+
+	void init(const Config& C);
+	void set_graph(const Graph& graph);
+
+	void step();
+	void infect_n_random(int n);
+	void fast_reset(Config& C);
+
+	bool infected(entity_id id) const {
+		return visited[id].load(std::memory_order_relaxed);
+	}
+	double current_timestep() {
+		return time_elapsed;
+	}
+	bool finished(Config& C) const {
+		return frontier.empty();
+	}
+	double total_weight() {
+		return 0;
+	}
+public:
+	// Every infection, once enabled (see observers.h). Infectors are not tracked,
+	// and the time is the generation.
+	InfectionLog infections;
+	// Picks the initial infections:
+	MTwist rng;
+	// Seeds are drawn from entities below this, -1 for all (see Config::unpadded_size)
+	int seed_range = -1;
+	double time_elapsed = 0;
+	size_t n_steps = 0, n_infections = 0;
+	// Entities newly infected in each generation, generation 0 being the initial infections:
+	std::vector<size_t> generation_sizes;
+private:
+	void infect(entity_id id);
+
+	std::unique_ptr<ThreadPool> pool;
+	Philox edge_rng;
+	uint64_t trial = 0;
+	const Graph* graph = NULL;
+	std::unique_ptr<std::atomic<bool>[]> visited;
+	std::vector<entity_id> frontier;
+	std::vector<std::vector<entity_id>> next;
+};
+
+#endif /* STATE_PERCOLATION_H_ */
@@ -0,0 +1,203 @@
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include "libs/perf_timer.h"
+
+#include "state_sssp.h"
+
+using namespace std;
+
+static const double INF = numeric_limits<double>::infinity();
+// Entities per parallel work chunk:
+static const size_t GRAIN = 512;
+
+// Lowers 'a' to 'v', returns true if 'v' was an improvement.
+static bool atomic_min(atomic<double>& a, double v) {
+	double cur = a.load(memory_order_relaxed);
+	while (v < cur) {
+		if (a.compare_exchange_weak(cur, v, memory_order_relaxed)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+void StateSSSP::init(const Config& C) {
+	PERF_TIMER();
+	rng.init_genrand(C.seed);
+	seed = C.seed, trial = 0;
+	seed_range = C.unpadded_size;
+	edge_rng.set_seed(seed);
+	time_elapsed = 0;
+	n_steps = 0, n_infections = 0;
+	delta = C.sssp_delta;
+	pool.reset(new ThreadPool(C.n_threads));
+	improved.resize(pool->size());
+}
+
+void StateSSSP::set_graph(const Graph& g) {
+	PERF_TIMER();
+	graph = &g;
+	size_t n = g.size();
+	if (delta <= 0) {
+		// Meyer & Sanders suggest delta = Theta(1 / max degree) for random edge weights.
+		// The average is the better fit for our (mostly uniform degree) graphs.
+		delta = n > 0 ? std::max(1.0, g.n_edges() / double(n)) : 1.0;
+		delta = 1.0 / delta;
+	}
+	dist.reset(new atomic<double>[n]);
+	settled.assign(n, false);
+	queued_bucket.assign(n, (size_t)-1);
+	member_of.assign(n, (size_t)-1);
+	frontier_round.assign(n, (size_t)-1);
+	for (size_t i = 0; i < n; i++) {
+		dist[i].store(INF, memory_order_relaxed);
+	}
+	sample_edges();
+}
+
+// Decide the fate of every edge for the current trial.
+// Equivalent to StateAlt: a coin flip on the edge's probability, then an exponential delay.
+void StateSSSP::sample_edges() {
+	PERF_TIMER();
+	const vector<float>& probs = graph->probs;
+	delays.resize(probs.size());
+	pool->parallel_for(probs.size(), GRAIN * 16, [&](int, size_t begin, size_t end) {
+		uint32_t r[4];
+		for (size_t e = begin; e < end; e++) {
+			if (edge_transmits(edge_rng, e, trial, probs[e], r)) {
+				delays[e] = edge_delay(r);
+			} else {
+				delays[e] = numeric_limits<float>::infinity();
+			}
+		}
+	});
+}
+
+void StateSSSP::settle(entity_id id) {
+	settled[id] = true;
+	n_infections++;
+	infections.add(infection_time(id), -1, id, n_steps);
+}
+
+void StateSSSP::relax_all(const vector<entity_id>& ids, bool light) {
+	const vector<size_t>& offsets = graph->offsets;
+	const vector<entity_id>& targets = graph->targets;
+	pool->parallel_for(ids.size(), GRAIN, [&](int thread, size_t begin, size_t end) {
+		vector<entity_id>& out = improved[thread];
+		for (size_t i = begin; i < end; i++) {
+			entity_id u = ids[i];
+			double du = dist[u].load(memory_order_relaxed);
+			for (size_t e = offsets[u]; e < offsets[u + 1]; e++) {
+				double w = delays[e];
+				if ((w < delta) != light || w == INF) {
+					continue;
+				}
+				entity_id v = targets[e];
+				if (!settled[v] && atomic_min(dist[v], du + w)) {
+					out.push_back(v);
+				}
+			}
+		}
+	});
+}
+
+// Move the entities improved by relax_all into their buckets, never earlier than 'first_open_bucket'.
+// If given, entities landing in 'first_open_bucket' itself instead form the next frontier.
+void StateSSSP::distribute_improved(size_t first_open_bucket, vector<entity_id>* frontier) {
+	if (frontier) {
+		frontier->clear();
+	}
+	round++;
+	for (vector<entity_id>& list : improved) {
+		for (entity_id v : list) {
+			size_t b = std::max(first_open_bucket, bucket_of(dist[v].load(memory_order_relaxed)));
+			if (frontier && b == first_open_bucket) {
+				if (frontier_round[v] != round) {
+					frontier_round[v] = round;
+					frontier->push_back(v);
+				}
+			} else if (queued_bucket[v] != b) {
+				queued_bucket[v] = b;
+				if (b >= buckets.size()) {
+					buckets.resize(b + 1);
+				}
+				buckets[b].push_back(v);
+			}
+		}
+		list.clear();
+	}
+}
+
+void StateSSSP::step() {
+	PERF_TIMER();
+	vector<entity_id> frontier, bucket_members;
+	while (bucket_members.empty() && current_bucket < buckets.size()) {
+		size_t b = current_bucket++;
+		// Filter out stale entries, ie entities since settled or moved to an earlier bucket:
+		round++;
+		for (entity_id v : buckets[b]) {
+			if (!settled[v] && queued_bucket[v] == b && frontier_round[v] != round) {
+				frontier_round[v] = round;
+				frontier.push_back(v);
+			}
+		}
+		vector<entity_id>().swap(buckets[b]);
+		// Relax light edges until no entity in this bucket improves:
+		while (!frontier.empty()) {
+			for (entity_id v : frontier) {
+				if (member_of[v] != b) {
+					member_of[v] = b;
+					bucket_members.push_back(v);
+				}
+			}
+			relax_all(frontier, true);
+			distribute_improved(b, &frontier);
+		}
+		// Everything in the bucket is now final:
+		sort(bucket_members.begin(), bucket_members.end(), [&](entity_id x, entity_id y) {
+			return infection_time(x) < infection_time(y);
+		});
+		for (entity_id v : bucket_members) {
+			settle(v);
+			n_steps++;
+			time_elapsed = std::max(time_elapsed, infection_time(v));
+		}
+		// Heavy edges can only reach later buckets:
+		relax_all(bucket_members, false);
+		distribute_improved(current_bucket, NULL);
+	}
+}
+
+void StateSSSP::infect_n_random(int n) {
+	// Uses rejection method implicitly:
+	vector<entity_id> ids;
+	while (n > 0) {
+		entity_id id = rng.rand_int(seed_range >= 0 ? seed_range : size());
+		if (!settled[id]) {
+			dist[id].store(0, memory_order_relaxed);
+			settle(id);
+			ids.push_back(id);
+			n--;
+		}
+	}
+	relax_all(ids, true);
+	relax_all(ids, false);
+	distribute_improved(current_bucket, NULL);
+}
+
+void StateSSSP::fast_reset(Config& C) {
+	for (size_t i = 0; i < size(); i++) {
+		dist[i].store(INF, memory_order_relaxed);
+	}
+	settled.assign(size(), false);
+	queued_bucket.assign(size(), (size_t)-1);
+	member_of.assign(size(), (size_t)-1);
+	buckets.clear();
+	current_bucket = 0;
+	time_elapsed = 0;
+	n_steps = 0, n_infections = 0;
+	trial++;
+	sample_edges();
+}
@@ -0,0 +1,103 @@
+#ifndef STATE_SSSP_H_
+#define STATE_SSSP_H_
+
+#include <atomic>
+#include <cmath>
+#include <memory>
+#include <vector>
+
+#include "libs/mtwist.h"
+#include "libs/philox.h"
+#include "libs/ThreadPool.h"
+
+#include "config.h"
+#include "edge_sampling.h"
+#include "graph.h"
+#include "observers.h"
+
+/*
+ * A third approach, equivalent in distribution to StateAlt (approach 2):
+ * In StateAlt, each infected entity flips a coin per out-edge and infects the
+ * neighbour after an exponential delay. Each edge is only ever considered once per trial,
+ * so this is first-passage percolation: the infection time of an entity is its shortest
+ * path distance from the initial infections, where blocked edges have infinite length.
+ *
+ * StateSSSP therefore pre-samples every edge's outcome from a counter-based RNG (so it
+ * can be done in parallel, and is reproducible for a given seed and trial), and then
+ * computes infection times with parallel delta-stepping (Meyer & Sanders).
+ * Each step() settles one bucket of width 'delta' of infection times.
+ */
+struct StateSSSP {
+	size_t size() {
+		return settled.size();
+	}
+
+	void init(const Config& C);
+	// Note: The graph must outlive the state.
+	void set_graph(const Graph& graph);
+
+	void step();
+	void infect_n_random(int n);
+	void fast_reset(Config& C);
+
+	// Infection time of 'id', infinity if it is never infected
+	double infection_time(entity_id id) const {
+		return dist[id].load(std::memory_order_relaxed);
+	}
+	bool infected(entity_id id) const {
+		return settled[id];
+	}
+	double current_timestep() {
+		return time_elapsed;
+	}
+	bool finished(Config& C) const {
+		for (size_t b = current_bucket; b < buckets.size(); b++) {
+			if (!buckets[b].empty()) {
+				return false;
+			}
+		}
+		return true;
+	}
+	double total_weight() {
+		return 0;
+	}
+public:
+	// Every infection, once enabled (see observers.h). Infectors are not tracked.
+	InfectionLog infections;
+	// Picks the initial infections:
+	MTwist rng;
+	// Seeds are drawn from entities below this, -1 for all (see Config::unpadded_size)
+	int seed_range = -1;
+	double time_elapsed = 0;
+	size_t n_steps = 0, n_infections = 0;
+	// Bucket width, and the delay below which an edge is 'light'
+	double delta = -1;
+private:
+	void sample_edges();
+	void settle(entity_id id);
+	// Relaxes the light (delay < delta) or heavy out-edges of every entity in 'ids', in parallel.
+	// Improved entities are collected in 'improved' per thread.
+	void relax_all(const std::vector<entity_id>& ids, bool light);
+	void distribute_improved(size_t first_open_bucket, std::vector<entity_id>* frontier);
+	size_t bucket_of(double d) const {
+		return (size_t)(d / delta);
+	}
+
+	std::unique_ptr<ThreadPool> pool;
+	Philox edge_rng;
+	uint64_t seed = 0, trial = 0;
+	const Graph* graph = NULL;
+	// Per-trial edge delays, infinity for edges that do not transmit
+	std::vector<float> delays;
+	// Per-entity:
+	std::unique_ptr<std::atomic<double>[]> dist;
+	std::vector<char> settled;
+	std::vector<size_t> queued_bucket, member_of;
+	std::vector<size_t> frontier_round;
+	// Pending entities per bucket, possibly stale:
+	std::vector<std::vector<entity_id>> buckets;
+	std::vector<std::vector<entity_id>> improved;
+	size_t current_bucket = 0, round = 0;
+};
+
+#endif /* STATE_SSSP_H_ */
@@ -1,6 +1,7 @@
 #include <cstdio>
 #include <vector>
 #include <initializer_list>
+#include <thread>
 
 #include <UnitTest++.h>
 
@@ -9,7 +10,16 @@
 #include "discrete_searchtree.h"
 #include "discrete_buckettree.h"
 
+#include "checkpoint.h"
+#include "edge_list.h"
+#include "reorder.h"
+#include "snapshot.h"
 #include "state.h"
+#include "state_alt.h"
+#include "state_bitparallel.h"
+#include "state_percolation.h"
+#include "state_sssp.h"
+#include "trace.h"
 
 #include "boost/heap/binomial_heap.hpp"
 #include "boost/heap/fibonacci_heap.hpp"
@@ -17,7 +27,12 @@
 #include "boost/heap/skew_heap.hpp"
 #include "boost/heap/pairing_heap.hpp"
 
+#include "libs/AsyncFileIO.h"
+#include "libs/BlockCompress.h"
+#include "libs/PerfTimer.h"
+#include "libs/SpscRing.h"
 #include "libs/StatCalc.h"
+#include "libs/Timer.h"
 
 const int TEST_SIZE = 256;
 const int TEST_SAMPLES = 1000;
@@ -43,7 +58,7 @@ TEST(walker_method_empirical) {
 	// Test the average results of applying our distribution algorithm for entity connection relationships.
 	Entity e;
 	{ PERF_TIMER2("walker_method_preprocess");
-	Node n;
+	EdgeList n;
 	int j = N/2;
 	for (int i = 0; i < N; i++) {
 		n.push_back({(double)j, j});
@@ -77,6 +92,1188 @@ TEST(walker_method_empirical) {
 	stats.print_summary();
 }
 
+// Every edge must transmit with its own probability, however sample_transmissions groups it.
+TEST(geometric_skip_transmission_rates) {
+	PERF_UNIT("geometric skip");
+	MTwist rng(1);
+	const int M = TEST_SAMPLES * 20;
+	EdgeList node;
+	for (int i = 0; i < 3; i++) node.push_back({1.0, i});
+	for (int i = 0; i < 50; i++) node.push_back({0.9, i});
+	for (int i = 0; i < 100; i++) node.push_back({0.3, i});
+	for (int i = 0; i < 200; i++) node.push_back({0.01 + 0.19 * (permutei(i, 200) / 200.0), i});
+	for (int i = 0; i < 20; i++) node.push_back({0.0, i});
+	std::sort(node.begin(), node.end(), [](const Edge& a, const Edge& b) {
+		return a.prob > b.prob;
+	});
+
+	std::vector<int> counts(node.size(), 0);
+	for (int i = 0; i < M; i++) {
+		PERF_TIMER2("sample_transmissions");
+		sample_transmissions(node, rng, [&](size_t j) {
+			counts[j]++;
+		});
+	}
+	for (size_t i = 0; i < node.size(); i++) {
+		CHECK_CLOSE(node[i].prob, counts[i] / double(M), 0.02);
+	}
+}
+
+// A sparse random graph, with the final size sensitive to the edge probabilities:
+static Graph random_test_graph(int n, int degree, MTwist& rng) {
+	std::vector<EdgeList> lists(n);
+	for (int i = 0; i < n; i++) {
+		for (int j = 0; j < degree; j++) {
+			lists[i].push_back({0.2 + 0.3 * rng.rand_real_not1(), rng.rand_int(n)});
+		}
+	}
+	return Graph::from_lists(lists);
+}
+
+template <typename T>
+static void run_trials(T& state, Config& C, int trials, StatCalc& sizes, StatCalc& times) {
+	for (int i = 0; i < trials; i++) {
+		state.infect_n_random(5);
+		while (!state.finished(C)) {
+			state.step();
+		}
+		sizes.add_element(state.n_infections);
+		times.add_element(state.time_elapsed);
+		state.fast_reset(C);
+	}
+}
+
+// Delta-stepping over pre-sampled edges must reproduce StateAlt's distribution of
+// final sizes and durations.
+TEST(sssp_matches_event_queue) {
+	PERF_UNIT("sssp vs event queue");
+	const int N = 20000, TRIALS = 60;
+	Config C(1, 1);
+	C.size = N, C.n_threads = 4;
+	MTwist rng(1);
+	Graph g = random_test_graph(N, 4, rng);
+
+	StatCalc alt_sizes, alt_times, sssp_sizes, sssp_times;
+	{ PERF_TIMER2("StateAlt trials");
+	StateAlt alt;
+	alt.init(C);
+	alt.set_graph(Graph(g));
+	run_trials(alt, C, TRIALS, alt_sizes, alt_times); }
+	{ PERF_TIMER2("StateSSSP trials");
+	StateSSSP sssp;
+	sssp.init(C);
+	sssp.set_graph(g);
+	run_trials(sssp, C, TRIALS, sssp_sizes, sssp_times); }
+
+	alt_sizes.print_summary(), sssp_sizes.print_summary();
+	alt_times.print_summary(), sssp_times.print_summary();
+	CHECK_CLOSE(alt_sizes.average, sssp_sizes.average, alt_sizes.average * 0.05);
+	CHECK_CLOSE(alt_times.average, sssp_times.average, alt_times.average * 0.1);
+}
+
+// Both engines sample edges with the same counter-based coins, so they must agree exactly.
+TEST(percolation_matches_sssp) {
+	PERF_UNIT("percolation vs sssp");
+	const int N = 20000, TRIALS = 20;
+	Config C(2, 1);
+	C.size = N, C.n_threads = 4;
+	MTwist rng(2);
+	Graph g = random_test_graph(N, 4, rng);
+
+	StateSSSP sssp;
+	sssp.init(C);
+	sssp.set_graph(g);
+	StatePercolation perc;
+	perc.init(C);
+	perc.set_graph(g);
+	for (int i = 0; i < TRIALS; i++) {
+		sssp.infect_n_random(5);
+		perc.infect_n_random(5);
+		{ PERF_TIMER2("StateSSSP trial"); while (!sssp.finished(C)) sssp.step(); }
+		{ PERF_TIMER2("StatePercolation trial"); while (!perc.finished(C)) perc.step(); }
+		CHECK_EQUAL(sssp.n_infections, perc.n_infections);
+		size_t generations_total = 0;
+		for (size_t n : perc.generation_sizes) {
+			generations_total += n;
+		}
+		CHECK_EQUAL(perc.n_infections, generations_total);
+		sssp.fast_reset(C);
+		perc.fast_reset(C);
+	}
+}
+
+template <int W>
+static void bitparallel_sizes(Config& C, const Graph& g, StatCalc& sizes) {
+	StateBitParallel<W> state;
+	state.init(C);
+	state.set_graph(g);
+	state.infect_n_random(5);
+	while (!state.finished(C)) {
+		state.step();
+	}
+	for (size_t n : state.trial_sizes()) {
+		sizes.add_element(n);
+	}
+	CHECK_EQUAL(state.n_infections, (size_t)sizes.sum);
+}
+
+// 64 (or 256) trials per pass must give the same final size distribution as one at a time.
+TEST(bitparallel_matches_percolation) {
+	PERF_UNIT("bit-parallel vs percolation");
+	const int N = 20000, TRIALS = 64;
+	Config C(3, 1);
+	C.size = N, C.n_threads = 1;
+	MTwist rng(3);
+	Graph g = random_test_graph(N, 4, rng);
+
+	StatCalc perc_sizes, bit_sizes, bit4_sizes;
+	{ PERF_TIMER2("StatePercolation 64 trials");
+	StatePercolation perc;
+	perc.init(C);
+	perc.set_graph(g);
+	StatCalc unused;
+	run_trials(perc, C, TRIALS, perc_sizes, unused); }
+	{ PERF_TIMER2("StateBitParallel<1> 64 trials"); bitparallel_sizes<1>(C, g, bit_sizes); }
+	{ PERF_TIMER2("StateBitParallel<4> 256 trials"); bitparallel_sizes<4>(C, g, bit4_sizes); }
+
+	perc_sizes.print_summary(), bit_sizes.print_summary(), bit4_sizes.print_summary();
+	CHECK_CLOSE(perc_sizes.average, bit_sizes.average, perc_sizes.average * 0.05);
+	CHECK_CLOSE(perc_sizes.average, bit4_sizes.average, perc_sizes.average * 0.05);
+}
+
+// Generation streams are derived per row, so the graph must not depend on the thread count.
+TEST(generate_graph_thread_independent) {
+	PERF_UNIT("parallel generation");
+	Config C(5, 200);
+	C.n_threads = 1;
+	Graph serial = generate_graph(C);
+	C.n_threads = 4;
+	Graph parallel = generate_graph(C);
+	CHECK(serial.offsets == parallel.offsets);
+	CHECK(serial.targets == parallel.targets);
+	CHECK(serial.probs == parallel.probs);
+}
+
+// Degree statistics of the random network generators, and independence from the thread count.
+TEST(random_network_generators) {
+	PERF_UNIT("random networks");
+	Config C(6, 100);
+	C.mean_degree = 6;
+	C.n_threads = 1;
+	Graph er = generate_erdos_renyi(C);
+	CHECK_CLOSE(6.0, er.n_edges() / double(er.size()), 0.2);
+	C.n_threads = 4;
+	CHECK(generate_erdos_renyi(C).targets == er.targets);
+
+	Graph ws = generate_watts_strogatz(C);
+	CHECK_EQUAL(ws.size() * 6, ws.n_edges());
+	// Edges not rewired still go to ring neighbours:
+	size_t local = 0;
+	for (size_t i = 0; i < ws.size(); i++) {
+		Node node = ws[i];
+		for (size_t j = 0; j < node.size(); j++) {
+			CHECK(node[j].node != (int)i);
+			int d = abs(node[j].node - (int)i);
+			local += (std::min(d, C.size - d) <= 3);
+		}
+	}
+	CHECK_CLOSE(0.9, local / double(ws.n_edges()), 0.02);
+
+	Graph ba = generate_barabasi_albert(C);
+	// 3 links per entity, each stored both ways:
+	CHECK_CLOSE(6.0, ba.n_edges() / double(ba.size()), 0.1);
+	size_t max_degree = 0;
+	for (size_t i = 0; i < ba.size(); i++) {
+		max_degree = std::max(max_degree, ba.degree(i));
+	}
+	// Heavy tail: far above anything a random graph of this density produces
+	CHECK(max_degree > 100);
+
+	Graph cm = generate_configuration_model(C);
+	std::vector<size_t> in_degree(cm.size(), 0);
+	for (entity_id target : cm.targets) {
+		in_degree[target]++;
+	}
+	for (size_t i = 0; i < cm.size(); i++) {
+		CHECK_EQUAL(cm.degree(i), in_degree[i]);
+	}
+	CHECK_CLOSE(6.0, cm.n_edges() / double(cm.size()), 1.5);
+
+	// A degree sequence sets the size, padded with degree-0 entities
+	const char* filename = "/tmp/infectsim_test_degrees.txt";
+	FILE* file = fopen(filename, "w");
+	for (int i = 0; i < 10; i++) {
+		fprintf(file, "%d\n", i % 4);
+	}
+	fclose(file);
+	Config D(5, 300);
+	D.degree_file = filename;
+	Graph seq = generate_configuration_model(D);
+	CHECK_EQUAL(4, D.sqrt_size);
+	CHECK_EQUAL(16u, seq.size());
+	for (size_t i = 0; i < seq.size(); i++) {
+		CHECK_EQUAL(i < 10 ? i % 4 : 0, seq.degree(i));
+	}
+	remove(filename);
+}
+
+// Sparse ids are remapped in order, comments and malformed lines skipped, and the graph padded.
+TEST(edge_list_import) {
+	PERF_UNIT("edge list import");
+	const char* filename = "/tmp/infectsim_test_edges.txt";
+	FILE* file = fopen(filename, "w");
+	fprintf(file, "# SNAP-style comment\n%% another\n");
+	fprintf(file, "1000000 7 0.25\n7\t1000000\n\n42 7 2.5e-1\r\nbad line\n7 42 0.5\n7 5");
+	fclose(file);
+
+	Config C(7, 1);
+	C.edge_prob = 0.9;
+	C.n_threads = 4;
+	Graph g = import_edge_list(filename, C);
+	// Ids 5, 7, 42, 1000000 become 0, 1, 2, 3:
+	CHECK_EQUAL(2, C.sqrt_size);
+	CHECK_EQUAL(4, (int)g.size());
+	CHECK_EQUAL(5, (int)g.n_edges());
+	CHECK_EQUAL(1000000, g.original_ids[3]);
+	CHECK_EQUAL(0, (int)g.degree(0));
+	// Sorted by target:
+	CHECK_EQUAL(3, (int)g.degree(1));
+	CHECK_EQUAL(0, g[1][0].node);
+	CHECK_CLOSE(0.9, g[1][0].prob, 1e-6);
+	CHECK_EQUAL(2, g[1][1].node);
+	CHECK_CLOSE(0.5, g[1][1].prob, 1e-6);
+	CHECK_EQUAL(3, g[1][2].node);
+	CHECK_CLOSE(0.9, g[1][2].prob, 1e-6);
+	CHECK_CLOSE(0.25, g[2][0].prob, 1e-6);
+	CHECK_CLOSE(0.25, g[3][0].prob, 1e-6);
+
+	// A larger list must import identically with any thread count:
+	file = fopen(filename, "w");
+	MTwist rng(7);
+	for (int i = 0; i < 200000; i++) {
+		fprintf(file, "%d %d %.3f\n", rng.rand_int(50000) * 3, rng.rand_int(50000) * 3, rng.rand_real_not1());
+	}
+	fclose(file);
+	C.n_threads = 1;
+	Graph serial = import_edge_list(filename, C);
+	C.n_threads = 4;
+	Graph parallel = import_edge_list(filename, C);
+	CHECK_EQUAL(200000, (int)serial.n_edges());
+	CHECK(serial.targets == parallel.targets);
+	CHECK(serial.probs == parallel.probs);
+	CHECK(serial.original_ids == parallel.original_ids);
+
+	// The padding is never seeded, and stays at the end when reordered
+	int n = C.unpadded_size;
+	CHECK(n > 0 && n < C.size);
+	CHECK_EQUAL(-1, serial.original_ids[n]);
+	CHECK(serial.original_ids[n - 1] >= 0);
+	StatePercolation perc;
+	perc.init(C);
+	perc.set_graph(serial);
+	perc.infect_n_random(n);
+	for (int i = 0; i < C.size; i++) {
+		CHECK_EQUAL(i < n, perc.infected(i));
+	}
+	CHECK(reorder_graph(parallel, "hilbert", C.sqrt_size, n));
+	for (int i = 0; i < C.size; i++) {
+		CHECK_EQUAL(i >= n, parallel.original_ids[i] == -1);
+	}
+	remove(filename);
+}
+
+// Mean |source - target| over the edges, a proxy for cache misses
+static double mean_edge_span(const Graph& g) {
+	double total = 0;
+	for (size_t i = 0; i < g.size(); i++) {
+		for (size_t e = g.offsets[i]; e < g.offsets[i + 1]; e++) {
+			total += abs(g.targets[e] - (int)i);
+		}
+	}
+	return total / g.n_edges();
+}
+
+// Reordering must preserve the graph (mapping back through original_ids) and improve locality.
+TEST(reorder_preserves_graph) {
+	PERF_UNIT("reordering");
+	Config C(8, 60);
+	Graph torus = generate_graph(C);
+	// Scramble the ids, as an importer might:
+	std::vector<entity_id> shuffle(torus.size());
+	MTwist rng(8);
+	for (size_t i = 0; i < shuffle.size(); i++) {
+		shuffle[i] = i;
+	}
+	for (size_t i = shuffle.size() - 1; i > 0; i--) {
+		std::swap(shuffle[i], shuffle[rng.rand_int(i + 1)]);
+	}
+	Graph scrambled = torus;
+	apply_order(scrambled, shuffle);
+	double scrambled_span = mean_edge_span(scrambled);
+
+	const char* methods[] = {"bfs", "rcm", "hilbert"};
+	for (const char* method : methods) {
+		Graph g = scrambled;
+		CHECK(reorder_graph(g, method, C.sqrt_size));
+		CHECK_EQUAL(torus.n_edges(), g.n_edges());
+		// original_ids compose, so they lead back to the unscrambled torus:
+		for (size_t i = 0; i < g.size(); i++) {
+			entity_id orig = g.original_ids[i];
+			CHECK_EQUAL(torus.degree(orig), g.degree(i));
+			for (size_t k = 0; k < g.degree(i); k++) {
+				CHECK_EQUAL(torus.targets[torus.offsets[orig] + k], g.original_ids[g.targets[g.offsets[i] + k]]);
+			}
+		}
+		printf("Mean edge span by %s: %.1f (scrambled: %.1f)\n", method, mean_edge_span(g), scrambled_span);
+		CHECK(mean_edge_span(g) < scrambled_span / 4);
+	}
+	CHECK(!reorder_graph(scrambled, "unknown", C.sqrt_size));
+}
+
+// Compression must round-trip up to quantization, with edges by descending probability.
+TEST(compressed_graph_roundtrip) {
+	PERF_UNIT("compressed graph");
+	MTwist rng(9);
+	const int N = 20000;
+	std::vector<EdgeList> lists(N);
+	for (int i = 0; i < N; i++) {
+		int degree = rng.rand_int(40);
+		for (int j = 0; j < degree; j++) {
+			// Mostly local targets, a few far away, and a few probability levels:
+			int target = rng.random_chance(0.8) ? (i + rng.rand_int(201) - 100 + N) % N : rng.rand_int(N);
+			lists[i].push_back({(1 + rng.rand_int(4)) / 4.0, target});
+		}
+	}
+	Graph g = Graph::from_lists(lists);
+	for (int bits : {8, 16}) {
+		CompressedGraph c = CompressedGraph::compress(g, bits, 4);
+		report_compression(c);
+		CHECK_EQUAL(g.n_edges(), c.n_edges());
+		CHECK(c.memory_size() < (g.n_edges() * 8 + g.offsets.size() * 8) / 2);
+		for (int i = 0; i < N; i++) {
+			Node node = c[i];
+			CHECK_EQUAL(g.degree(i), node.size());
+			std::vector<std::pair<float, entity_id>> a, b;
+			for (size_t k = 0; k < node.size(); k++) {
+				if (k > 0) {
+					CHECK(node[k - 1].prob >= node[k].prob);
+				}
+				a.push_back({g[i][k].prob, g[i][k].node});
+				b.push_back({(float)node[k].prob, node[k].node});
+			}
+			std::sort(a.begin(), a.end()), std::sort(b.begin(), b.end());
+			for (size_t k = 0; k < a.size(); k++) {
+				CHECK_EQUAL(a[k].second, b[k].second);
+				CHECK_CLOSE(a[k].first, b[k].first, 1.0 / (1 << bits));
+			}
+		}
+	}
+
+	// The event engine must run on it unchanged:
+	Config C(9, 1);
+	C.size = N;
+	StateAltCompressed alt;
+	alt.init(C);
+	alt.set_graph(CompressedGraph::compress(g, 8));
+	StatCalc sizes, times;
+	run_trials(alt, C, 3, sizes, times);
+	CHECK(sizes.average > 5);
+}
+
+// Containers far over the old 1MB limit must round-trip, in native and portable files alike.
+TEST(serialize_large_containers) {
+	PERF_UNIT("serialization");
+	const char* filename = "/tmp/infectsim_test.dat";
+	std::vector<float> floats(3000000);
+	std::vector<uint64_t> words(400000);
+	std::vector<char> bytes(5000001);
+	for (size_t i = 0; i < floats.size(); i++) {
+		floats[i] = i * 0.5f;
+	}
+	for (size_t i = 0; i < words.size(); i++) {
+		words[i] = i * 0x0102030405ULL;
+	}
+	for (size_t i = 0; i < bytes.size(); i++) {
+		bytes[i] = i % 251;
+	}
+	for (bool native : {true, false}) {
+		{
+			DataWriter writer(filename, native);
+			int small = -17;
+			double d = 2.5;
+			writer << small << floats << d << words << bytes;
+		}
+		DataReader reader(filename);
+		int small = 0;
+		double d = 0;
+		std::vector<float> floats2;
+		std::vector<uint64_t> words2;
+		std::vector<char> bytes2;
+		reader << small << floats2 << d << words2 << bytes2;
+		CHECK_EQUAL(-17, small);
+		CHECK_EQUAL(2.5, d);
+		CHECK(floats == floats2);
+		CHECK(words == words2);
+		CHECK(bytes == bytes2);
+	}
+	remove(filename);
+}
+
+static std::vector<char> read_file(const char* filename) {
+	std::vector<char> data;
+	FILE* file = fopen(filename, "rb");
+	for (int c; file != NULL && (c = fgetc(file)) != EOF;) {
+		data.push_back(c);
+	}
+	if (file != NULL) {
+		fclose(file);
+	}
+	return data;
+}
+
+// Portable files must hold containers of structs field by field (and so byte-swapped), not as
+// the compiler laid them out.
+TEST(serialize_portable_structs) {
+	PERF_UNIT("serialization");
+	const char* filename = "/tmp/infectsim_test.dat";
+	const char* expected_filename = "/tmp/infectsim_test_expected.dat";
+	std::vector<InfectionEvent> events;
+	for (int i = 0; i < 1000; i++) {
+		events.push_back({i * 0.25, i, i - 1});
+	}
+	{
+		DataWriter writer(filename, false);
+		writer << events;
+	}
+	{
+		DataWriter writer(expected_filename, false);
+		writer << (uint64_t)events.size();
+		for (InfectionEvent& e : events) {
+			writer << e.time << e.infected << e.infector;
+		}
+	}
+	CHECK(read_file(filename) == read_file(expected_filename));
+	DataReader reader(filename);
+	std::vector<InfectionEvent> events2;
+	reader << events2;
+	CHECK_EQUAL(events.size(), events2.size());
+	for (size_t i = 0; i < events.size() && i < events2.size(); i++) {
+		CHECK_EQUAL(events[i].time, events2[i].time);
+		CHECK_EQUAL(events[i].infected, events2[i].infected);
+		CHECK_EQUAL(events[i].infector, events2[i].infector);
+	}
+	remove(filename);
+	remove(expected_filename);
+}
+
+// The background thread must write and read back exactly the bytes given, whatever the
+// write and read sizes, with or without O_DIRECT, including files of a whole number of chunks.
+TEST(async_file_io) {
+	PERF_UNIT("async file io");
+	const char* filename = "/tmp/infectsim_test.async";
+	MTwist rng(11);
+	for (size_t total : {(size_t)0, (size_t)2 * AsyncFileIO::CHUNK_SIZE, (size_t)3456789}) {
+		std::vector<char> data(total);
+		for (size_t i = 0; i < total; i++) {
+			data[i] = rng.rand_int(256);
+		}
+		for (bool direct : {false, true}) {
+			AsyncFileIO writer(filename, AsyncFileIO::WRITE, direct);
+			CHECK(writer.is_open());
+			for (size_t i = 0; i < total;) {
+				size_t n = std::min(total - i, (size_t)rng.rand_int(300000));
+				writer.write(data.data() + i, n);
+				i += n;
+			}
+			CHECK(writer.close());
+
+			AsyncFileIO reader(filename, AsyncFileIO::READ, direct);
+			std::vector<char> read_back(total + 100);
+			size_t got = 0;
+			while (true) {
+				size_t n = reader.read(read_back.data() + got, std::min(read_back.size() - got, (size_t)rng.rand_int(300000) + 1));
+				if (n == 0) {
+					break;
+				}
+				got += n;
+			}
+			CHECK_EQUAL(total, got);
+			read_back.resize(got);
+			CHECK(data == read_back);
+		}
+	}
+	remove(filename);
+}
+
+// The codec must round-trip compressible and random data alike, and compressed files must
+// read back both sequentially and at random offsets.
+TEST(block_compress) {
+	PERF_UNIT("block compress");
+	MTwist rng(13);
+	std::vector<char> data(3 * CompressedFileWriter::BLOCK_SIZE + 12345);
+	for (size_t i = 0; i < data.size(); i++) {
+		// Runs of repeats and short cycles, then random bytes for the last block:
+		data[i] = (i < 3 * CompressedFileWriter::BLOCK_SIZE) ? (char)((i / 7) % 13 + (i % 3)) : rng.rand_int(256);
+	}
+	for (size_t n : {(size_t)0, (size_t)5, (size_t)100, (size_t)70000, data.size()}) {
+		std::vector<char> packed(lz_compress_bound(n));
+		size_t packed_size = lz_compress(data.data(), n, packed.data());
+		CHECK(packed_size <= packed.size());
+		std::vector<char> unpacked(n);
+		CHECK(lz_decompress(packed.data(), packed_size, unpacked.data(), n));
+		CHECK(std::equal(unpacked.begin(), unpacked.end(), data.begin()));
+		if (n > 0) {
+			// Truncated input must be caught, not overrun
+			CHECK(!lz_decompress(packed.data(), packed_size - 1, unpacked.data(), n));
+		}
+	}
+
+	const char* filename = "/tmp/infectsim_test.lz";
+	CompressedFileWriter writer(filename, 2);
+	CHECK(writer.is_open());
+	for (size_t i = 0; i < data.size();) {
+		size_t n = std::min(data.size() - i, (size_t)rng.rand_int(300000));
+		writer.write(data.data() + i, n);
+		i += n;
+	}
+	CHECK(writer.close());
+	CHECK(writer.compressed_size() < writer.raw_size() / 2);
+	CHECK(CompressedFileReader::is_compressed(filename));
+
+	CompressedFileReader reader(filename, 2);
+	CHECK_EQUAL(4u, reader.n_blocks());
+	CHECK_EQUAL(data.size(), reader.raw_size());
+	std::vector<char> read_back(data.size() + 100);
+	size_t got = 0;
+	while (size_t n = reader.read(read_back.data() + got, std::min(read_back.size() - got, (size_t)rng.rand_int(300000) + 1))) {
+		got += n;
+	}
+	CHECK_EQUAL(data.size(), got);
+	CHECK(std::equal(data.begin(), data.end(), read_back.begin()));
+	for (int i = 0; i < 20; i++) {
+		size_t offset = rng.rand_int(data.size()), n = rng.rand_int(2 * CompressedFileWriter::BLOCK_SIZE);
+		size_t expected = std::min(n, data.size() - offset);
+		CHECK_EQUAL(expected, reader.read_at(offset, read_back.data(), n));
+		CHECK(std::equal(read_back.begin(), read_back.begin() + expected, data.begin() + offset));
+	}
+
+	// A corrupt block must be reported as an error to the reader, not take down a decoding thread
+	{
+		FILE* file = fopen(filename, "r+b");
+		uint32_t packed_size0;
+		fseek(file, 12, SEEK_SET);
+		CHECK(fread(&packed_size0, 4, 1, file) == 1);
+		uint32_t packed_size1;
+		long block1 = 12 + 8 + (packed_size0 & 0x7fffffff);
+		fseek(file, block1, SEEK_SET);
+		CHECK(fread(&packed_size1, 4, 1, file) == 1);
+		CHECK(!(packed_size1 & 0x80000000));
+		// All 255s: a literal run that never ends
+		std::vector<char> garbage(packed_size1, (char)0xff);
+		fseek(file, block1 + 8, SEEK_SET);
+		fwrite(garbage.data(), 1, garbage.size(), file);
+		fclose(file);
+		CompressedFileReader corrupt(filename, 4);
+		for (int attempt = 0; attempt < 2; attempt++) {
+			bool caught = false;
+			try {
+				for (size_t got = 0; corrupt.read_at(got, read_back.data(), 100000) > 0; got += 100000) {
+				}
+			} catch (SerializeBufferError&) {
+				caught = true;
+			}
+			CHECK(caught);
+		}
+	}
+
+	// Data files are detected as compressed when read
+	{
+		DataWriter file_writer(filename, true, false, /* compressed: */ true);
+		file_writer << data;
+		file_writer.close();
+	}
+	std::vector<char> loaded;
+	DataReader file_reader(filename);
+	file_reader << loaded;
+	CHECK(data == loaded);
+	remove(filename);
+}
+
+// Everything pushed must be popped once, in order, across many wrap-arounds of a small ring
+// that is often full and often empty.
+TEST(spsc_ring) {
+	PERF_UNIT("spsc ring");
+	const uint64_t N = 1000000;
+	SpscRing<uint64_t> ring(100);
+	CHECK_EQUAL(128u, ring.capacity());
+	CHECK(ring.empty());
+	std::thread producer([&]() {
+		MTwist rng(17);
+		std::vector<uint64_t> items(200);
+		for (uint64_t next = 0; next < N;) {
+			size_t n = std::min((uint64_t)rng.rand_int(200) + 1, N - next);
+			for (size_t i = 0; i < n; i++) {
+				items[i] = next + i;
+			}
+			size_t pushed = ring.push(items.data(), n);
+			next += pushed;
+			if (pushed == 0) {
+				std::this_thread::yield();
+			}
+		}
+	});
+	MTwist rng(19);
+	std::vector<uint64_t> items(200);
+	uint64_t expected = 0;
+	bool in_order = true;
+	while (expected < N) {
+		size_t n = ring.pop(items.data(), rng.rand_int(200) + 1);
+		for (size_t i = 0; i < n; i++) {
+			in_order = in_order && (items[i] == expected++);
+		}
+		if (n == 0) {
+			std::this_thread::yield();
+		}
+	}
+	producer.join();
+	CHECK(in_order);
+	CHECK(ring.empty());
+	CHECK_EQUAL(0u, ring.pop(items.data(), items.size()));
+}
+
+#ifndef PERF_TIMERS_DISABLED
+static int perf_recurse(int depth) {
+	PERF_TIMER2("perf_recurse");
+	return (depth == 0) ? 0 : 1 + perf_recurse(depth - 1);
+}
+
+// Every scope is counted once, whichever thread (or recursion level) it ran in, and a timed
+// scope must stay cheap enough to leave in hot loops.
+TEST(perf_timer_threads) {
+	PERF_UNIT("perf timer");
+	const int N = 100000;
+	std::vector<std::thread> threads;
+	for (int t = 0; t < 4; t++) {
+		threads.emplace_back([&]() {
+			for (int i = 0; i < N; i++) {
+				PERF_TIMER2("perf_timer_threads scope");
+			}
+		});
+	}
+	for (std::thread& thread : threads) {
+		thread.join();
+	}
+	CHECK_EQUAL(4u * N, perf_timer_calls("perf_timer_threads scope"));
+	CHECK_EQUAL(10, perf_recurse(10));
+	CHECK_EQUAL(11u, perf_timer_calls("perf_recurse"));
+	CHECK_EQUAL(0u, perf_timer_calls("never timed"));
+
+	Timer timer;
+	for (int i = 0; i < N; i++) {
+		PERF_TIMER2("perf_timer_threads overhead");
+	}
+	double ns_per_scope = timer.get_microseconds() * 1000.0 / N;
+	printf("%.1fns per timed scope\n", ns_per_scope);
+	CHECK(ns_per_scope < 1000);
+}
+#endif
+
+#ifndef PERF_TIMERS_DISABLED
+static void perf_spin(int n) {
+	volatile int sink = 0;
+	for (int i = 0; i < n; i++) {
+		sink = sink + i;
+	}
+}
+
+static void perf_pong(int depth);
+
+static void perf_ping(int depth) {
+	PERF_TIMER2("perf_ping");
+	perf_spin(1000);
+	if (depth > 0) {
+		perf_pong(depth - 1);
+	}
+}
+
+static void perf_pong(int depth) {
+	PERF_TIMER2("perf_pong");
+	perf_spin(1000);
+	perf_ping(depth);
+}
+
+// Inclusive time covers each outermost activation once, however deep the recursion,
+// and the exclusive times of a scope and its callees add up to its inclusive time.
+TEST(perf_timer_call_tree) {
+	PERF_UNIT("perf timer call tree");
+	for (int i = 0; i < 3; i++) {
+		PERF_TIMER2("perf_timer_call_tree outer");
+		perf_spin(10000);
+		for (int j = 0; j < 4; j++) {
+			PERF_TIMER2("perf_timer_call_tree inner");
+			perf_spin(1000);
+		}
+	}
+	PerfSiteTotals outer = perf_timer_totals("perf_timer_call_tree outer");
+	PerfSiteTotals inner = perf_timer_totals("perf_timer_call_tree inner");
+	CHECK_EQUAL(3u, outer.slot.calls);
+	CHECK_EQUAL(12u, inner.slot.calls);
+	CHECK_EQUAL(outer.slot.total, outer.exclusive + inner.slot.total);
+	CHECK_EQUAL(inner.slot.total, inner.exclusive);
+
+	perf_recurse(10);
+	PerfSiteTotals direct = perf_timer_totals("perf_recurse");
+	CHECK_EQUAL(1u, direct.slot.calls);
+	CHECK_EQUAL(10u, direct.recursive);
+	CHECK_EQUAL(direct.slot.total, direct.exclusive);
+
+	perf_ping(5);
+	PerfSiteTotals ping = perf_timer_totals("perf_ping");
+	PerfSiteTotals pong = perf_timer_totals("perf_pong");
+	CHECK_EQUAL(1u, ping.slot.calls);
+	CHECK_EQUAL(5u, ping.recursive);
+	CHECK_EQUAL(5u, pong.slot.calls + pong.recursive);
+	CHECK_EQUAL(ping.slot.total, ping.exclusive + pong.exclusive);
+	CHECK(pong.slot.total < ping.slot.total);
+}
+
+// Every tick count falls in a bucket whose values are within ~3% of it, and a few slow calls
+// among many fast ones (as in an occasional rescale) show up in the tail percentiles only.
+TEST(perf_timer_percentiles) {
+	PERF_UNIT("perf timer percentiles");
+	MTwist rng(23);
+	bool in_bucket = true;
+	for (int i = 0; i < 100000; i++) {
+		uint64_t ticks = uint64_t(rng.rand_int(1 << 30)) << rng.rand_int(30);
+		int bucket = perf_bucket(ticks);
+		uint64_t lowest = (bucket == 0) ? 0 : perf_bucket_limit(bucket - 1) + 1;
+		in_bucket = in_bucket && bucket < PERF_BUCKETS && lowest <= ticks
+				&& ticks <= perf_bucket_limit(bucket)
+				&& perf_bucket_limit(bucket) - lowest <= lowest / PERF_SUB_BUCKETS;
+	}
+	CHECK(in_bucket);
+	CHECK_EQUAL(PERF_BUCKETS - 1, perf_bucket(~uint64_t(0)));
+
+	std::thread slow_thread([]() {
+		for (int i = 0; i < 20; i++) {
+			PERF_TIMER2("perf_timer_percentiles scope");
+			perf_spin(1000000);
+		}
+	});
+	for (int i = 0; i < 10000; i++) {
+		PERF_TIMER2("perf_timer_percentiles scope");
+		perf_spin(100);
+	}
+	slow_thread.join();
+	PerfSlot slot = perf_timer_totals("perf_timer_percentiles scope").slot;
+	CHECK_EQUAL(10020u, slot.calls);
+	CHECK(slot.percentile(0.9) * 100 < slot.percentile(0.999));
+	CHECK(slot.percentile(0.999) <= slot.max);
+	CHECK_EQUAL(slot.max, slot.percentile(1.0));
+}
+
+static int count_occurrences(const std::string& text, const std::string& pattern) {
+	int count = 0;
+	for (size_t at = text.find(pattern); at != std::string::npos; at = text.find(pattern, at + 1)) {
+		count++;
+	}
+	return count;
+}
+
+static std::string read_text(const char* filename) {
+	std::string text;
+	FILE* file = fopen(filename, "r");
+	for (int c; file != NULL && (c = fgetc(file)) != EOF;) {
+		text += (char)c;
+	}
+	if (file != NULL) {
+		fclose(file);
+	}
+	return text;
+}
+
+// The timeline keeps each thread's latest scopes, and the summaries have a row per site
+// of every PERF_UNIT kept.
+TEST(perf_timer_export) {
+	const char* trace_filename = "/tmp/infectsim_test.perf.json";
+	const char* json_filename = "/tmp/infectsim_test.summary.json";
+	const char* csv_filename = "/tmp/infectsim_test.summary.csv";
+	{
+		PERF_UNIT("perf timer export");
+		perf_trace_start(64);
+		std::thread other([]() {
+			for (int i = 0; i < 10; i++) {
+				PERF_TIMER2("perf_timer_export \"quoted\" scope");
+			}
+		});
+		other.join();
+		for (int i = 0; i < 100; i++) {
+			PERF_TIMER2("perf_timer_export \"quoted\" scope");
+			perf_spin(100);
+		}
+		perf_trace_stop();
+		{ PERF_TIMER2("perf_timer_export untraced"); }
+		CHECK(perf_write_trace(trace_filename));
+	}
+	std::string trace = read_text(trace_filename);
+	CHECK_EQUAL(0u, trace.find("{\"displayTimeUnit\": \"ms\", \"traceEvents\": ["));
+	CHECK_EQUAL(74, count_occurrences(trace, "\"name\": \"perf_timer_export \\\"quoted\\\" scope\", \"cat\": \"perf\", \"ph\": \"X\""));
+	CHECK_EQUAL(0, count_occurrences(trace, "untraced"));
+
+	CHECK(perf_write_summary(json_filename));
+	CHECK(perf_write_summary(csv_filename));
+	std::string json = read_text(json_filename), csv = read_text(csv_filename);
+	CHECK_EQUAL(1, count_occurrences(json, "{\"unit\": \"perf timer export\", \"name\": \"perf_timer_export \\\"quoted\\\" scope\", \"calls\": 110,"));
+	CHECK_EQUAL(1, count_occurrences(csv, "\"perf timer export\",\"perf_timer_export \"\"quoted\"\" scope\",110,"));
+	CHECK_EQUAL(1, count_occurrences(csv, "\"perf timer export\",\"perf_timer_export untraced\",1,"));
+	CHECK_EQUAL(0u, csv.find("unit,name,calls,total_ms,"));
+	remove(trace_filename);
+	remove(json_filename);
+	remove(csv_filename);
+}
+#endif
+
+// Engines running in place on a mapped snapshot must behave exactly as on the network it was
+// saved from, and corruption must be caught.
+TEST(snapshot_roundtrip) {
+	PERF_UNIT("snapshot");
+	const char* filename = "/tmp/infectsim_test.snap";
+	Config C(5, 40);
+	Graph g = generate_graph(C);
+	g.original_ids.assign(g.size(), 7);
+	State kmc;
+	kmc.init(C);
+	kmc.set_graph(g);
+	g.sort_by_prob();
+	SnapshotWriter writer;
+	writer.add_graph(g);
+	writer.add_alias_tables(kmc.alias);
+	writer.write(filename, C.sqrt_size);
+
+	std::shared_ptr<Snapshot> snapshot = Snapshot::open(filename);
+	CHECK(snapshot->verify());
+	CHECK_EQUAL(C.sqrt_size, snapshot->sqrt_size());
+	CHECK_EQUAL(0u, snapshot->file_size() % SNAPSHOT_ALIGN);
+	GraphView view = snapshot->graph();
+	CHECK_EQUAL(0u, (size_t)view.targets % SNAPSHOT_ALIGN);
+	Graph copy = view.to_graph();
+	CHECK(copy.offsets == g.offsets && copy.targets == g.targets && copy.probs == g.probs);
+	CHECK(copy.original_ids == g.original_ids);
+
+	// Same seed, same trials:
+	StatCalc sizes, times, mapped_sizes, mapped_times;
+	run_trials(kmc, C, 2, sizes, times);
+	State mapped_kmc;
+	mapped_kmc.init(C);
+	mapped_kmc.set_alias_tables(snapshot->alias_tables());
+	CHECK(mapped_kmc.alias.connections != kmc.alias.connections);
+	run_trials(mapped_kmc, C, 2, mapped_sizes, mapped_times);
+	CHECK_EQUAL(sizes.average, mapped_sizes.average);
+	CHECK_EQUAL(times.average, mapped_times.average);
+
+	StatCalc alt_sizes, alt_times, view_sizes, view_times;
+	StateAlt alt;
+	alt.init(C);
+	alt.set_graph(Graph(g));
+	run_trials(alt, C, 2, alt_sizes, alt_times);
+	StateAltView alt_view;
+	alt_view.init(C);
+	alt_view.set_graph(snapshot->graph());
+	run_trials(alt_view, C, 2, view_sizes, view_times);
+	CHECK_EQUAL(alt_sizes.average, view_sizes.average);
+	CHECK_EQUAL(alt_times.average, view_times.average);
+	// The first section starts on the first aligned boundary:
+	long probs_offset = SNAPSHOT_ALIGN + ((const char*)view.probs - (const char*)view.offsets);
+	snapshot.reset();
+	view = GraphView();
+	// Views keep the file mapped:
+	CHECK_EQUAL(g[1][2].node, alt_view.graph[1][2].node);
+
+	// Flip a byte of the probabilities, then of the header:
+	FILE* file = fopen(filename, "r+b");
+	fseek(file, probs_offset + 5, SEEK_SET);
+	int byte = fgetc(file);
+	fseek(file, probs_offset + 5, SEEK_SET);
+	fputc(byte ^ 0x5A, file);
+	fclose(file);
+	CHECK(!Snapshot::open(filename)->verify());
+	file = fopen(filename, "r+b");
+	fseek(file, offsetof(SnapshotHeader, sqrt_size), SEEK_SET);
+	fputc(99, file);
+	fclose(file);
+	CHECK_THROW(Snapshot::open(filename), const char*);
+	remove(filename);
+}
+
+// Runs 'steps' steps, checkpoints, and checks that restoring the checkpoint onto a fresh
+// engine (on the same network) finishes the run exactly as the original does.
+template <typename StateT>
+static void check_restore_continues_exactly(StateT& original, StateT& restored, Config& C, int steps) {
+	const char* filename = "/tmp/infectsim_test.checkpoint";
+	original.infect_n_random(20);
+	for (int i = 0; i < steps && !original.finished(C); i++) {
+		original.step();
+	}
+	{
+		DataWriter writer(filename);
+		original.visit_progress(writer);
+	}
+	DataReader reader(filename);
+	restored.visit_progress(reader);
+	CHECK_EQUAL(original.n_steps, restored.n_steps);
+	while (!original.finished(C)) {
+		original.step();
+	}
+	while (!restored.finished(C)) {
+		restored.step();
+	}
+	CHECK_EQUAL(original.n_steps, restored.n_steps);
+	CHECK_EQUAL(original.n_infections, restored.n_infections);
+	CHECK_EQUAL(original.time_elapsed, restored.time_elapsed);
+	remove(filename);
+}
+
+// Checkpointing an InfectionSet (and the RNG) must not change what it selects afterwards.
+template <typename InfectionSet>
+static void check_infection_set_checkpoint() {
+	const char* filename = "/tmp/infectsim_test.checkpoint";
+	MTwist rng(4);
+	InfectionSet set(1000);
+	for (int i = 0; i < 500; i++) {
+		set.insert(i * 2, 1 + rng.rand_int(100));
+		if (i % 50 == 0) {
+			set.scale(0.5);
+		}
+	}
+	{
+		DataWriter writer(filename);
+		set.visit(writer);
+		rng.visit(writer);
+	}
+	InfectionSet restored(1000);
+	MTwist restored_rng;
+	DataReader reader(filename);
+	restored.visit(reader);
+	restored_rng.visit(reader);
+	CHECK_EQUAL((double)set.total_weight(), (double)restored.total_weight());
+	for (int i = 0; i < 1000; i++) {
+		CHECK_EQUAL(set.random_select(rng), restored.random_select(restored_rng));
+	}
+	remove(filename);
+}
+
+TEST(checkpoint_restore) {
+	PERF_UNIT("checkpoint");
+	check_infection_set_checkpoint<DiscreteFixedTree>();
+	check_infection_set_checkpoint<DiscreteSearchTree>();
+	check_infection_set_checkpoint<DiscreteBucketTree>();
+	check_infection_set_checkpoint<DiscreteBST>();
+
+	Config C(8, 40);
+	Graph g = generate_graph(C);
+	State kmc, kmc_restored;
+	kmc.init(C), kmc_restored.init(C);
+	kmc.set_graph(g), kmc_restored.set_graph(g);
+	check_restore_continues_exactly(kmc, kmc_restored, C, 3000);
+
+	StateAlt alt, alt_restored;
+	alt.init(C), alt_restored.init(C);
+	alt.set_graph(Graph(g)), alt_restored.set_graph(Graph(g));
+	check_restore_continues_exactly(alt, alt_restored, C, 300);
+
+	// Written by a forked child:
+	const char* filename = "/tmp/infectsim_test.fork_checkpoint";
+	Checkpointer checkpointer(filename, 0);
+	CHECK(checkpointer.due());
+	size_t n_steps = alt.n_steps;
+	checkpointer.write([&](DataWriter& writer) {
+		alt.visit_progress(writer);
+	});
+	alt.fast_reset(C);
+	checkpointer.wait();
+	DataReader reader(filename);
+	alt_restored.visit_progress(reader);
+	CHECK_EQUAL(n_steps, alt_restored.n_steps);
+	remove(filename);
+}
+
+// Runs 'state' with a trace and generation statistics observing it, and checks the trace
+// records each infection once, seeds without an infector, and everyone else after an
+// infected infector.
+template <typename StateT>
+static void check_engine_trace(StateT& state, Config& C, const char* filename) {
+	GenerationStats generations;
+	{
+		TraceWriter trace(filename, true, 1000);
+		TraceObserver tracer;
+		tracer.writer = &trace;
+		NullObserver unused;
+		generations.enabled = true;
+		generations.reset(state.size());
+		auto observer = observe(tracer, unused, generations);
+		CHECK(observer.active());
+		state.infections.enable(true);
+		state.infect_n_random(5);
+		for (int i = 0; i < 2000 && !state.finished(C); i++) {
+			state.step();
+			if (state.infections.full()) {
+				deliver_infections(state, observer);
+			}
+		}
+		deliver_infections(state, observer);
+		state.infections.enable(false);
+		CHECK(trace.close());
+		CHECK_EQUAL(state.n_infections, trace.n_records());
+		CHECK_EQUAL(state.n_infections, generations.n_infections);
+		CHECK(generations.max > 0);
+	}
+	TraceReader reader(filename);
+	TraceBlock block;
+	std::vector<double> infected_at(state.size(), -1);
+	size_t n_seeds = 0, n_records = 0, last_step = 0;
+	while (reader.next(block)) {
+		for (size_t i = 0; i < block.time.size(); i++) {
+			CHECK(infected_at[block.infected[i]] < 0);
+			CHECK(block.step[i] >= last_step);
+			last_step = block.step[i];
+			infected_at[block.infected[i]] = block.time[i];
+			if (block.infector[i] < 0) {
+				n_seeds++;
+			} else {
+				CHECK(infected_at[block.infector[i]] >= 0 && infected_at[block.infector[i]] <= block.time[i]);
+			}
+			n_records++;
+		}
+	}
+	CHECK_EQUAL(5u, n_seeds);
+	CHECK_EQUAL(state.n_infections, n_records);
+
+	// A disabled log stores nothing
+	state.fast_reset(C);
+	state.infect_n_random(5);
+	CHECK(state.infections.empty());
+}
+
+// Records from several threads, in small blocks, must all come back in their order per thread,
+// tagged with their trial, whether compressed or not.
+TEST(trace_roundtrip) {
+	PERF_UNIT("trace");
+	const char* filename = "/tmp/infectsim_test.trace";
+	const int N_THREADS = 3, N_RECORDS = 10000;
+	std::vector<int64_t> ids(N_RECORDS);
+	for (int i = 0; i < N_RECORDS; i++) {
+		ids[i] = 1000000 + 3 * i;
+	}
+	for (bool compressed : {false, true}) {
+		TraceWriter trace(filename, compressed, 777);
+		CHECK(trace.is_open());
+		trace.write_original_ids(ids);
+		for (int trial = 0; trial < 2; trial++) {
+			trace.set_trial(trial);
+			std::vector<std::thread> threads;
+			for (int t = 0; t < N_THREADS; t++) {
+				threads.emplace_back([&, t]() {
+					for (int i = 0; i < N_RECORDS; i++) {
+						trace.record(i * 0.5, t, i, (uint64_t)t << 32 | i);
+					}
+				});
+			}
+			for (std::thread& thread : threads) {
+				thread.join();
+			}
+		}
+		CHECK(trace.close());
+		CHECK_EQUAL((uint64_t)2 * N_THREADS * N_RECORDS, trace.n_records());
+
+		TraceReader reader(filename);
+		CHECK(reader.is_open());
+		TraceBlock block;
+		std::vector<int> next(2 * N_THREADS, 0);
+		while (reader.next(block)) {
+			CHECK(block.trial == 0 || block.trial == 1);
+			for (size_t i = 0; i < block.time.size(); i++) {
+				int t = block.infector[i];
+				int& expected = next[block.trial * N_THREADS + t];
+				CHECK_EQUAL(expected, block.infected[i]);
+				CHECK_EQUAL(expected * 0.5, block.time[i]);
+				CHECK_EQUAL((uint64_t)t << 32 | expected, block.step[i]);
+				expected++;
+			}
+		}
+		for (int n : next) {
+			CHECK_EQUAL(N_RECORDS, n);
+		}
+		CHECK(reader.original_ids() == ids);
+	}
+
+	Config C(9, 40);
+	Graph g = generate_graph(C);
+	State kmc;
+	kmc.init(C);
+	kmc.set_graph(g);
+	check_engine_trace(kmc, C, filename);
+	StateAlt alt;
+	alt.init(C);
+	alt.set_graph(Graph(g));
+	check_engine_trace(alt, C, filename);
+	remove(filename);
+}
+
+// LatticeGraph must have exactly the edges generate_graph stores, in descending probability order.
+TEST(lattice_matches_torus) {
+	PERF_UNIT("lattice graph");
+	Config C(3, 30);
+	Graph torus = generate_graph(C);
+	LatticeGraph lattice(C.sqrt_size, 0.9);
+	CHECK_EQUAL(torus.size(), lattice.size());
+	CHECK_EQUAL(torus.n_edges(), lattice.n_edges());
+	for (size_t i = 0; i < torus.size(); i++) {
+		Node node = torus[i];
+		LatticeNode lnode = lattice[i];
+		std::vector<std::pair<entity_id, float>> a, b;
+		for (size_t j = 0; j < node.size(); j++) {
+			a.push_back({node[j].node, node[j].prob});
+			b.push_back({lnode[j].node, lnode[j].prob});
+		}
+		std::sort(a.begin(), a.end()), std::sort(b.begin(), b.end());
+		CHECK(a == b);
+	}
+
+	LatticeGraph popular(C.sqrt_size, 0.9, 7);
+	double total = 0;
+	for (size_t i = 0; i < popular.size(); i++) {
+		LatticeNode lnode = popular[i];
+		for (size_t j = 1; j < lnode.size(); j++) {
+			CHECK(lnode[j - 1].prob >= lnode[j].prob);
+		}
+		total += lnode[0].prob;
+	}
+	// Orthogonal edges have probability min(1, U[0, 2)), averaging 0.75:
+	CHECK_CLOSE(0.75, total / popular.size(), 0.05);
+}
+
+// Both engines must accept the implicit graph unchanged.
+TEST(engines_run_on_lattice) {
+	PERF_UNIT("engines on lattice");
+	Config C(4, 60);
+	StatCalc sizes, times;
+	State state;
+	state.init(C);
+	state.set_graph(LatticeGraph(C.sqrt_size, 0.9));
+	state.infect_n_random(5);
+	while (!state.finished(C)) {
+		state.step();
+	}
+	CHECK(state.n_infections > 5);
+
+	StateAltLattice alt;
+	alt.init(C);
+	alt.set_graph(LatticeGraph(C.sqrt_size, 0.9));
+	run_trials(alt, C, 5, sizes, times);
+	// With p = 0.9 to all 8 neighbours, the outbreak covers (nearly) the whole torus
+	CHECK(sizes.average > C.size * 0.95);
+}
+
 // This test mostly trivially passes.
 // Its output is merely empirical evidence that data structure implementation is correct.
 template <typename T>
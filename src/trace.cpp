@@ -0,0 +1,203 @@
+#include <algorithm>
+#include <cstring>
+
+#include "libs/BlockCompress.h"
+#include "libs/customassert.h"
+
+#include "trace.h"
+
+using namespace std;
+
+static const uint32_t TRACE_BYTE_ORDER = 0x01020304;
+// Bytes per record: time, step, infector, infected
+static const size_t RECORD_SIZE = 8 + 8 + 4 + 4;
+
+static size_t padded(size_t n) {
+	return (n + 7) & ~(size_t)7;
+}
+
+TraceColumns::TraceColumns(size_t capacity) :
+		capacity(capacity), storage(3 * capacity) {
+	time = (double*)storage.data();
+	step = (uint64_t*)(time + capacity);
+	infector = (int32_t*)(step + capacity);
+	infected = infector + capacity;
+}
+
+void TraceColumns::compact() {
+	if (n == capacity) {
+		return;
+	}
+	char* base = (char*)storage.data();
+	memmove(base + 8 * n, step, 8 * n);
+	memmove(base + 16 * n, infector, 4 * n);
+	memmove(base + 20 * n, infected, 4 * n);
+}
+
+atomic<uint64_t> TraceWriter::next_id(1);
+
+TraceWriter::TraceWriter(const string& filename, bool compressed, size_t block_records) :
+		id(next_id++), file(filename, AsyncFileIO::WRITE), compressed(compressed), block_records(block_records) {
+	if (!is_open()) {
+		return;
+	}
+	TraceFileHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, TRACE_MAGIC, sizeof(TRACE_MAGIC));
+	header.byte_order = TRACE_BYTE_ORDER;
+	header.version = TRACE_VERSION;
+	header.header_size = sizeof(TraceFileHeader);
+	header.block_header_size = sizeof(TraceBlockHeader);
+	file.write((const char*)&header, sizeof(header));
+	bytes_written = sizeof(header);
+}
+
+TraceWriter::~TraceWriter() {
+	close();
+}
+
+TraceColumns& TraceWriter::add_buffer() {
+	std::lock_guard<std::mutex> lock(mutex);
+	buffers.emplace_back(new TraceColumns(block_records));
+	return *buffers.back();
+}
+
+void TraceWriter::write_block(TraceColumns& c) {
+	if (c.n == 0) {
+		return;
+	}
+	c.compact();
+	append_block(0, c.n, (const char*)c.storage.data(), c.n * RECORD_SIZE, c.packed);
+	c.n = 0;
+}
+
+void TraceWriter::write_original_ids(const vector<int64_t>& ids) {
+	if (ids.empty()) {
+		return;
+	}
+	vector<char> packed;
+	append_block(TRACE_IDS, ids.size(), (const char*)ids.data(), ids.size() * sizeof(int64_t), packed);
+}
+
+void TraceWriter::append_block(uint32_t flags, uint32_t n_records, const char* raw, size_t raw_size, vector<char>& packed) {
+	const char* payload = raw;
+	size_t payload_size = raw_size;
+	if (compressed) {
+		// Compressed outside the lock, so threads compress in parallel
+		packed.resize(lz_compress_bound(raw_size));
+		size_t packed_size = lz_compress(raw, raw_size, packed.data());
+		if (packed_size < raw_size) {
+			payload = packed.data();
+			payload_size = packed_size;
+			flags |= TRACE_LZ;
+		}
+	}
+	static const char ZEROS[8] = {0};
+	std::lock_guard<std::mutex> lock(mutex);
+	TraceBlockHeader header;
+	memcpy(header.magic, TRACE_BLOCK_MAGIC, sizeof(TRACE_BLOCK_MAGIC));
+	header.flags = flags;
+	header.trial = trial;
+	header.n_records = n_records;
+	header.payload_size = payload_size;
+	header.raw_size = raw_size;
+	file.write((const char*)&header, sizeof(header));
+	file.write(payload, payload_size);
+	file.write(ZEROS, padded(payload_size) - payload_size);
+	if (!(flags & TRACE_IDS)) {
+		records_written += n_records;
+	}
+	bytes_written += sizeof(header) + padded(payload_size);
+}
+
+void TraceWriter::record(const InfectionBatch& batch) {
+	TraceColumns& c = local();
+	for (size_t i = 0; i < batch.n;) {
+		size_t n = std::min(batch.n - i, c.capacity - c.n);
+		memcpy(c.time + c.n, batch.time + i, n * sizeof(double));
+		memcpy(c.step + c.n, batch.step + i, n * sizeof(uint64_t));
+		memcpy(c.infector + c.n, batch.infector + i, n * sizeof(int32_t));
+		memcpy(c.infected + c.n, batch.infected + i, n * sizeof(int32_t));
+		c.n += n, i += n;
+		if (c.n == c.capacity) {
+			write_block(c);
+		}
+	}
+}
+
+void TraceWriter::flush_all() {
+	for (unique_ptr<TraceColumns>& c : buffers) {
+		write_block(*c);
+	}
+}
+
+void TraceWriter::set_trial(int trial) {
+	flush_all();
+	this->trial = trial;
+}
+
+bool TraceWriter::close() {
+	if (!closed && is_open()) {
+		flush_all();
+	}
+	closed = true;
+	return file.close();
+}
+
+TraceReader::TraceReader(const string& filename) {
+	file = fopen(filename.c_str(), "rb");
+	if (file == NULL) {
+		return;
+	}
+	TraceFileHeader header;
+	bool ok = fread(&header, sizeof(header), 1, file) == 1 && memcmp(header.magic, TRACE_MAGIC, sizeof(TRACE_MAGIC)) == 0;
+	ASSERT(ok, "Not a trace file!");
+	ASSERT(header.byte_order == TRACE_BYTE_ORDER, "Trace was written with a different byte order!");
+	// Version 1 differs only in having no TRACE_IDS blocks
+	ASSERT(header.version >= 1 && header.version <= TRACE_VERSION && header.header_size == sizeof(TraceFileHeader)
+			&& header.block_header_size == sizeof(TraceBlockHeader), "Unsupported trace version!");
+}
+
+TraceReader::~TraceReader() {
+	if (file != NULL) {
+		fclose(file);
+	}
+}
+
+template <typename T>
+static void read_column(const char*& p, std::vector<T>& column, size_t n) {
+	column.resize(n);
+	memcpy(column.data(), p, n * sizeof(T));
+	p += n * sizeof(T);
+}
+
+bool TraceReader::next(TraceBlock& block) {
+	TraceBlockHeader header;
+	if (fread(&header, sizeof(header), 1, file) != 1) {
+		return false;
+	}
+	ASSERT(memcmp(header.magic, TRACE_BLOCK_MAGIC, sizeof(TRACE_BLOCK_MAGIC)) == 0, "Trace block is corrupt!");
+	size_t record_size = (header.flags & TRACE_IDS) ? sizeof(int64_t) : RECORD_SIZE;
+	ASSERT(header.raw_size == (uint64_t)header.n_records * record_size, "Trace block is corrupt!");
+	payload.resize(padded(header.payload_size));
+	ASSERT(fread(payload.data(), 1, payload.size(), file) == payload.size(), "Trace is truncated!");
+	const char* p = payload.data();
+	if (header.flags & TRACE_LZ) {
+		raw.resize(header.raw_size);
+		ASSERT(lz_decompress(payload.data(), header.payload_size, raw.data(), raw.size()), "Trace block is corrupt!");
+		p = raw.data();
+	} else {
+		ASSERT(header.payload_size == header.raw_size, "Trace block is corrupt!");
+	}
+	size_t n = header.n_records;
+	if (header.flags & TRACE_IDS) {
+		read_column(p, ids, n);
+		return next(block);
+	}
+	block.trial = header.trial;
+	read_column(p, block.time, n);
+	read_column(p, block.step, n);
+	read_column(p, block.infector, n);
+	read_column(p, block.infected, n);
+	return true;
+}
@@ -0,0 +1,182 @@
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <atomic>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "libs/AsyncFileIO.h"
+#include "libs/int_types.h"
+
+#include "discrete_common.h"
+#include "observers.h"
+
+/*
+ * Binary columnar trace of every infection: (time, infector, infected, step), where the
+ * infector is -1 for seeded infections. util/read_trace.py reads it with NumPy.
+ *
+ * Records are appended to per-thread column buffers, and each full buffer becomes one block.
+ * Everything is native-endian and 8-byte aligned, so uncompressed blocks can be viewed in
+ * place from an mmap of the file:
+ *   header (32 bytes): magic "INFSTRC1", u32 byte order mark 0x01020304, u32 version,
+ *     u32 header size, u32 block header size, u64 reserved
+ *   per block: header (32 bytes): magic "BLK\0", u32 flags (TRACE_LZ: payload is
+ *     LZ-compressed, see BlockCompress.h), u32 trial, u32 record count,
+ *     u64 payload size, u64 raw payload size;
+ *     then the payload, zero-padded to a multiple of 8 bytes
+ *   raw payload: f64 time[n], u64 step[n], i32 infector[n], i32 infected[n]
+ *   or, for a block flagged TRACE_IDS: i64 original_id[n], the input id of every entity
+ *     (see Graph::original_ids). Written first, and only for imported or reordered graphs.
+ * Blocks from different threads interleave; within a block, records are in the order
+ * recorded. Sort by (trial, step) for a global order.
+ */
+static const char TRACE_MAGIC[8] = {'I', 'N', 'F', 'S', 'T', 'R', 'C', '1'};
+static const char TRACE_BLOCK_MAGIC[4] = {'B', 'L', 'K', '\0'};
+static const uint32_t TRACE_VERSION = 2;
+static const uint32_t TRACE_LZ = 1, TRACE_IDS = 2;
+
+struct TraceFileHeader {
+	char magic[8];
+	uint32_t byte_order, version, header_size, block_header_size;
+	uint64_t reserved;
+};
+
+struct TraceBlockHeader {
+	char magic[4];
+	uint32_t flags, trial, n_records;
+	uint64_t payload_size, raw_size;
+};
+
+// One block's columns, laid out as its raw payload
+struct TraceColumns {
+	TraceColumns(size_t capacity);
+	// Moves the columns together when the block is not full
+	void compact();
+
+	size_t capacity, n = 0;
+	std::vector<uint64_t> storage;
+	double* time;
+	uint64_t* step;
+	int32_t* infector;
+	int32_t* infected;
+	// Compression scratch space
+	std::vector<char> packed;
+};
+
+class TraceWriter {
+public:
+	// 64K records, 1.5MB per block
+	static const size_t DEFAULT_BLOCK_RECORDS = 64 * 1024;
+
+	// If 'compressed', blocks are LZ-compressed as they are written
+	TraceWriter(const std::string& filename, bool compressed = false, size_t block_records = DEFAULT_BLOCK_RECORDS);
+	// Closes, without reporting errors; call close() to see them
+	~TraceWriter();
+
+	bool is_open() const {
+		return file.is_open();
+	}
+	// Thread-safe: each thread fills a buffer of its own, and only takes a lock to write it out
+	void record(double time, entity_id infector, entity_id infected, uint64_t step) {
+		TraceColumns& c = local();
+		c.time[c.n] = time;
+		c.step[c.n] = step;
+		c.infector[c.n] = infector;
+		c.infected[c.n] = infected;
+		if (++c.n == c.capacity) {
+			write_block(c);
+		}
+	}
+	// Records a whole batch, copying column by column
+	void record(const InfectionBatch& batch);
+	// Writes the entities' input ids, so readers can map the records back to them.
+	// Call before recording anything; nothing is written for an empty 'ids'.
+	void write_original_ids(const std::vector<int64_t>& ids);
+	// Writes out every partial buffer, and tags blocks from here on with 'trial'.
+	// No thread may be recording meanwhile.
+	void set_trial(int trial);
+	// Writes out everything, and fsyncs. Returns false if any write failed.
+	bool close();
+
+	uint64_t n_records() const {
+		return records_written;
+	}
+	uint64_t file_size() const {
+		return bytes_written;
+	}
+
+private:
+	// This thread's buffer, created on first use
+	TraceColumns& local() {
+		static thread_local uint64_t cached_id = 0;
+		static thread_local TraceColumns* cached = NULL;
+		if (cached_id != id) {
+			cached = &add_buffer();
+			cached_id = id;
+		}
+		return *cached;
+	}
+	TraceColumns& add_buffer();
+	void write_block(TraceColumns& c);
+	// Compresses 'raw' if asked to (into 'packed'), and appends it as one block
+	void append_block(uint32_t flags, uint32_t n_records, const char* raw, size_t raw_size, std::vector<char>& packed);
+	void flush_all();
+
+	static std::atomic<uint64_t> next_id;
+	// Tells apart writers (even at the same address) in the per-thread cache
+	uint64_t id;
+	AsyncFileIO file;
+	bool compressed;
+	size_t block_records;
+	int trial = 0;
+	std::mutex mutex;
+	std::vector<std::unique_ptr<TraceColumns>> buffers;
+	uint64_t records_written = 0, bytes_written = 0;
+	bool closed = false;
+};
+
+// Traces the infections handed to it by the run loop (see observers.h)
+struct TraceObserver {
+	TraceWriter* writer = NULL;
+	bool active() const {
+		return writer != NULL;
+	}
+	void on_infections(const InfectionBatch& batch) {
+		writer->record(batch);
+	}
+};
+
+// A block read back from a trace
+struct TraceBlock {
+	int trial = 0;
+	std::vector<double> time;
+	std::vector<uint64_t> step;
+	std::vector<int32_t> infector, infected;
+};
+
+// Reads a trace block by block, eg for tests and tools; analysis is meant for util/read_trace.py
+class TraceReader {
+public:
+	TraceReader(const std::string& filename);
+	~TraceReader();
+
+	bool is_open() const {
+		return file != NULL;
+	}
+	// Returns false at the end of the trace; throws on a corrupt one
+	bool next(TraceBlock& block);
+	// The entities' input ids, once read past (empty if the trace has none)
+	const std::vector<int64_t>& original_ids() const {
+		return ids;
+	}
+
+private:
+	FILE* file = NULL;
+	std::vector<char> payload, raw;
+	std::vector<int64_t> ids;
+};
+
+#endif /* TRACE_H_ */
@@ -0,0 +1,161 @@
+#!/usr/bin/env python
+"""
+Reads infection traces written by 'infectsim --trace FILE' (see src/trace.h).
+
+Uncompressed blocks are NumPy views straight into an mmap of the file, so nothing is
+copied until used. Blocks written with --lz are decompressed here, in pure Python, which
+is far slower than reading uncompressed traces.
+
+    import read_trace
+    t = read_trace.load("run.trace")          # dict of concatenated columns
+    t["infected_id"]                          # the same, as ids of the imported input
+    for block in read_trace.blocks("run.trace"):
+        print(block["trial"], block["infected"][:10])
+
+Run directly for a per-trial summary.
+"""
+
+import sys
+
+import numpy as np
+
+MAGIC = b"INFSTRC1"
+BLOCK_MAGIC = b"BLK\0"
+VERSIONS = (1, 2)
+BYTE_ORDER = 0x01020304
+LZ = 1
+IDS = 2
+
+HEADER = np.dtype([("magic", "S8"), ("byte_order", "<u4"), ("version", "<u4"),
+                   ("header_size", "<u4"), ("block_header_size", "<u4"), ("reserved", "<u8")])
+BLOCK_HEADER = np.dtype([("magic", "S4"), ("flags", "u4"), ("trial", "u4"), ("n_records", "u4"),
+                         ("payload_size", "u8"), ("raw_size", "u8")])
+COLUMNS = [("time", "f8"), ("step", "u8"), ("infector", "i4"), ("infected", "i4")]
+RECORD_SIZE = sum(np.dtype(t).itemsize for _, t in COLUMNS)
+
+
+def lz_decompress(src, raw_size):
+    """The inverse of lz_compress in src/libs/BlockCompress.cpp."""
+    src = bytes(src)
+    out = bytearray()
+    i, n = 0, len(src)
+    while i < n:
+        token = src[i]
+        i += 1
+        n_literals = token >> 4
+        if n_literals == 15:
+            while True:
+                b = src[i]
+                i += 1
+                n_literals += b
+                if b != 255:
+                    break
+        out += src[i:i + n_literals]
+        i += n_literals
+        if i == n:
+            break
+        offset = src[i] | (src[i + 1] << 8)
+        i += 2
+        length = token & 15
+        if length == 15:
+            while True:
+                b = src[i]
+                i += 1
+                length += b
+                if b != 255:
+                    break
+        length += 4
+        start = len(out) - offset
+        if offset >= length:
+            out += out[start:start + length]
+        else:
+            # Overlapping, ie a repeating pattern
+            for k in range(length):
+                out.append(out[start + k])
+    if len(out) != raw_size:
+        raise ValueError("corrupt compressed trace block")
+    return out
+
+
+def _byte_order(data):
+    """Returns the byte order prefix the trace was written in."""
+    header = np.frombuffer(data, HEADER, count=1)[0]
+    if header["magic"] != MAGIC:
+        raise ValueError("not an infectsim trace")
+    for prefix in "<>":
+        header = np.frombuffer(data, HEADER.newbyteorder(prefix), count=1)[0]
+        if header["byte_order"] == BYTE_ORDER:
+            if header["version"] not in VERSIONS or header["header_size"] != HEADER.itemsize \
+                    or header["block_header_size"] != BLOCK_HEADER.itemsize:
+                raise ValueError("unsupported trace version %d" % header["version"])
+            return prefix
+    raise ValueError("unknown byte order")
+
+
+def _all_blocks(filename):
+    """Yields (flags, n_records, raw payload, byte order, header) for every block."""
+    data = np.memmap(filename, dtype=np.uint8, mode="r")
+    order = _byte_order(data)
+    block_header = BLOCK_HEADER.newbyteorder(order)
+    pos = HEADER.itemsize
+    while pos < len(data):
+        h = np.frombuffer(data, block_header, count=1, offset=pos)[0]
+        if h["magic"] != BLOCK_MAGIC.rstrip(b"\0"):
+            raise ValueError("corrupt trace block at offset %d" % pos)
+        pos += BLOCK_HEADER.itemsize
+        n, payload_size = int(h["n_records"]), int(h["payload_size"])
+        payload = data[pos:pos + payload_size]
+        pos += (payload_size + 7) & ~7
+        if h["flags"] & LZ:
+            payload = lz_decompress(payload, int(h["raw_size"]))
+        yield int(h["flags"]), n, payload, order, h
+
+
+def original_ids(filename):
+    """Returns the input id of every entity, or None if the network was not imported or reordered."""
+    for flags, n, payload, order, _ in _all_blocks(filename):
+        if flags & IDS:
+            return np.frombuffer(payload, np.dtype("i8").newbyteorder(order), count=n)
+    return None
+
+
+def blocks(filename):
+    """Yields each block of records as a dict of 'trial' and the column arrays."""
+    for flags, n, payload, order, h in _all_blocks(filename):
+        if flags & IDS:
+            continue
+        block = {"trial": int(h["trial"])}
+        offset = 0
+        for name, t in COLUMNS:
+            dtype = np.dtype(t).newbyteorder(order)
+            block[name] = np.frombuffer(payload, dtype, count=n, offset=offset)
+            offset += n * dtype.itemsize
+        yield block
+
+
+def load(filename):
+    """Returns every column (and 'trial') concatenated over all blocks. For an imported or
+    reordered network, 'infector_id' and 'infected_id' also give the entities' input ids
+    (-1 for the infector of a seed)."""
+    parts = list(blocks(filename))
+    result = {}
+    for name, t in COLUMNS:
+        result[name] = np.concatenate([b[name] for b in parts]) if parts else np.zeros(0, t)
+    result["trial"] = np.concatenate([np.full(len(b["time"]), b["trial"], np.uint32) for b in parts]) \
+        if parts else np.zeros(0, np.uint32)
+    ids = original_ids(filename)
+    if ids is not None:
+        result["infected_id"] = ids[result["infected"]]
+        result["infector_id"] = np.where(result["infector"] < 0, -1, ids[np.maximum(result["infector"], 0)])
+    return result
+
+
+if __name__ == "__main__":
+    if len(sys.argv) != 2:
+        sys.exit("Usage: %s TRACE" % sys.argv[0])
+    t = load(sys.argv[1])
+    for trial in np.unique(t["trial"]):
+        mask = t["trial"] == trial
+        seeds = np.count_nonzero(t["infector"][mask] < 0)
+        print("trial %d: %d infections (%d seeded), last at t=%.3f, step %d" % (
+            trial, np.count_nonzero(mask), seeds, t["time"][mask].max(), t["step"][mask].max()))